@@ -37,11 +37,15 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <xf86drm.h>
 #include <wayland-client.h>
+#include <wayland-server-core.h>
 #include "wayland-kms-auth.h"
 #include "wayland-kms-client-protocol.h"
+#include "wayland-kms-format.h"
 
 #if defined(DEBUG)
 #	define WLKMS_DEBUG(s, x...) { printf(s, ##x); }
@@ -49,38 +53,160 @@
 #	define WLKMS_DEBUG(s, x...) { }
 #endif
 
+struct kms_auth_request {
+	struct wl_list link;		/* kms_auth::pending */
+	uint32_t magic;
+	kms_auth_done_func_t done;
+	void *data;
+};
+
 struct kms_auth {
 	struct wl_display *wl_display;	/* wl_display facing my server */
+	struct wl_display *wl_display_wrapper;
 	struct wl_event_queue *wl_queue;
 	struct wl_registry *wl_registry;
 	struct wl_kms *wl_kms;
-	int authenticated;
+
+	struct wl_event_source *source;	/* upstream fd on our event loop */
+	uint32_t source_mask;
+	struct wl_list pending;		/* in-flight requests, oldest first */
+	int dead;			/* the upstream connection failed */
+
+	struct wl_array formats;	/* uint32_t, as advertised upstream */
+
+	/* the wl_kms globals of the server, until we picked ours */
+	struct wl_array globals;	/* struct kms_auth_global */
+	dev_t nodes[3];			/* of our device */
+	int num_nodes;
+};
+
+/* A wl_kms global of the server, bound to see its device if need be */
+struct kms_auth_global {
+	struct kms_auth *auth;
+	uint32_t name, version;
+	struct wl_kms *probe;
+	int match;			/* it is our device */
+};
+
+/* A buffer of ours, forwarded to our server */
+struct kms_auth_buffer {
+	struct kms_auth *auth;
+	struct wl_buffer *wl_buffer;
+	kms_auth_release_func_t release;
+	void *data;
 };
 
 
 /*
  * For the nested authentication
+ *
+ * Requests are pipelined to the upstream server. Our server answers
+ * them strictly in order, either with an authenticated event or with a
+ * protocol error which ends the connection. So the oldest pending
+ * request is the one each authenticated event refers to.
  */
 
+static void kms_auth_complete(struct kms_auth_request *req, int result)
+{
+	wl_list_remove(&req->link);
+	if (req->done)
+		req->done(req->data, result);
+	free(req);
+}
+
+static void kms_auth_fail_all(struct kms_auth *auth)
+{
+	struct kms_auth_request *req, *tmp;
+
+	wl_list_for_each_safe(req, tmp, &auth->pending, link)
+		kms_auth_complete(req, -1);
+}
+
 static void wayland_kms_handle_authenticated(void *data, struct wl_kms *kms)
 {
 	struct kms_auth *auth = data;
+	struct kms_auth_request *req;
+
 	WLKMS_DEBUG("%s: %s: %d: authenticated.\n", __FILE__, __func__, __LINE__);
-	auth->authenticated = 1;
+
+	if (wl_list_empty(&auth->pending))
+		return;
+
+	req = wl_container_of(auth->pending.next, req, link);
+	kms_auth_complete(req, 0);
+}
+
+static void kms_auth_add_format(struct kms_auth *auth, uint32_t format)
+{
+	uint32_t *f;
+
+	wl_array_for_each(f, &auth->formats) {
+		if (*f == format)
+			return;
+	}
+
+	if ((f = wl_array_add(&auth->formats, sizeof *f)))
+		*f = format;
 }
 
 static void wayland_kms_handle_format(void *data, struct wl_kms *kms, uint32_t format)
 {
+	kms_auth_add_format(data, format);
 }
 
 static void wayland_kms_handle_device(void *data, struct wl_kms *kms, const char *device)
 {
 }
 
+static void wayland_kms_handle_format_table(void *data, struct wl_kms *kms,
+					    int32_t fd, uint32_t size)
+{
+	struct kms_format_table_entry *entries;
+	uint32_t i;
+
+	entries = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (entries == MAP_FAILED)
+		return;
+
+	for (i = 0; i < size / sizeof *entries; i++)
+		kms_auth_add_format(data, entries[i].format);
+
+	munmap(entries, size);
+}
+
+static void wayland_kms_handle_scanout_hint(void *data, struct wl_kms *kms,
+					    struct wl_buffer *buffer, uint32_t format,
+					    int32_t width, int32_t height)
+{
+}
+
+static void wayland_kms_handle_plane(void *data, struct wl_kms *kms,
+				     struct wl_buffer *buffer, int32_t fd,
+				     uint32_t offset, uint32_t stride)
+{
+	close(fd);
+}
+
+static void wayland_kms_handle_allocated(void *data, struct wl_kms *kms,
+					 struct wl_buffer *buffer)
+{
+}
+
+static void wayland_kms_handle_allocation_failed(void *data, struct wl_kms *kms,
+						 struct wl_buffer *buffer)
+{
+}
+
 static const struct wl_kms_listener wayland_kms_listener = {
 	.authenticated = wayland_kms_handle_authenticated,
 	.format = wayland_kms_handle_format,
-	.device = wayland_kms_handle_device
+	.device = wayland_kms_handle_device,
+	.format_table = wayland_kms_handle_format_table,
+	.scanout_hint = wayland_kms_handle_scanout_hint,
+	.plane = wayland_kms_handle_plane,
+	.allocated = wayland_kms_handle_allocated,
+	.allocation_failed = wayland_kms_handle_allocation_failed,
 };
 
 /*
@@ -91,17 +217,27 @@ static void wayland_registry_handle_global(void *data, struct wl_registry *regis
 		                                           uint32_t name, const char *interface, uint32_t version)
 {
 	struct kms_auth *auth = data;
+	struct kms_auth_global *global;
 
 	WLKMS_DEBUG("%s: %s: %d\n", __FILE__, __func__, __LINE__);
 
 	/*
-	 * we need to connect to the wl_kms objects
+	 * we need to connect to the wl_kms object of our device; the
+	 * candidates are sorted out by kms_auth_bind()
 	 */
-	if (!strcmp(interface, "wl_kms")) {
-		auth->wl_kms = wl_registry_bind(registry, name, &wl_kms_interface, version);
-		if (wl_kms_add_listener(auth->wl_kms, &wayland_kms_listener, auth) < 0)
-			WLKMS_DEBUG("%s: %s: %d: already added listener\n", __FILE__, __func__, __LINE__);
-	}
+	if (auth->wl_kms || strcmp(interface, "wl_kms"))
+		return;
+
+	if (!(global = wl_array_add(&auth->globals, sizeof *global)))
+		return;
+
+	if (version > (uint32_t)wl_kms_interface.version)
+		version = wl_kms_interface.version;
+	global->auth = auth;
+	global->name = name;
+	global->version = version;
+	global->probe = NULL;
+	global->match = 0;
 }
 
 static void wayland_registry_handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
@@ -113,23 +249,383 @@ static const struct wl_registry_listener wayland_registry_listener = {
 	.global_remove = wayland_registry_handle_global_remove,
 };
 
-int
-kms_auth_request(struct kms_auth *auth, uint32_t magic)
+/* The nodes of our device, to find its wl_kms among those of the server */
+static void kms_auth_get_nodes(struct kms_auth *auth, int fd)
+{
+	struct stat st;
+	char *name;
+	int i;
+
+	if (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode))
+		auth->nodes[auth->num_nodes++] = st.st_rdev;
+
+	for (i = 0; i < 2; i++) {
+		name = i ? drmGetRenderDeviceNameFromFd(fd) :
+			   drmGetPrimaryDeviceNameFromFd(fd);
+		if (name && stat(name, &st) == 0)
+			auth->nodes[auth->num_nodes++] = st.st_rdev;
+		free(name);
+	}
+}
+
+static void kms_auth_probe_device(void *data, struct wl_kms *kms, const char *device)
 {
+	struct kms_auth_global *global = data;
+	struct kms_auth *auth = global->auth;
+	struct stat st;
+	int i;
+
+	if (stat(device, &st) < 0)
+		return;
+
+	for (i = 0; i < auth->num_nodes; i++) {
+		if (st.st_rdev == auth->nodes[i])
+			global->match = 1;
+	}
+}
+
+static void kms_auth_probe_format(void *data, struct wl_kms *kms, uint32_t format)
+{
+}
+
+static void kms_auth_probe_format_table(void *data, struct wl_kms *kms,
+					int32_t fd, uint32_t size)
+{
+	close(fd);
+}
+
+static void kms_auth_probe_authenticated(void *data, struct wl_kms *kms)
+{
+}
+
+static const struct wl_kms_listener kms_auth_probe_listener = {
+	.authenticated = kms_auth_probe_authenticated,
+	.format = kms_auth_probe_format,
+	.device = kms_auth_probe_device,
+	.format_table = kms_auth_probe_format_table,
+	.scanout_hint = wayland_kms_handle_scanout_hint,
+	.plane = wayland_kms_handle_plane,
+	.allocated = wayland_kms_handle_allocated,
+	.allocation_failed = wayland_kms_handle_allocation_failed,
+};
+
+/*
+ * Binds the wl_kms of the server for our device. With several of them,
+ * each is bound once to see its device, then let go but for ours, or
+ * the first one if none matches.
+ */
+static int kms_auth_bind(struct kms_auth *auth)
+{
+	struct kms_auth_global *global, *chosen = NULL;
+	int ret = 0;
+
+	if (auth->globals.size == 0)
+		return 0;
+
+	if (auth->globals.size > sizeof *global) {
+		wl_array_for_each(global, &auth->globals) {
+			global->probe = wl_registry_bind(auth->wl_registry, global->name,
+							 &wl_kms_interface, global->version);
+			if (global->probe)
+				wl_kms_add_listener(global->probe, &kms_auth_probe_listener,
+						    global);
+		}
+
+		ret = wl_display_roundtrip_queue(auth->wl_display, auth->wl_queue);
+
+		wl_array_for_each(global, &auth->globals) {
+			if (global->match && !chosen)
+				chosen = global;
+			if (global->probe)
+				wl_kms_destroy(global->probe);
+		}
+		if (ret < 0)
+			return -1;
+	}
+
+	if (!chosen)
+		chosen = auth->globals.data;
+
+	auth->wl_kms = wl_registry_bind(auth->wl_registry, chosen->name,
+					&wl_kms_interface, chosen->version);
 	if (!auth->wl_kms)
 		return -1;
+	wl_kms_add_listener(auth->wl_kms, &wayland_kms_listener, auth);
+
+	/* no more use for the others */
+	wl_array_release(&auth->globals);
+	wl_array_init(&auth->globals);
+
+	/* gets the formats */
+	return wl_display_roundtrip_queue(auth->wl_display, auth->wl_queue);
+}
+
+static void kms_auth_update_mask(struct kms_auth *auth, uint32_t mask)
+{
+	if (!auth->source || auth->source_mask == mask)
+		return;
+
+	wl_event_source_fd_update(auth->source, mask);
+	auth->source_mask = mask;
+}
+
+static int kms_auth_flush(struct kms_auth *auth)
+{
+	if (wl_display_flush(auth->wl_display) < 0) {
+		if (errno != EAGAIN)
+			return -1;
+
+		/* finish the write once the socket drains */
+		kms_auth_update_mask(auth, WL_EVENT_READABLE | WL_EVENT_WRITABLE);
+		return 0;
+	}
+
+	kms_auth_update_mask(auth, WL_EVENT_READABLE);
+	return 0;
+}
+
+static int kms_auth_read(struct kms_auth *auth)
+{
+	while (wl_display_prepare_read_queue(auth->wl_display, auth->wl_queue) != 0) {
+		if (wl_display_dispatch_queue_pending(auth->wl_display, auth->wl_queue) < 0)
+			return -1;
+	}
+
+	if (wl_display_read_events(auth->wl_display) < 0 && errno != EAGAIN)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Gives up on the upstream connection. Its fd stays readable or hung up
+ * for good, so it leaves the event loop, or the loop would spin on it.
+ */
+static void kms_auth_fail(struct kms_auth *auth)
+{
+	WLKMS_DEBUG("%s: %s: %d: upstream connection failed.\n", __FILE__, __func__, __LINE__);
+
+	auth->dead = 1;
+	if (auth->source) {
+		wl_event_source_remove(auth->source);
+		auth->source = NULL;
+	}
+
+	kms_auth_fail_all(auth);
+}
+
+/*
+ * Called when the upstream connection is readable or writable, and
+ * once per event loop iteration (mask 0) to pick up replies that
+ * another reader of the same connection already queued for us.
+ */
+static int kms_auth_handle_event(int fd, uint32_t mask, void *data)
+{
+	struct kms_auth *auth = data;
+
+	if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR))
+		goto error;
+
+	if ((mask & WL_EVENT_WRITABLE) && kms_auth_flush(auth) < 0)
+		goto error;
+
+	if ((mask & WL_EVENT_READABLE) && kms_auth_read(auth) < 0)
+		goto error;
+
+	if (wl_display_dispatch_queue_pending(auth->wl_display, auth->wl_queue) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	kms_auth_fail(auth);
+	return 0;
+}
+
+struct kms_auth_request*
+kms_auth_request(struct kms_auth *auth, uint32_t magic,
+		 kms_auth_done_func_t done, void *data)
+{
+	struct kms_auth_request *req;
+
+	if (auth->dead || !auth->wl_kms || wl_display_get_error(auth->wl_display))
+		return NULL;
+
+	if (!(req = calloc(1, sizeof(struct kms_auth_request))))
+		return NULL;
+
+	req->magic = magic;
+	req->done = done;
+	req->data = data;
+	wl_list_insert(auth->pending.prev, &req->link);
 
-	auth->authenticated = 0;
 	wl_kms_authenticate(auth->wl_kms, magic);
 
-	if (wl_display_roundtrip_queue(auth->wl_display, auth->wl_queue) < 0 || !auth->authenticated)
+	if (kms_auth_flush(auth) < 0) {
+		wl_list_remove(&req->link);
+		free(req);
+		return NULL;
+	}
+
+	return req;
+}
+
+void
+kms_auth_cancel(struct kms_auth_request *req)
+{
+	/* the reply is still consumed in order; just drop the callback */
+	req->done = NULL;
+	req->data = NULL;
+}
+
+int
+kms_auth_dispatch(struct kms_auth *auth)
+{
+	if (auth->dead)
+		return -1;
+
+	if (wl_display_dispatch_queue(auth->wl_display, auth->wl_queue) < 0) {
+		kms_auth_fail(auth);
 		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * For forwarding buffers
+ *
+ * The planes are sent with the fds we hold; libwayland sends copies.
+ * Release events come on our queue, like the authentication replies.
+ */
+
+static void kms_auth_buffer_handle_release(void *data, struct wl_buffer *buffer)
+{
+	struct kms_auth_buffer *ab = data;
+
+	if (ab->release)
+		ab->release(ab->data);
+}
+
+static const struct wl_buffer_listener kms_auth_buffer_listener = {
+	.release = kms_auth_buffer_handle_release,
+};
+
+static int kms_auth_has_format(struct kms_auth *auth, uint32_t format)
+{
+	uint32_t *f;
+
+	wl_array_for_each(f, &auth->formats) {
+		if (*f == format)
+			return 1;
+	}
 
 	return 0;
 }
 
+/*
+ * Creates a wl_buffer of our server with the given planes; fds,
+ * offsets and strides hold 4 entries, those past num_planes unused.
+ * release is called each time the server releases it.
+ */
+struct kms_auth_buffer *
+kms_auth_buffer_create(struct kms_auth *auth, int32_t width, int32_t height,
+		       uint32_t format, int num_planes, const int32_t *fds,
+		       const uint32_t *offsets, const uint32_t *strides,
+		       kms_auth_release_func_t release, void *data)
+{
+	struct kms_auth_buffer *ab;
+	int32_t f[4];
+	int i;
+
+	/* a buffer the server refuses would be a protocol error, fatal to us */
+	if (auth->dead || !auth->wl_kms || wl_display_get_error(auth->wl_display) ||
+	    !kms_auth_has_format(auth, format) || num_planes > 4)
+		return NULL;
+
+	/* older servers take one dma-buf per plane, starting at its beginning */
+	if (wl_kms_get_version(auth->wl_kms) < 7) {
+		if (num_planes > 3)
+			return NULL;
+		for (i = 0; i < num_planes; i++) {
+			if (offsets[i])
+				return NULL;
+		}
+	}
+
+	if (!(ab = calloc(1, sizeof(struct kms_auth_buffer))))
+		return NULL;
+
+	ab->auth = auth;
+	ab->release = release;
+	ab->data = data;
+
+	/* the server ignores the fds of the planes the format doesn't have */
+	for (i = 0; i < 4; i++)
+		f[i] = i < num_planes ? fds[i] : fds[0];
+
+	if (wl_kms_get_version(auth->wl_kms) >= 7)
+		ab->wl_buffer = wl_kms_create_planar_buffer(auth->wl_kms, width, height, format,
+							    f[0], offsets[0], strides[0],
+							    f[1], offsets[1], strides[1],
+							    f[2], offsets[2], strides[2],
+							    f[3], offsets[3], strides[3]);
+	else
+		ab->wl_buffer = wl_kms_create_mp_buffer(auth->wl_kms, width, height, format,
+							f[0], strides[0],
+							f[1], strides[1],
+							f[2], strides[2]);
+
+	if (!ab->wl_buffer) {
+		free(ab);
+		return NULL;
+	}
+	wl_buffer_add_listener(ab->wl_buffer, &kms_auth_buffer_listener, ab);
+
+	if (kms_auth_flush(ab->auth) < 0) {
+		kms_auth_buffer_destroy(ab);
+		return NULL;
+	}
+
+	return ab;
+}
+
+struct wl_buffer *
+kms_auth_buffer_get(struct kms_auth_buffer *ab)
+{
+	return ab->wl_buffer;
+}
+
+/* Passes an acquire fence for the next commit of the buffer on; not consumed */
+int
+kms_auth_buffer_set_fence(struct kms_auth_buffer *ab, int fence)
+{
+	if (wl_kms_get_version(ab->auth->wl_kms) < 5)
+		return -1;
+
+	wl_kms_set_acquire_fence(ab->auth->wl_kms, ab->wl_buffer, fence);
+	return kms_auth_flush(ab->auth);
+}
+
+int
+kms_auth_can_fence(struct kms_auth *auth)
+{
+	return auth->wl_kms && wl_kms_get_version(auth->wl_kms) >= 5;
+}
+
+void
+kms_auth_buffer_destroy(struct kms_auth_buffer *ab)
+{
+	if (!ab)
+		return;
+
+	wl_buffer_destroy(ab->wl_buffer);
+	kms_auth_flush(ab->auth);
+	free(ab);
+}
+
 struct kms_auth*
-kms_auth_init(struct wl_display *display)
+kms_auth_init(struct wl_display *display, struct wl_event_loop *loop, int fd)
 {
 	struct kms_auth *auth;
 
@@ -137,15 +633,37 @@ kms_auth_init(struct wl_display *display)
 		return NULL;
 
 	auth->wl_display = display;
+	wl_list_init(&auth->pending);
+	wl_array_init(&auth->formats);
+	wl_array_init(&auth->globals);
+	kms_auth_get_nodes(auth, fd);
 
 	auth->wl_queue = wl_display_create_queue(auth->wl_display);
-	auth->wl_registry = wl_display_get_registry(auth->wl_display);
-	wl_proxy_set_queue((struct wl_proxy*)auth->wl_registry, auth->wl_queue);
+	if (!auth->wl_queue)
+		goto error;
+
+	/* create our proxies directly on our queue */
+	auth->wl_display_wrapper = wl_proxy_create_wrapper(auth->wl_display);
+	if (!auth->wl_display_wrapper)
+		goto error;
+	wl_proxy_set_queue((struct wl_proxy*)auth->wl_display_wrapper, auth->wl_queue);
+
+	auth->wl_registry = wl_display_get_registry(auth->wl_display_wrapper);
+	if (!auth->wl_registry)
+		goto error;
 	if (wl_registry_add_listener(auth->wl_registry, &wayland_registry_listener, auth) < 0)
 		goto error;
 
-	if (wl_display_roundtrip_queue(auth->wl_display, auth->wl_queue) < 0)
+	if (wl_display_roundtrip_queue(auth->wl_display, auth->wl_queue) < 0 ||
+	    kms_auth_bind(auth) < 0)
+		goto error;
+
+	auth->source_mask = WL_EVENT_READABLE;
+	auth->source = wl_event_loop_add_fd(loop, wl_display_get_fd(auth->wl_display),
+					    auth->source_mask, kms_auth_handle_event, auth);
+	if (!auth->source)
 		goto error;
+	wl_event_source_check(auth->source);
 
 	return auth;
 
@@ -157,14 +675,32 @@ error:
 void
 kms_auth_uninit(struct kms_auth *auth)
 {
+	struct kms_auth_request *req, *tmp;
+
 	if (!auth)
 		return;
 
+	if (auth->source)
+		wl_event_source_remove(auth->source);
+
+	wl_list_for_each_safe(req, tmp, &auth->pending, link) {
+		wl_list_remove(&req->link);
+		free(req);
+	}
+
 	if (auth->wl_kms)
 		wl_kms_destroy(auth->wl_kms);
 
 	if (auth->wl_registry)
 		wl_registry_destroy(auth->wl_registry);
 
+	if (auth->wl_display_wrapper)
+		wl_proxy_wrapper_destroy(auth->wl_display_wrapper);
+
+	if (auth->wl_queue)
+		wl_event_queue_destroy(auth->wl_queue);
+
+	wl_array_release(&auth->globals);
+	wl_array_release(&auth->formats);
 	free(auth);
 }
@@ -2,9 +2,35 @@
 #define WAYLAND_KMS_AUTH_H
 
 struct kms_auth;
+struct kms_auth_request;
+struct wl_event_loop;
 
-extern struct kms_auth *kms_auth_init(struct wl_display *display);
+/* result is 0 if authenticated, -1 otherwise */
+typedef void (*kms_auth_done_func_t)(void *data, int result);
+
+/* Talks to the wl_kms of display for the device fd is open on */
+extern struct kms_auth *kms_auth_init(struct wl_display *display,
+				      struct wl_event_loop *loop, int fd);
 extern void kms_auth_uninit(struct kms_auth *auth);
-extern int kms_auth_request(struct kms_auth *auth, uint32_t magic);
+extern struct kms_auth_request *kms_auth_request(struct kms_auth *auth, uint32_t magic,
+						 kms_auth_done_func_t done, void *data);
+extern void kms_auth_cancel(struct kms_auth_request *req);
+extern int kms_auth_dispatch(struct kms_auth *auth);
+
+/* Buffers forwarded to the server we authenticate with */
+struct kms_auth_buffer;
+struct wl_buffer;
+
+typedef void (*kms_auth_release_func_t)(void *data);
+
+extern struct kms_auth_buffer *
+kms_auth_buffer_create(struct kms_auth *auth, int32_t width, int32_t height,
+		       uint32_t format, int num_planes, const int32_t *fds,
+		       const uint32_t *offsets, const uint32_t *strides,
+		       kms_auth_release_func_t release, void *data);
+extern struct wl_buffer *kms_auth_buffer_get(struct kms_auth_buffer *ab);
+extern int kms_auth_can_fence(struct kms_auth *auth);
+extern int kms_auth_buffer_set_fence(struct kms_auth_buffer *ab, int fence);
+extern void kms_auth_buffer_destroy(struct kms_auth_buffer *ab);
 
 #endif
@@ -0,0 +1,696 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <xf86drm.h>
+#include <wayland-client.h>
+#include "wayland-kms-client.h"
+#include "wayland-kms-client-protocol.h"
+#include "wayland-kms-format.h"
+
+#if defined(DEBUG)
+#	define WLKMS_DEBUG(s, x...) { printf(s, ##x); }
+#else
+#	define WLKMS_DEBUG(s, x...) { }
+#endif
+
+/* acquires over which an image must stay spare before it is dropped */
+#define KMS_SWAPCHAIN_WINDOW	120
+
+struct wl_kms_connection {
+	struct wl_display *display;
+	struct wl_event_queue *queue;	/* for the setup round trips */
+	struct wl_kms *wl_kms;
+
+	char *device;
+	struct wl_array formats;	/* uint32_t, as advertised */
+	int authenticated;
+
+	int fd;				/* the device advertised */
+	int dumb_fd;			/* its primary node, for dumb buffers */
+};
+
+struct wl_kms_swapchain {
+	struct wl_kms_connection *conn;
+	struct wl_kms_allocator allocator;
+
+	int32_t width, height;
+	uint32_t format;
+
+	struct wl_list images;		/* kms_image::link, least recently acquired first */
+	int count;
+	int min_images, max_images;
+
+	/* fewest images left free by an acquire within the window */
+	int acquires;
+	int min_spare;
+};
+
+struct kms_image {
+	struct wl_kms_image base;
+	struct wl_kms_swapchain *swapchain;
+	struct wl_list link;
+	int busy;			/* acquired, or held by the compositor */
+
+	/* dumb buffer backing */
+	uint32_t handles[WL_KMS_IMAGE_MAX_PLANES];
+	uint64_t sizes[WL_KMS_IMAGE_MAX_PLANES];
+};
+
+/*
+ * wl_kms events
+ */
+
+static void kms_connection_add_format(struct wl_kms_connection *conn, uint32_t format)
+{
+	uint32_t *f;
+
+	wl_array_for_each(f, &conn->formats) {
+		if (*f == format)
+			return;
+	}
+
+	if ((f = wl_array_add(&conn->formats, sizeof *f)))
+		*f = format;
+}
+
+static void wayland_kms_handle_device(void *data, struct wl_kms *kms, const char *device)
+{
+	struct wl_kms_connection *conn = data;
+
+	free(conn->device);
+	conn->device = strdup(device);
+}
+
+static void wayland_kms_handle_format(void *data, struct wl_kms *kms, uint32_t format)
+{
+	kms_connection_add_format(data, format);
+}
+
+static void wayland_kms_handle_authenticated(void *data, struct wl_kms *kms)
+{
+	struct wl_kms_connection *conn = data;
+
+	WLKMS_DEBUG("%s: %s: %d: authenticated.\n", __FILE__, __func__, __LINE__);
+	conn->authenticated = 1;
+}
+
+static void wayland_kms_handle_format_table(void *data, struct wl_kms *kms,
+					    int32_t fd, uint32_t size)
+{
+	struct kms_format_table_entry *entries;
+	uint32_t i;
+
+	entries = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (entries == MAP_FAILED)
+		return;
+
+	for (i = 0; i < size / sizeof *entries; i++)
+		kms_connection_add_format(data, entries[i].format);
+
+	munmap(entries, size);
+}
+
+static void wayland_kms_handle_scanout_hint(void *data, struct wl_kms *kms,
+					    struct wl_buffer *buffer, uint32_t format,
+					    int32_t width, int32_t height)
+{
+}
+
+static void wayland_kms_handle_plane(void *data, struct wl_kms *kms,
+				     struct wl_buffer *buffer, int32_t fd,
+				     uint32_t offset, uint32_t stride)
+{
+	close(fd);
+}
+
+static void wayland_kms_handle_allocated(void *data, struct wl_kms *kms,
+					 struct wl_buffer *buffer)
+{
+}
+
+static void wayland_kms_handle_allocation_failed(void *data, struct wl_kms *kms,
+						 struct wl_buffer *buffer)
+{
+}
+
+static const struct wl_kms_listener wayland_kms_listener = {
+	.device = wayland_kms_handle_device,
+	.format = wayland_kms_handle_format,
+	.authenticated = wayland_kms_handle_authenticated,
+	.format_table = wayland_kms_handle_format_table,
+	.scanout_hint = wayland_kms_handle_scanout_hint,
+	.plane = wayland_kms_handle_plane,
+	.allocated = wayland_kms_handle_allocated,
+	.allocation_failed = wayland_kms_handle_allocation_failed,
+};
+
+static void wayland_registry_handle_global(void *data, struct wl_registry *registry,
+					   uint32_t name, const char *interface, uint32_t version)
+{
+	struct wl_kms_connection *conn = data;
+
+	if (strcmp(interface, "wl_kms") || conn->wl_kms)
+		return;
+
+	if (version > (uint32_t)wl_kms_interface.version)
+		version = wl_kms_interface.version;
+	conn->wl_kms = wl_registry_bind(registry, name, &wl_kms_interface, version);
+	wl_kms_add_listener(conn->wl_kms, &wayland_kms_listener, conn);
+}
+
+static void wayland_registry_handle_global_remove(void *data, struct wl_registry *registry,
+						  uint32_t name)
+{
+}
+
+static const struct wl_registry_listener wayland_registry_listener = {
+	.global = wayland_registry_handle_global,
+	.global_remove = wayland_registry_handle_global_remove,
+};
+
+/*
+ * Connection
+ */
+
+static int kms_connection_authenticate(struct wl_kms_connection *conn, int fd)
+{
+	drm_magic_t magic;
+	int ret = 0;
+
+	if (drmGetMagic(fd, &magic))
+		return -1;
+
+	/* wait for the answer on our own queue; a failure is a protocol error */
+	wl_proxy_set_queue((struct wl_proxy *)conn->wl_kms, conn->queue);
+
+	conn->authenticated = 0;
+	wl_kms_authenticate(conn->wl_kms, magic);
+	while (!conn->authenticated) {
+		if (wl_display_dispatch_queue(conn->display, conn->queue) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	wl_proxy_set_queue((struct wl_proxy *)conn->wl_kms, NULL);
+	return ret;
+}
+
+static int kms_connection_open(struct wl_kms_connection *conn, const char *device)
+{
+	int fd;
+
+	if ((fd = open(device, O_RDWR | O_CLOEXEC)) < 0) {
+		WLKMS_DEBUG("%s: %s: can't open %s (%s)\n", __FILE__, __func__,
+			    device, strerror(errno));
+		return -1;
+	}
+
+	if (drmGetNodeTypeFromFd(fd) != DRM_NODE_RENDER &&
+	    kms_connection_authenticate(conn, fd) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+struct wl_kms_connection *wayland_kms_connect(struct wl_display *display)
+{
+	struct wl_kms_connection *conn;
+	struct wl_display *wrapper = NULL;
+	struct wl_registry *registry = NULL;
+
+	if (!(conn = calloc(1, sizeof(struct wl_kms_connection))))
+		return NULL;
+
+	conn->display = display;
+	conn->fd = conn->dumb_fd = -1;
+	wl_array_init(&conn->formats);
+
+	if (!(conn->queue = wl_display_create_queue(display)))
+		goto error;
+	if (!(wrapper = wl_proxy_create_wrapper(display)))
+		goto error;
+	wl_proxy_set_queue((struct wl_proxy *)wrapper, conn->queue);
+
+	if (!(registry = wl_display_get_registry(wrapper)))
+		goto error;
+	wl_registry_add_listener(registry, &wayland_registry_listener, conn);
+
+	/* one round trip for the globals, one for the wl_kms events */
+	if (wl_display_roundtrip_queue(display, conn->queue) < 0 || !conn->wl_kms)
+		goto error;
+	if (wl_display_roundtrip_queue(display, conn->queue) < 0 || !conn->device)
+		goto error;
+
+	wl_registry_destroy(registry);
+	registry = NULL;
+	wl_proxy_wrapper_destroy(wrapper);
+	wrapper = NULL;
+
+	/* buffers created from now on get their release events on the default queue */
+	wl_proxy_set_queue((struct wl_proxy *)conn->wl_kms, NULL);
+
+	if ((conn->fd = kms_connection_open(conn, conn->device)) < 0)
+		goto error;
+
+	return conn;
+
+error:
+	if (registry)
+		wl_registry_destroy(registry);
+	if (wrapper)
+		wl_proxy_wrapper_destroy(wrapper);
+	wayland_kms_disconnect(conn);
+	return NULL;
+}
+
+void wayland_kms_disconnect(struct wl_kms_connection *conn)
+{
+	if (!conn)
+		return;
+
+	if (conn->dumb_fd >= 0 && conn->dumb_fd != conn->fd)
+		close(conn->dumb_fd);
+	if (conn->fd >= 0)
+		close(conn->fd);
+	if (conn->wl_kms)
+		wl_kms_destroy(conn->wl_kms);
+	if (conn->queue)
+		wl_event_queue_destroy(conn->queue);
+
+	wl_array_release(&conn->formats);
+	free(conn->device);
+	free(conn);
+}
+
+int wayland_kms_connection_get_fd(struct wl_kms_connection *conn)
+{
+	return conn->fd;
+}
+
+const char *wayland_kms_connection_get_device(struct wl_kms_connection *conn)
+{
+	return conn->device;
+}
+
+int wayland_kms_connection_has_format(struct wl_kms_connection *conn, uint32_t format)
+{
+	uint32_t *f;
+
+	wl_array_for_each(f, &conn->formats) {
+		if (*f == format)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Dumb buffers can't be created on a render node, so if the server
+ * advertised one, open the primary node of the same device.
+ */
+static int kms_connection_get_dumb_fd(struct wl_kms_connection *conn)
+{
+	char *primary;
+
+	if (conn->dumb_fd >= 0)
+		return conn->dumb_fd;
+
+	if (drmGetNodeTypeFromFd(conn->fd) != DRM_NODE_RENDER)
+		return conn->dumb_fd = conn->fd;
+
+	if (!(primary = drmGetPrimaryDeviceNameFromFd(conn->fd)))
+		return -1;
+
+	conn->dumb_fd = kms_connection_open(conn, primary);
+	free(primary);
+
+	return conn->dumb_fd;
+}
+
+/*
+ * Default allocator: a mapped dumb buffer per plane
+ */
+
+static void kms_dumb_free(void *data, struct wl_kms_image *base)
+{
+	struct wl_kms_connection *conn = data;
+	struct kms_image *image = wl_container_of(base, image, base);
+	struct drm_mode_destroy_dumb destroy_arg;
+	int i;
+
+	for (i = 0; i < base->num_planes; i++) {
+		if (base->data[i])
+			munmap(base->data[i], image->sizes[i]);
+		if (base->fds[i] >= 0)
+			close(base->fds[i]);
+		if (image->handles[i]) {
+			memset(&destroy_arg, 0, sizeof destroy_arg);
+			destroy_arg.handle = image->handles[i];
+			drmIoctl(conn->dumb_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
+		}
+	}
+}
+
+static int kms_dumb_alloc(void *data, struct wl_kms_image *base)
+{
+	struct wl_kms_connection *conn = data;
+	struct kms_image *image = wl_container_of(base, image, base);
+	const struct kms_format_info *info;
+	struct drm_mode_create_dumb create_arg;
+	struct drm_mode_map_dumb map_arg;
+	void *map;
+	int fd, i;
+
+	if (!(info = kms_format_get_info(base->format)))
+		return -1;
+	if ((fd = kms_connection_get_dumb_fd(conn)) < 0)
+		return -1;
+
+	for (i = 0; i < info->num_planes; i++) {
+		memset(&create_arg, 0, sizeof create_arg);
+		create_arg.bpp = info->cpp[i] * 8;
+		create_arg.width = base->width;
+		create_arg.height = base->height;
+		if (i > 0) {
+			create_arg.width = (base->width + info->hsub - 1) / info->hsub;
+			create_arg.height = (base->height + info->vsub - 1) / info->vsub;
+		}
+
+		if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg))
+			goto error;
+
+		base->num_planes = i + 1;
+		base->strides[i] = create_arg.pitch;
+		base->offsets[i] = 0;
+		image->handles[i] = create_arg.handle;
+		image->sizes[i] = create_arg.size;
+
+		if (drmPrimeHandleToFD(fd, create_arg.handle, DRM_CLOEXEC, &base->fds[i]))
+			goto error;
+
+		memset(&map_arg, 0, sizeof map_arg);
+		map_arg.handle = create_arg.handle;
+		if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map_arg))
+			goto error;
+
+		map = mmap(NULL, create_arg.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, map_arg.offset);
+		if (map == MAP_FAILED)
+			goto error;
+		base->data[i] = map;
+	}
+
+	return 0;
+
+error:
+	WLKMS_DEBUG("%s: %s: plane %d: %s\n", __FILE__, __func__, i, strerror(errno));
+	kms_dumb_free(data, base);
+	return -1;
+}
+
+/*
+ * Images
+ */
+
+static void kms_image_destroy(struct kms_image *image)
+{
+	struct wl_kms_swapchain *swapchain = image->swapchain;
+
+	if (image->base.buffer)
+		wl_buffer_destroy(image->base.buffer);
+	swapchain->allocator.free(swapchain->allocator.data, &image->base);
+
+	wl_list_remove(&image->link);
+	swapchain->count--;
+	free(image);
+}
+
+static void kms_image_handle_release(void *data, struct wl_buffer *buffer)
+{
+	struct kms_image *image = data;
+	struct wl_kms_swapchain *swapchain = image->swapchain;
+
+	image->busy = 0;
+
+	/* left over from before a resize */
+	if (image->base.width != swapchain->width ||
+	    image->base.height != swapchain->height)
+		kms_image_destroy(image);
+}
+
+static const struct wl_buffer_listener kms_image_buffer_listener = {
+	.release = kms_image_handle_release,
+};
+
+static struct wl_buffer *kms_image_create_buffer(struct wl_kms_connection *conn,
+						 struct wl_kms_image *image)
+{
+	int fds[WL_KMS_IMAGE_MAX_PLANES];
+	int i;
+
+	/* the server closes the fds of the planes the format doesn't have */
+	for (i = 0; i < WL_KMS_IMAGE_MAX_PLANES; i++)
+		fds[i] = i < image->num_planes ? image->fds[i] : image->fds[0];
+
+	if (wl_kms_get_version(conn->wl_kms) >= 7)
+		return wl_kms_create_planar_buffer(conn->wl_kms, image->width, image->height,
+						   image->format,
+						   fds[0], image->offsets[0], image->strides[0],
+						   fds[1], image->offsets[1], image->strides[1],
+						   fds[2], image->offsets[2], image->strides[2],
+						   fds[3], image->offsets[3], image->strides[3]);
+
+	/* older servers take one dma-buf per plane, starting at its beginning */
+	if (image->num_planes > 3)
+		return NULL;
+	for (i = 0; i < image->num_planes; i++) {
+		if (image->offsets[i])
+			return NULL;
+	}
+
+	return wl_kms_create_mp_buffer(conn->wl_kms, image->width, image->height,
+				       image->format,
+				       fds[0], image->strides[0],
+				       fds[1], image->strides[1],
+				       fds[2], image->strides[2]);
+}
+
+static struct kms_image *kms_image_create(struct wl_kms_swapchain *swapchain)
+{
+	struct kms_image *image;
+	int i;
+
+	if (!(image = calloc(1, sizeof(struct kms_image))))
+		return NULL;
+
+	image->swapchain = swapchain;
+	image->base.width = swapchain->width;
+	image->base.height = swapchain->height;
+	image->base.format = swapchain->format;
+	for (i = 0; i < WL_KMS_IMAGE_MAX_PLANES; i++)
+		image->base.fds[i] = -1;
+
+	if (swapchain->allocator.alloc(swapchain->allocator.data, &image->base) < 0) {
+		free(image);
+		return NULL;
+	}
+
+	wl_list_insert(swapchain->images.prev, &image->link);
+	swapchain->count++;
+
+	if (!(image->base.buffer = kms_image_create_buffer(swapchain->conn, &image->base))) {
+		kms_image_destroy(image);
+		return NULL;
+	}
+	wl_buffer_add_listener(image->base.buffer, &kms_image_buffer_listener, image);
+
+	WLKMS_DEBUG("%s: %s: %d: %d images\n", __FILE__, __func__, __LINE__, swapchain->count);
+	return image;
+}
+
+/*
+ * Swapchain
+ */
+
+struct wl_kms_swapchain *
+wayland_kms_swapchain_create(struct wl_kms_connection *conn,
+			     int32_t width, int32_t height, uint32_t format,
+			     const struct wl_kms_allocator *allocator)
+{
+	struct wl_kms_swapchain *swapchain;
+
+	if (width <= 0 || height <= 0 || !wayland_kms_connection_has_format(conn, format))
+		return NULL;
+
+	if (!(swapchain = calloc(1, sizeof(struct wl_kms_swapchain))))
+		return NULL;
+
+	swapchain->conn = conn;
+	swapchain->width = width;
+	swapchain->height = height;
+	swapchain->format = format;
+	swapchain->min_images = 2;
+	swapchain->max_images = 4;
+	swapchain->min_spare = INT_MAX;
+	wl_list_init(&swapchain->images);
+
+	if (allocator) {
+		swapchain->allocator = *allocator;
+	} else {
+		swapchain->allocator.alloc = kms_dumb_alloc;
+		swapchain->allocator.free = kms_dumb_free;
+		swapchain->allocator.data = conn;
+	}
+
+	return swapchain;
+}
+
+void wayland_kms_swapchain_destroy(struct wl_kms_swapchain *swapchain)
+{
+	struct kms_image *image, *tmp;
+
+	if (!swapchain)
+		return;
+
+	/* the compositor keeps what it has imported of the busy ones */
+	wl_list_for_each_safe(image, tmp, &swapchain->images, link)
+		kms_image_destroy(image);
+
+	free(swapchain);
+}
+
+int wayland_kms_swapchain_set_depth(struct wl_kms_swapchain *swapchain,
+				    int min_images, int max_images)
+{
+	if (min_images < 1 || max_images < min_images)
+		return -1;
+
+	swapchain->min_images = min_images;
+	swapchain->max_images = max_images;
+	return 0;
+}
+
+int wayland_kms_swapchain_get_depth(struct wl_kms_swapchain *swapchain)
+{
+	return swapchain->count;
+}
+
+/*
+ * Free images are dropped right away, the others once the compositor
+ * releases them.
+ */
+int wayland_kms_swapchain_resize(struct wl_kms_swapchain *swapchain,
+				 int32_t width, int32_t height)
+{
+	struct kms_image *image, *tmp;
+
+	if (width <= 0 || height <= 0)
+		return -1;
+
+	swapchain->width = width;
+	swapchain->height = height;
+	swapchain->acquires = 0;
+	swapchain->min_spare = INT_MAX;
+
+	wl_list_for_each_safe(image, tmp, &swapchain->images, link) {
+		if (!image->busy)
+			kms_image_destroy(image);
+	}
+
+	return 0;
+}
+
+/*
+ * Adapts the depth to the client: an image is added whenever none is
+ * free, and one is dropped when at least one stayed free at every
+ * acquire for KMS_SWAPCHAIN_WINDOW acquires.
+ */
+struct wl_kms_image *
+wayland_kms_swapchain_acquire(struct wl_kms_swapchain *swapchain)
+{
+	struct kms_image *image, *found = NULL, *spare = NULL;
+	int free_images = 0;
+
+	wl_list_for_each(image, &swapchain->images, link) {
+		if (image->busy)
+			continue;
+		if (!found)
+			found = image;
+		else if (!spare)
+			spare = image;
+		free_images++;
+	}
+
+	if (found) {
+		if (free_images - 1 < swapchain->min_spare)
+			swapchain->min_spare = free_images - 1;
+	} else {
+		/* starved */
+		swapchain->min_spare = 0;
+		if (swapchain->count < swapchain->max_images)
+			found = kms_image_create(swapchain);
+	}
+
+	if (++swapchain->acquires >= KMS_SWAPCHAIN_WINDOW) {
+		if (spare && swapchain->min_spare > 0 &&
+		    swapchain->count > swapchain->min_images)
+			kms_image_destroy(spare);
+		swapchain->acquires = 0;
+		swapchain->min_spare = INT_MAX;
+	}
+
+	if (!found)
+		return NULL;
+
+	found->busy = 1;
+
+	/* hand them out round robin */
+	wl_list_remove(&found->link);
+	wl_list_insert(swapchain->images.prev, &found->link);
+
+	return &found->base;
+}
+
+void wayland_kms_swapchain_cancel(struct wl_kms_swapchain *swapchain,
+				  struct wl_kms_image *base)
+{
+	struct kms_image *image = wl_container_of(base, image, base);
+
+	kms_image_handle_release(image, base->buffer);
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef WAYLAND_KMS_CLIENT_H
+#define WAYLAND_KMS_CLIENT_H
+
+#include <stdint.h>
+
+/*
+ * Client side helpers for wl_kms.
+ *
+ * A wl_kms_connection binds wl_kms on a display, keeps the device and
+ * the formats the server advertised, and opens and authenticates the
+ * device once. A wl_kms_swapchain then hands out buffers of one size
+ * and format, creating their wl_buffers once and reusing them as the
+ * compositor releases them.
+ *
+ * The release events are dispatched on the default queue of the
+ * display, so the client has to dispatch it for buffers to come back.
+ */
+
+struct wl_display;
+struct wl_buffer;
+struct wl_kms_connection;
+struct wl_kms_swapchain;
+
+#define WL_KMS_IMAGE_MAX_PLANES 4
+
+struct wl_kms_image {
+	struct wl_buffer *buffer;	/* attach this one */
+	int32_t width, height;
+	uint32_t format;
+
+	/* filled in by the allocator */
+	int num_planes;
+	int fds[WL_KMS_IMAGE_MAX_PLANES];	/* dma-bufs, kept open */
+	uint32_t strides[WL_KMS_IMAGE_MAX_PLANES];
+	uint32_t offsets[WL_KMS_IMAGE_MAX_PLANES];
+	void *data[WL_KMS_IMAGE_MAX_PLANES];	/* CPU mappings, if any */
+	void *user_data;			/* free for the allocator */
+};
+
+/*
+ * Backing store of the images. alloc() gets an image with its size and
+ * format set and fills in its planes, returning 0 on success; free()
+ * releases them. The default one allocates dumb buffers on the device
+ * and maps them; a client rendering with GBM passes its own.
+ */
+struct wl_kms_allocator {
+	int (*alloc)(void *data, struct wl_kms_image *image);
+	void (*free)(void *data, struct wl_kms_image *image);
+	void *data;
+};
+
+extern struct wl_kms_connection *wayland_kms_connect(struct wl_display *display);
+extern void wayland_kms_disconnect(struct wl_kms_connection *conn);
+
+/* the device the server uses, opened and authenticated */
+extern int wayland_kms_connection_get_fd(struct wl_kms_connection *conn);
+extern const char *wayland_kms_connection_get_device(struct wl_kms_connection *conn);
+extern int wayland_kms_connection_has_format(struct wl_kms_connection *conn,
+					     uint32_t format);
+
+/*
+ * The swapchain keeps between min_images and max_images images (2 and 4
+ * by default). It grows when the client asks for an image and none is
+ * free, and gives an image back when one has stayed spare for a while.
+ */
+extern struct wl_kms_swapchain *
+wayland_kms_swapchain_create(struct wl_kms_connection *conn,
+			     int32_t width, int32_t height, uint32_t format,
+			     const struct wl_kms_allocator *allocator);
+extern void wayland_kms_swapchain_destroy(struct wl_kms_swapchain *swapchain);
+extern int wayland_kms_swapchain_set_depth(struct wl_kms_swapchain *swapchain,
+					   int min_images, int max_images);
+extern int wayland_kms_swapchain_resize(struct wl_kms_swapchain *swapchain,
+					int32_t width, int32_t height);
+extern int wayland_kms_swapchain_get_depth(struct wl_kms_swapchain *swapchain);
+
+/*
+ * Returns a free image, or NULL if all max_images are still held by the
+ * compositor; dispatch the display and try again then. The image stays
+ * busy until the compositor releases its wl_buffer, or until it is
+ * given back unused with wayland_kms_swapchain_cancel().
+ */
+extern struct wl_kms_image *
+wayland_kms_swapchain_acquire(struct wl_kms_swapchain *swapchain);
+extern void wayland_kms_swapchain_cancel(struct wl_kms_swapchain *swapchain,
+					 struct wl_kms_image *image);
+
+#endif
@@ -0,0 +1,734 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/dma-buf.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "wayland-kms.h"
+#include "wayland-kms-format.h"
+#include "wayland-kms-workqueue.h"
+#include "wayland-kms-server-protocol.h"
+
+#if defined(DEBUG)
+#	define WLKMS_DEBUG(s, x...) { printf(s, ##x); }
+#else
+#	define WLKMS_DEBUG(s, x...) { }
+#endif
+
+/* areas worth splitting between threads, and how many at most */
+#define KMS_CONVERT_TILE_PIXELS (512 * 1024)
+#define KMS_CONVERT_MAX_THREADS 4
+
+struct wl_kms_map {
+	struct wl_kms_buffer *buffer;
+	const struct kms_format_info *info;
+	uint64_t sync;			/* DMA_BUF_SYNC_READ/WRITE */
+
+	/* planes sharing a dma-buf share its mapping */
+	int num_maps;
+	struct {
+		int fd;
+		int owned;		/* exported for us, see WL_KMS_FLAG_DROP_FDS */
+		void *addr;
+		size_t size;
+	} maps[MAX_PLANES];
+
+	uint8_t *planes[MAX_PLANES];
+};
+
+/*
+ * Mapping
+ */
+
+static int kms_map_sync(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags };
+	int ret;
+
+	do {
+		ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	/* memfds and other fds that aren't dma-bufs need no syncing */
+	if (ret < 0 && errno == ENOTTY)
+		ret = 0;
+
+	return ret;
+}
+
+static int kms_map_plane(struct wl_kms_map *map, int plane)
+{
+	struct wl_kms_planes *p = &map->buffer->planes[plane];
+	struct stat st, other;
+	off_t size;
+	void *addr;
+	int i, fd = p->fd, prot = 0;
+
+	if (fd == WL_KMS_INVALID_FD &&
+	    (fd = wayland_kms_buffer_get_plane_fd(map->buffer, plane)) < 0)
+		return -1;
+
+	if (fstat(fd, &st))
+		goto error;
+
+	for (i = 0; i < map->num_maps; i++) {
+		if (!fstat(map->maps[i].fd, &other) && other.st_ino == st.st_ino) {
+			if (fd != p->fd)
+				close(fd);
+			goto found;
+		}
+	}
+
+	/* as in kms_check_layout(), without moving the client's offset */
+	if (S_ISREG(st.st_mode))
+		size = st.st_size;
+	else if ((size = lseek(fd, 0, SEEK_END)) > 0)
+		lseek(fd, 0, SEEK_SET);
+	if (size <= 0)
+		goto error;
+
+	if (map->sync & DMA_BUF_SYNC_READ)
+		prot |= PROT_READ;
+	if (map->sync & DMA_BUF_SYNC_WRITE)
+		prot |= PROT_WRITE;
+
+	addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto error;
+
+	if (kms_map_sync(fd, DMA_BUF_SYNC_START | map->sync) < 0) {
+		munmap(addr, size);
+		goto error;
+	}
+
+	map->maps[i].fd = fd;
+	map->maps[i].owned = fd != p->fd;
+	map->maps[i].addr = addr;
+	map->maps[i].size = size;
+	map->num_maps++;
+
+found:
+	if ((uint64_t)p->offset >= map->maps[i].size)
+		return -1;
+	map->planes[plane] = (uint8_t *)map->maps[i].addr + p->offset;
+	return 0;
+
+error:
+	if (fd != p->fd)
+		close(fd);
+	return -1;
+}
+
+struct wl_kms_map *wayland_kms_buffer_map(struct wl_kms_buffer *buffer,
+					  uint32_t flags)
+{
+	struct wl_kms_map *map;
+	int i;
+
+	if (!(map = calloc(1, sizeof(struct wl_kms_map))))
+		return NULL;
+
+	map->buffer = buffer;
+	map->info = kms_format_get_info(buffer->format);
+	if (flags & WL_KMS_MAP_READ)
+		map->sync |= DMA_BUF_SYNC_READ;
+	if (flags & WL_KMS_MAP_WRITE)
+		map->sync |= DMA_BUF_SYNC_WRITE;
+
+	for (i = 0; i < buffer->num_planes; i++) {
+		if (kms_map_plane(map, i) < 0) {
+			WLKMS_DEBUG("%s: %s: can't map plane %d (%s)\n", __FILE__,
+				    __func__, i, strerror(errno));
+			wayland_kms_buffer_unmap(map);
+			return NULL;
+		}
+	}
+
+	return map;
+}
+
+void *wayland_kms_map_get_plane(struct wl_kms_map *map, int plane,
+				uint32_t *stride)
+{
+	if (plane < 0 || plane >= map->buffer->num_planes)
+		return NULL;
+
+	if (stride)
+		*stride = map->buffer->planes[plane].stride;
+	return map->planes[plane];
+}
+
+void wayland_kms_buffer_unmap(struct wl_kms_map *map)
+{
+	int i;
+
+	for (i = 0; i < map->num_maps; i++) {
+		kms_map_sync(map->maps[i].fd, DMA_BUF_SYNC_END | map->sync);
+		munmap(map->maps[i].addr, map->maps[i].size);
+		if (map->maps[i].owned)
+			close(map->maps[i].fd);
+	}
+
+	free(map);
+}
+
+/*
+ * Conversion to XRGB8888
+ *
+ * YUV is taken as BT.601 limited range, in 6 bit fixed point so that
+ * the SIMD versions work on 16 bit lanes and give the same results.
+ */
+
+struct kms_convert;
+
+typedef void (*kms_convert_row_t)(const struct kms_convert *cv, int row,
+				  int x, int width, uint32_t *dst);
+
+struct kms_convert {
+	const struct wl_kms_map *map;
+	kms_convert_row_t convert_row;
+
+	/* packed RGB */
+	int cpp;
+	uint8_t shift[3], bits[3];	/* R, G, B */
+
+	/* YUV */
+	int hsub, vsub;
+	int u, v;			/* planes, or byte offsets when packed */
+	int y0, y1;			/* byte offsets in packed YUV */
+	int uv_step;			/* 2 for interleaved chroma */
+
+	uint8_t *dst;
+	uint32_t dst_stride;
+};
+
+struct kms_convert_job {
+	struct kms_work work;
+	const struct kms_convert *cv;
+	struct wl_kms_rect rect;
+};
+
+static inline uint8_t kms_clamp(int value)
+{
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static inline uint32_t kms_yuv_pixel(int y, int u, int v)
+{
+	int c = 74 * (y - 16) + 32, d = u - 128, e = v - 128;
+
+	return 0xff000000 |
+	       kms_clamp((c + 102 * e) >> 6) << 16 |
+	       kms_clamp((c - 25 * d - 52 * e) >> 6) << 8 |
+	       kms_clamp((c + 129 * d) >> 6);
+}
+
+static inline const uint8_t *
+kms_convert_src(const struct kms_convert *cv, int plane, int row)
+{
+	const struct wl_kms_map *map = cv->map;
+
+	return map->planes[plane] + (size_t)row * map->buffer->planes[plane].stride;
+}
+
+/* fast path for 4:2:x YUV; u and v are read every uv_step bytes */
+static int
+kms_yuv_row_simd(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+		 int uv_step, int width, uint32_t *dst)
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi8((char)0xff);
+	__m128i ys, us, vs, c, d, e, r, g, b, bg, rx;
+	uint32_t u4, v4;
+	uint64_t uv8;
+
+	for (; i + 8 <= width; i += 8) {
+		ys = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + i)), zero);
+
+		if (uv_step == 2) {
+			/* u0 v0 u1 v1... as 32 bit lanes of u | v << 16 */
+			memcpy(&uv8, (u < v ? u : v) + i, 8);
+			c = _mm_unpacklo_epi8(_mm_cvtsi64_si128(uv8), zero);
+			us = _mm_and_si128(c, _mm_set1_epi32(0xffff));
+			vs = _mm_srli_epi32(c, 16);
+			if (v < u) {
+				c = us;
+				us = vs;
+				vs = c;
+			}
+		} else {
+			memcpy(&u4, u + i / 2, 4);
+			memcpy(&v4, v + i / 2, 4);
+			us = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(u4), zero), zero);
+			vs = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v4), zero), zero);
+		}
+
+		/* one chroma sample for two pixels */
+		us = _mm_or_si128(us, _mm_slli_epi32(us, 16));
+		vs = _mm_or_si128(vs, _mm_slli_epi32(vs, 16));
+
+		c = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(ys, _mm_set1_epi16(16)),
+						  _mm_set1_epi16(74)),
+				  _mm_set1_epi16(32));
+		d = _mm_sub_epi16(us, _mm_set1_epi16(128));
+		e = _mm_sub_epi16(vs, _mm_set1_epi16(128));
+
+		r = _mm_adds_epi16(c, _mm_mullo_epi16(e, _mm_set1_epi16(102)));
+		g = _mm_subs_epi16(c, _mm_add_epi16(_mm_mullo_epi16(d, _mm_set1_epi16(25)),
+						    _mm_mullo_epi16(e, _mm_set1_epi16(52))));
+		b = _mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(129)));
+
+		r = _mm_packus_epi16(_mm_srai_epi16(r, 6), zero);
+		g = _mm_packus_epi16(_mm_srai_epi16(g, 6), zero);
+		b = _mm_packus_epi16(_mm_srai_epi16(b, 6), zero);
+
+		bg = _mm_unpacklo_epi8(b, g);
+		rx = _mm_unpacklo_epi8(r, alpha);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(bg, rx));
+		_mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(bg, rx));
+	}
+#elif defined(__ARM_NEON)
+	int16x8_t c, d, e, r, g, b;
+	uint8x8x2_t uv;
+	uint8x8x4_t out;
+	uint8x8_t u8, v8;
+	uint32_t u4, v4;
+
+	out.val[3] = vdup_n_u8(0xff);
+
+	for (; i + 8 <= width; i += 8) {
+		if (uv_step == 2) {
+			/* u0 v0 u1 v1... split into u0 u1 u2 u3 and v0 v1 v2 v3 */
+			u8 = vld1_u8((u < v ? u : v) + i);
+			uv = vuzp_u8(u8, u8);
+			u8 = uv.val[v < u];
+			v8 = uv.val[u < v];
+		} else {
+			memcpy(&u4, u + i / 2, 4);
+			memcpy(&v4, v + i / 2, 4);
+			u8 = vreinterpret_u8_u32(vdup_n_u32(u4));
+			v8 = vreinterpret_u8_u32(vdup_n_u32(v4));
+		}
+
+		/* one chroma sample for two pixels */
+		u8 = vzip_u8(u8, u8).val[0];
+		v8 = vzip_u8(v8, v8).val[0];
+
+		c = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + i)));
+		c = vaddq_s16(vmulq_n_s16(vsubq_s16(c, vdupq_n_s16(16)), 74),
+			      vdupq_n_s16(32));
+		d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), vdupq_n_s16(128));
+		e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), vdupq_n_s16(128));
+
+		r = vqaddq_s16(c, vmulq_n_s16(e, 102));
+		g = vqsubq_s16(c, vaddq_s16(vmulq_n_s16(d, 25), vmulq_n_s16(e, 52)));
+		b = vqaddq_s16(c, vmulq_n_s16(d, 129));
+
+		out.val[0] = vqshrun_n_s16(b, 6);
+		out.val[1] = vqshrun_n_s16(g, 6);
+		out.val[2] = vqshrun_n_s16(r, 6);
+		vst4_u8((uint8_t *)(dst + i), out);
+	}
+#endif
+
+	return i;
+}
+
+static void
+kms_convert_row_yuv_planar(const struct kms_convert *cv, int row, int x,
+			   int width, uint32_t *dst)
+{
+	const uint8_t *y = kms_convert_src(cv, 0, row);
+	const uint8_t *u, *v;
+	int i = 0, cx;
+
+	if (cv->uv_step == 2) {
+		/* interleaved chroma; u and v are byte offsets in plane 1 */
+		u = kms_convert_src(cv, 1, row / cv->vsub) + cv->u;
+		v = kms_convert_src(cv, 1, row / cv->vsub) + cv->v;
+	} else {
+		u = kms_convert_src(cv, cv->u, row / cv->vsub);
+		v = kms_convert_src(cv, cv->v, row / cv->vsub);
+	}
+
+	/* start the fast path on a chroma sample */
+	if (cv->hsub == 2 && (x & 1)) {
+		cx = x / 2 * cv->uv_step;
+		dst[0] = kms_yuv_pixel(y[x], u[cx], v[cx]);
+		i = 1;
+	}
+
+	if (cv->hsub == 2)
+		i += kms_yuv_row_simd(y + x + i, u + (x + i) / 2 * cv->uv_step,
+				      v + (x + i) / 2 * cv->uv_step, cv->uv_step,
+				      width - i, dst + i);
+
+	for (; i < width; i++) {
+		cx = (x + i) / cv->hsub * cv->uv_step;
+		dst[i] = kms_yuv_pixel(y[x + i], u[cx], v[cx]);
+	}
+}
+
+/* YUYV and friends, and AYUV */
+static void
+kms_convert_row_yuv_packed(const struct kms_convert *cv, int row, int x,
+			   int width, uint32_t *dst)
+{
+	const uint8_t *src = kms_convert_src(cv, 0, row);
+	const uint8_t *p;
+	int i;
+
+	for (i = 0; i < width; i++) {
+		if (cv->cpp == 4) {
+			p = src + (x + i) * 4;
+			dst[i] = kms_yuv_pixel(p[cv->y0], p[cv->u], p[cv->v]);
+		} else {
+			p = src + (x + i) / 2 * 4;
+			dst[i] = kms_yuv_pixel(p[(x + i) & 1 ? cv->y1 : cv->y0],
+					       p[cv->u], p[cv->v]);
+		}
+	}
+}
+
+static void
+kms_convert_row_xrgb(const struct kms_convert *cv, int row, int x,
+		     int width, uint32_t *dst)
+{
+	const uint32_t *src = (const uint32_t *)kms_convert_src(cv, 0, row) + x;
+	int i;
+
+	for (i = 0; i < width; i++)
+		dst[i] = src[i] | 0xff000000;
+}
+
+static inline uint32_t kms_expand(uint32_t pixel, int shift, int bits)
+{
+	uint32_t value = (pixel >> shift) & ((1 << bits) - 1);
+
+	/* replicate the high bits into the low ones */
+	value <<= 8 - bits;
+	while (bits < 8) {
+		value |= value >> bits;
+		bits *= 2;
+	}
+
+	return value & 0xff;
+}
+
+static void
+kms_convert_row_rgb(const struct kms_convert *cv, int row, int x,
+		    int width, uint32_t *dst)
+{
+	const uint8_t *src = kms_convert_src(cv, 0, row) + x * cv->cpp;
+	uint32_t pixel;
+	int i, j;
+
+	for (i = 0; i < width; i++, src += cv->cpp) {
+		/* little endian, like all DRM formats */
+		for (pixel = 0, j = cv->cpp - 1; j >= 0; j--)
+			pixel = pixel << 8 | src[j];
+
+		dst[i] = 0xff000000 |
+			 kms_expand(pixel, cv->shift[0], cv->bits[0]) << 16 |
+			 kms_expand(pixel, cv->shift[1], cv->bits[1]) << 8 |
+			 kms_expand(pixel, cv->shift[2], cv->bits[2]);
+	}
+}
+
+/*
+ * R, G and B positions of packed RGB formats, as shift and bits. Only
+ * the 8 high bits of 10 bit channels are taken.
+ */
+static const struct {
+	uint32_t format;
+	uint8_t shift[3], bits[3];
+} kms_rgb_layouts[] = {
+	{ WL_KMS_FORMAT_RGB332,		{ 5, 2, 0 },	{ 3, 3, 2 } },
+	{ WL_KMS_FORMAT_BGR233,		{ 0, 3, 6 },	{ 3, 3, 2 } },
+	{ WL_KMS_FORMAT_XRGB4444,	{ 8, 4, 0 },	{ 4, 4, 4 } },
+	{ WL_KMS_FORMAT_ARGB4444,	{ 8, 4, 0 },	{ 4, 4, 4 } },
+	{ WL_KMS_FORMAT_XBGR4444,	{ 0, 4, 8 },	{ 4, 4, 4 } },
+	{ WL_KMS_FORMAT_ABGR4444,	{ 0, 4, 8 },	{ 4, 4, 4 } },
+	{ WL_KMS_FORMAT_RGBX4444,	{ 12, 8, 4 },	{ 4, 4, 4 } },
+	{ WL_KMS_FORMAT_RGBA4444,	{ 12, 8, 4 },	{ 4, 4, 4 } },
+	{ WL_KMS_FORMAT_BGRX4444,	{ 4, 8, 12 },	{ 4, 4, 4 } },
+	{ WL_KMS_FORMAT_BGRA4444,	{ 4, 8, 12 },	{ 4, 4, 4 } },
+	{ WL_KMS_FORMAT_XRGB1555,	{ 10, 5, 0 },	{ 5, 5, 5 } },
+	{ WL_KMS_FORMAT_ARGB1555,	{ 10, 5, 0 },	{ 5, 5, 5 } },
+	{ WL_KMS_FORMAT_XBGR1555,	{ 0, 5, 10 },	{ 5, 5, 5 } },
+	{ WL_KMS_FORMAT_ABGR1555,	{ 0, 5, 10 },	{ 5, 5, 5 } },
+	{ WL_KMS_FORMAT_RGBX5551,	{ 11, 6, 1 },	{ 5, 5, 5 } },
+	{ WL_KMS_FORMAT_RGBA5551,	{ 11, 6, 1 },	{ 5, 5, 5 } },
+	{ WL_KMS_FORMAT_BGRX5551,	{ 1, 6, 11 },	{ 5, 5, 5 } },
+	{ WL_KMS_FORMAT_BGRA5551,	{ 1, 6, 11 },	{ 5, 5, 5 } },
+	{ WL_KMS_FORMAT_RGB565,		{ 11, 5, 0 },	{ 5, 6, 5 } },
+	{ WL_KMS_FORMAT_BGR565,		{ 0, 5, 11 },	{ 5, 6, 5 } },
+	{ WL_KMS_FORMAT_RGB888,		{ 16, 8, 0 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_BGR888,		{ 0, 8, 16 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_XBGR8888,	{ 0, 8, 16 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_ABGR8888,	{ 0, 8, 16 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_RGBX8888,	{ 24, 16, 8 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_RGBA8888,	{ 24, 16, 8 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_BGRX8888,	{ 8, 16, 24 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_BGRA8888,	{ 8, 16, 24 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_XRGB2101010,	{ 22, 12, 2 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_ARGB2101010,	{ 22, 12, 2 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_XBGR2101010,	{ 2, 12, 22 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_ABGR2101010,	{ 2, 12, 22 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_RGBX1010102,	{ 24, 14, 4 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_RGBA1010102,	{ 24, 14, 4 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_BGRX1010102,	{ 4, 14, 24 },	{ 8, 8, 8 } },
+	{ WL_KMS_FORMAT_BGRA1010102,	{ 4, 14, 24 },	{ 8, 8, 8 } },
+};
+
+#define NUM_KMS_RGB_LAYOUTS (sizeof(kms_rgb_layouts) / sizeof(kms_rgb_layouts[0]))
+
+static int kms_convert_setup(struct kms_convert *cv, uint32_t format)
+{
+	unsigned int i;
+
+	cv->hsub = cv->map->info->hsub;
+	cv->vsub = cv->map->info->vsub;
+	cv->cpp = cv->map->info->cpp[0];
+	cv->uv_step = 1;
+
+	switch (format) {
+	case WL_KMS_FORMAT_XRGB8888:
+	case WL_KMS_FORMAT_ARGB8888:
+		cv->convert_row = kms_convert_row_xrgb;
+		return 0;
+
+	case WL_KMS_FORMAT_NV12:
+	case WL_KMS_FORMAT_NV16:
+		cv->convert_row = kms_convert_row_yuv_planar;
+		cv->uv_step = 2;
+		cv->u = 0;
+		cv->v = 1;
+		return 0;
+
+	case WL_KMS_FORMAT_NV21:
+	case WL_KMS_FORMAT_NV61:
+		cv->convert_row = kms_convert_row_yuv_planar;
+		cv->uv_step = 2;
+		cv->u = 1;
+		cv->v = 0;
+		return 0;
+
+	case WL_KMS_FORMAT_YUV410:
+	case WL_KMS_FORMAT_YUV411:
+	case WL_KMS_FORMAT_YUV420:
+	case WL_KMS_FORMAT_YUV422:
+	case WL_KMS_FORMAT_YUV444:
+		cv->convert_row = kms_convert_row_yuv_planar;
+		cv->u = 1;
+		cv->v = 2;
+		return 0;
+
+	case WL_KMS_FORMAT_YVU410:
+	case WL_KMS_FORMAT_YVU411:
+	case WL_KMS_FORMAT_YVU420:
+	case WL_KMS_FORMAT_YVU422:
+	case WL_KMS_FORMAT_YVU444:
+		cv->convert_row = kms_convert_row_yuv_planar;
+		cv->u = 2;
+		cv->v = 1;
+		return 0;
+
+	/* byte offsets of Y0, U, Y1 and V in 2 pixels */
+	case WL_KMS_FORMAT_YUYV:
+		cv->y0 = 0; cv->u = 1; cv->y1 = 2; cv->v = 3;
+		cv->convert_row = kms_convert_row_yuv_packed;
+		return 0;
+	case WL_KMS_FORMAT_YVYU:
+		cv->y0 = 0; cv->v = 1; cv->y1 = 2; cv->u = 3;
+		cv->convert_row = kms_convert_row_yuv_packed;
+		return 0;
+	case WL_KMS_FORMAT_UYVY:
+		cv->u = 0; cv->y0 = 1; cv->v = 2; cv->y1 = 3;
+		cv->convert_row = kms_convert_row_yuv_packed;
+		return 0;
+	case WL_KMS_FORMAT_VYUY:
+		cv->v = 0; cv->y0 = 1; cv->u = 2; cv->y1 = 3;
+		cv->convert_row = kms_convert_row_yuv_packed;
+		return 0;
+
+	/* Cr, Cb, Y and A in memory */
+	case WL_KMS_FORMAT_AYUV:
+		cv->v = 0; cv->u = 1; cv->y0 = 2;
+		cv->convert_row = kms_convert_row_yuv_packed;
+		return 0;
+	}
+
+	for (i = 0; i < NUM_KMS_RGB_LAYOUTS; i++) {
+		if (kms_rgb_layouts[i].format != format)
+			continue;
+
+		memcpy(cv->shift, kms_rgb_layouts[i].shift, sizeof cv->shift);
+		memcpy(cv->bits, kms_rgb_layouts[i].bits, sizeof cv->bits);
+		cv->convert_row = kms_convert_row_rgb;
+		return 0;
+	}
+
+	return -1;
+}
+
+static void kms_convert_rect(const struct kms_convert *cv,
+			     const struct wl_kms_rect *rect)
+{
+	int row;
+
+	for (row = rect->y; row < rect->y + rect->height; row++)
+		cv->convert_row(cv, row, rect->x, rect->width,
+				(uint32_t *)(cv->dst + (size_t)row * cv->dst_stride) +
+				rect->x);
+}
+
+static void kms_convert_work(struct kms_work *work)
+{
+	struct kms_convert_job *job = wl_container_of(work, job, work);
+
+	kms_convert_rect(job->cv, &job->rect);
+}
+
+/* the job lives on the stack of kms_convert_tiled(), which waits for it */
+static void kms_convert_done(struct kms_work *work)
+{
+}
+
+static int kms_convert_threads(void)
+{
+	static int threads;
+	long n;
+
+	if (!threads) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n < 1 ? 1 : n > KMS_CONVERT_MAX_THREADS ?
+			KMS_CONVERT_MAX_THREADS : n;
+	}
+
+	return threads;
+}
+
+/* Splits large areas in bands of rows, one per thread */
+static void kms_convert_tiled(const struct kms_convert *cv,
+			      const struct wl_kms_rect *rect)
+{
+	struct kms_convert_job jobs[KMS_CONVERT_MAX_THREADS];
+	struct kms_workqueue *wq = NULL;
+	int i, n = 1, rows;
+
+	if ((int64_t)rect->width * rect->height >= KMS_CONVERT_TILE_PIXELS)
+		n = kms_convert_threads();
+	if (n > rect->height)
+		n = rect->height;
+
+	/* the first band is ours, the others go to the threads of wl_kms */
+	if (n > 1)
+		wq = kms_get_convert_workqueue(cv->map->buffer->kms,
+					       kms_convert_threads() - 1);
+
+	for (i = 0; i < n; i++) {
+		rows = rect->height / n + (i < rect->height % n);
+		jobs[i].work.func = kms_convert_work;
+		jobs[i].work.done = kms_convert_done;
+		jobs[i].cv = cv;
+		jobs[i].rect = *rect;
+		jobs[i].rect.y = i ? jobs[i - 1].rect.y + jobs[i - 1].rect.height : rect->y;
+		jobs[i].rect.height = rows;
+		if (i > 0 && wq)
+			kms_workqueue_submit(wq, &jobs[i].work);
+	}
+
+	kms_convert_rect(cv, &jobs[0].rect);
+
+	for (i = 1; i < n; i++) {
+		if (wq)
+			kms_workqueue_wait(wq, &jobs[i].work);
+		else
+			kms_convert_rect(cv, &jobs[i].rect);
+	}
+}
+
+int wayland_kms_map_convert(struct wl_kms_map *map, void *dst,
+			    uint32_t dst_stride, const struct wl_kms_rect *rects,
+			    int num_rects)
+{
+	struct wl_kms_buffer *buffer = map->buffer;
+	struct wl_kms_rect full = { 0, 0, buffer->width, buffer->height };
+	struct wl_kms_rect rect;
+	struct kms_convert cv = {
+		.map = map,
+		.dst = dst,
+		.dst_stride = dst_stride,
+	};
+	int i;
+
+	if (!map->info || kms_convert_setup(&cv, buffer->format) < 0)
+		return -1;
+
+	if (num_rects == 0) {
+		rects = &full;
+		num_rects = 1;
+	}
+
+	for (i = 0; i < num_rects; i++) {
+		/* clip to the buffer */
+		rect = rects[i];
+		if (rect.x < 0) {
+			rect.width += rect.x;
+			rect.x = 0;
+		}
+		if (rect.y < 0) {
+			rect.height += rect.y;
+			rect.y = 0;
+		}
+		if (rect.width > buffer->width - rect.x)
+			rect.width = buffer->width - rect.x;
+		if (rect.height > buffer->height - rect.y)
+			rect.height = buffer->height - rect.y;
+		if (rect.width <= 0 || rect.height <= 0)
+			continue;
+
+		kms_convert_tiled(&cv, &rect);
+	}
+
+	return 0;
+}
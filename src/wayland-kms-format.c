@@ -0,0 +1,370 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <wayland-server.h>
+#include "wayland-kms-format.h"
+#include "wayland-kms-server-protocol.h"
+
+#include <EGL/egl.h>
+#include "weston-egl-ext.h"
+
+#if defined(DEBUG)
+#	define WLKMS_DEBUG(s, x...) { printf(s, ##x); }
+#else
+#	define WLKMS_DEBUG(s, x...) { }
+#endif
+
+struct kms_format_table {
+	int fd;				/* sealed memfd */
+	uint32_t size;
+};
+
+/*
+ * Formats we know how to import, in the order they are advertised.
+ * cpp is the number of bytes per pixel of each plane; the planes after
+ * the first are subsampled by hsub and vsub. YUV formats that can be
+ * sampled plane by plane have a second texture format for
+ * WL_KMS_FLAG_PLANAR_TEXTURES.
+ */
+static const struct kms_format_info kms_formats[] = {
+	/* format			planes	cpp		hsub vsub alpha	texture, planar */
+	{ WL_KMS_FORMAT_ARGB8888,	1,	{ 4 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_XRGB8888,	1,	{ 4 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_ABGR8888,	1,	{ 4 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_XBGR8888,	1,	{ 4 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_RGB888,		1,	{ 3 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_BGR888,		1,	{ 3 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_YUYV,		1,	{ 2 },		1, 1, 0,	0,
+	  EGL_TEXTURE_Y_XUXV_WL },
+	{ WL_KMS_FORMAT_YVYU,		1,	{ 2 },		1, 1, 0,	0,
+	  EGL_TEXTURE_Y_XUXV_WL },
+	{ WL_KMS_FORMAT_UYVY,		1,	{ 2 },		1, 1, 0,	0, 0 },
+	{ WL_KMS_FORMAT_RGB565,		1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_BGR565,		1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_RGB332,		1,	{ 1 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_NV12,		2,	{ 1, 2 },	2, 2, 0,	EGL_TEXTURE_EXTERNAL_WL,
+	  EGL_TEXTURE_Y_UV_WL },
+	{ WL_KMS_FORMAT_NV21,		2,	{ 1, 2 },	2, 2, 0,	EGL_TEXTURE_EXTERNAL_WL,
+	  EGL_TEXTURE_Y_UV_WL },
+	{ WL_KMS_FORMAT_NV16,		2,	{ 1, 2 },	2, 1, 0,	EGL_TEXTURE_EXTERNAL_WL,
+	  EGL_TEXTURE_Y_UV_WL },
+	{ WL_KMS_FORMAT_NV61,		2,	{ 1, 2 },	2, 1, 0,	EGL_TEXTURE_EXTERNAL_WL,
+	  EGL_TEXTURE_Y_UV_WL },
+	{ WL_KMS_FORMAT_YUV420,		3,	{ 1, 1, 1 },	2, 2, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+
+	/* formats added after the ones above; keep those first */
+	{ WL_KMS_FORMAT_BGR233,		1,	{ 1 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_XRGB4444,	1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_XBGR4444,	1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_RGBX4444,	1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_BGRX4444,	1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_ARGB4444,	1,	{ 2 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_ABGR4444,	1,	{ 2 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_RGBA4444,	1,	{ 2 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_BGRA4444,	1,	{ 2 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_XRGB1555,	1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_XBGR1555,	1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_RGBX5551,	1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_BGRX5551,	1,	{ 2 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_ARGB1555,	1,	{ 2 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_ABGR1555,	1,	{ 2 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_RGBA5551,	1,	{ 2 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_BGRA5551,	1,	{ 2 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_RGBX8888,	1,	{ 4 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_BGRX8888,	1,	{ 4 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_RGBA8888,	1,	{ 4 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_BGRA8888,	1,	{ 4 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_XRGB2101010,	1,	{ 4 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_XBGR2101010,	1,	{ 4 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_RGBX1010102,	1,	{ 4 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_BGRX1010102,	1,	{ 4 },		1, 1, 0,	EGL_TEXTURE_RGB, 0 },
+	{ WL_KMS_FORMAT_ARGB2101010,	1,	{ 4 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_ABGR2101010,	1,	{ 4 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_RGBA1010102,	1,	{ 4 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_BGRA1010102,	1,	{ 4 },		1, 1, 1,	EGL_TEXTURE_RGBA, 0 },
+	{ WL_KMS_FORMAT_VYUY,		1,	{ 2 },		1, 1, 0,	0, 0 },
+	{ WL_KMS_FORMAT_AYUV,		1,	{ 4 },		1, 1, 1,	0, 0 },
+	{ WL_KMS_FORMAT_YUV410,		3,	{ 1, 1, 1 },	4, 4, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+	{ WL_KMS_FORMAT_YVU410,		3,	{ 1, 1, 1 },	4, 4, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+	{ WL_KMS_FORMAT_YUV411,		3,	{ 1, 1, 1 },	4, 1, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+	{ WL_KMS_FORMAT_YVU411,		3,	{ 1, 1, 1 },	4, 1, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+	{ WL_KMS_FORMAT_YVU420,		3,	{ 1, 1, 1 },	2, 2, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+	{ WL_KMS_FORMAT_YUV422,		3,	{ 1, 1, 1 },	2, 1, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+	{ WL_KMS_FORMAT_YVU422,		3,	{ 1, 1, 1 },	2, 1, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+	{ WL_KMS_FORMAT_YUV444,		3,	{ 1, 1, 1 },	1, 1, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+	{ WL_KMS_FORMAT_YVU444,		3,	{ 1, 1, 1 },	1, 1, 0,	0,
+	  EGL_TEXTURE_Y_U_V_WL },
+};
+
+#define NUM_KMS_FORMATS (sizeof(kms_formats) / sizeof(kms_formats[0]))
+
+/* returns the description of the format, NULL if unsupported */
+const struct kms_format_info *
+kms_format_get_info(uint32_t format)
+{
+	int i = kms_format_index(format);
+
+	return i < 0 ? NULL : &kms_formats[i];
+}
+
+const struct kms_format_info *
+kms_format_list(int *count)
+{
+	*count = NUM_KMS_FORMATS;
+	return kms_formats;
+}
+
+int
+kms_format_index(uint32_t format)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_KMS_FORMATS; i++) {
+		if (kms_formats[i].format == format)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Checks that planes of the given strides and offsets hold a picture
+ * of the given size, and fit in dma-bufs of the given sizes. A size of
+ * 0 means unknown, and isn't checked.
+ */
+int
+kms_format_check_layout(const struct kms_format_info *info, int32_t width,
+			int32_t height, const uint32_t *offsets,
+			const uint32_t *strides, const uint64_t *sizes)
+{
+	uint64_t w, h;
+	int i;
+
+	if (width <= 0 || height <= 0)
+		return -1;
+
+	for (i = 0; i < info->num_planes; i++) {
+		w = i ? ((uint64_t)width + info->hsub - 1) / info->hsub : width;
+		h = i ? ((uint64_t)height + info->vsub - 1) / info->vsub : height;
+
+		if (strides[i] < w * info->cpp[i])
+			return -1;
+		if (sizes[i] &&
+		    offsets[i] + (uint64_t)strides[i] * (h - 1) + w * info->cpp[i] > sizes[i])
+			return -1;
+	}
+
+	return 0;
+}
+
+static int kms_format_table_add(struct wl_array *entries, uint32_t format,
+				uint32_t flags, uint64_t modifier)
+{
+	struct kms_format_table_entry *entry;
+
+	wl_array_for_each(entry, entries) {
+		if (entry->format == format && entry->modifier == modifier) {
+			entry->flags |= flags;
+			return 0;
+		}
+	}
+
+	if (!(entry = wl_array_add(entries, sizeof *entry)))
+		return -1;
+
+	entry->format = format;
+	entry->flags = flags;
+	entry->modifier = modifier;
+	return 0;
+}
+
+/* Add the format/modifier pairs a plane reports in its IN_FORMATS blob */
+static void kms_format_table_add_modifiers(struct wl_array *entries, int drm_fd,
+					   uint32_t plane_id)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	drmModePropertyBlobPtr blob = NULL;
+	struct drm_format_modifier_blob *header;
+	struct drm_format_modifier *mods;
+	uint32_t *formats, i, j;
+
+	if (!(props = drmModeObjectGetProperties(drm_fd, plane_id, DRM_MODE_OBJECT_PLANE)))
+		return;
+
+	for (i = 0; i < props->count_props && !blob; i++) {
+		if (!(prop = drmModeGetProperty(drm_fd, props->props[i])))
+			continue;
+		if (!strcmp(prop->name, "IN_FORMATS"))
+			blob = drmModeGetPropertyBlob(drm_fd, props->prop_values[i]);
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	if (!blob)
+		return;
+
+	header = blob->data;
+	formats = (uint32_t *)((char *)header + header->formats_offset);
+	mods = (struct drm_format_modifier *)((char *)header + header->modifiers_offset);
+
+	for (i = 0; i < header->count_modifiers; i++) {
+		for (j = 0; j < 64; j++) {
+			if (!(mods[i].formats & (1ULL << j)))
+				continue;
+			if (mods[i].offset + j >= header->count_formats)
+				break;
+			if (kms_format_index(formats[mods[i].offset + j]) < 0)
+				continue;
+			kms_format_table_add(entries, formats[mods[i].offset + j],
+					     WL_KMS_FORMAT_FLAG_SCANOUT, mods[i].modifier);
+		}
+	}
+
+	drmModeFreePropertyBlob(blob);
+}
+
+/*
+ * Builds the table of formats we can import, flagging those a plane
+ * of the device can scan out, along with the modifiers it reports.
+ */
+static int kms_format_table_build(struct wl_array *entries, int drm_fd)
+{
+	drmModePlaneResPtr res;
+	drmModePlanePtr plane;
+	uint32_t i, j;
+
+	for (i = 0; i < NUM_KMS_FORMATS; i++) {
+		if (kms_format_table_add(entries, kms_formats[i].format, 0,
+					 DRM_FORMAT_MOD_INVALID) < 0)
+			return -1;
+	}
+
+	/* a render-only device has no planes */
+	if (!(res = drmModeGetPlaneResources(drm_fd)))
+		return 0;
+
+	for (i = 0; i < res->count_planes; i++) {
+		if (!(plane = drmModeGetPlane(drm_fd, res->planes[i])))
+			continue;
+
+		for (j = 0; j < plane->count_formats; j++) {
+			if (kms_format_index(plane->formats[j]) >= 0)
+				kms_format_table_add(entries, plane->formats[j],
+						     WL_KMS_FORMAT_FLAG_SCANOUT,
+						     DRM_FORMAT_MOD_INVALID);
+		}
+
+		kms_format_table_add_modifiers(entries, drm_fd, plane->plane_id);
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(res);
+	return 0;
+}
+
+struct kms_format_table *
+kms_format_table_create(int drm_fd)
+{
+	struct kms_format_table *table;
+	struct wl_array entries;
+
+	if (!(table = calloc(1, sizeof(struct kms_format_table))))
+		return NULL;
+
+	wl_array_init(&entries);
+	if (kms_format_table_build(&entries, drm_fd) < 0)
+		goto error;
+
+	table->size = entries.size;
+	table->fd = memfd_create("wayland-kms-formats", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (table->fd < 0)
+		goto error;
+
+	if (write(table->fd, entries.data, entries.size) != (ssize_t)entries.size)
+		goto error_fd;
+
+	/* clients map it read-only; nobody may change it under them */
+	if (fcntl(table->fd, F_ADD_SEALS,
+		  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		goto error_fd;
+
+	WLKMS_DEBUG("%s: %s: %u entries\n", __FILE__, __func__,
+		    table->size / (uint32_t)sizeof(struct kms_format_table_entry));
+
+	wl_array_release(&entries);
+	return table;
+
+error_fd:
+	close(table->fd);
+error:
+	wl_array_release(&entries);
+	free(table);
+	return NULL;
+}
+
+void
+kms_format_table_destroy(struct kms_format_table *table)
+{
+	if (!table)
+		return;
+
+	close(table->fd);
+	free(table);
+}
+
+int
+kms_format_table_get_fd(struct kms_format_table *table)
+{
+	return table->fd;
+}
+
+uint32_t
+kms_format_table_get_size(struct kms_format_table *table)
+{
+	return table->size;
+}
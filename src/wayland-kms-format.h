@@ -0,0 +1,44 @@
+#ifndef WAYLAND_KMS_FORMAT_H
+#define WAYLAND_KMS_FORMAT_H
+
+struct kms_format_table;
+
+/*
+ * Entry of the format table shared with version 6 clients. See the
+ * format_table event in wayland-kms.xml.
+ */
+struct kms_format_table_entry {
+	uint32_t format;
+	uint32_t flags;		/* WL_KMS_FORMAT_FLAG_* */
+	uint64_t modifier;
+};
+
+/* What we need to know about a format; see kms_formats[] */
+struct kms_format_info {
+	uint32_t format;
+	int num_planes;
+	uint8_t cpp[3];		/* bytes per pixel of each plane */
+	uint8_t hsub, vsub;	/* chroma subsampling */
+	uint8_t has_alpha;
+	int texture_format;	/* EGL_TEXTURE_*, 0 if none */
+	int planar_texture_format;	/* EGL_TEXTURE_Y_*_WL, 0 if none */
+};
+
+extern const struct kms_format_info *kms_format_get_info(uint32_t format);
+
+extern const struct kms_format_info *kms_format_list(int *count);
+
+/* index of the format in kms_format_list(), -1 if unsupported */
+extern int kms_format_index(uint32_t format);
+
+extern int kms_format_check_layout(const struct kms_format_info *info,
+				   int32_t width, int32_t height,
+				   const uint32_t *offsets, const uint32_t *strides,
+				   const uint64_t *sizes);
+
+extern struct kms_format_table *kms_format_table_create(int drm_fd);
+extern void kms_format_table_destroy(struct kms_format_table *table);
+extern int kms_format_table_get_fd(struct kms_format_table *table);
+extern uint32_t kms_format_table_get_size(struct kms_format_table *table);
+
+#endif
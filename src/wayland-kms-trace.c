@@ -0,0 +1,300 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <wayland-server-core.h>
+#include "wayland-kms-trace.h"
+
+#if defined(DEBUG)
+#	define WLKMS_DEBUG(s, x...) { printf(s, ##x); }
+#else
+#	define WLKMS_DEBUG(s, x...) { }
+#endif
+
+/*
+ * Dump format: a kms_trace_header followed by count records of
+ * record_size bytes, oldest first, in host byte order. Times are
+ * CLOCK_MONOTONIC nanoseconds.
+ */
+#define KMS_TRACE_MAGIC "WKMT"
+#define KMS_TRACE_VERSION 1
+
+struct kms_trace_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t count;
+};
+
+struct kms_trace_entry {
+	uint64_t time;
+	uint32_t event;			/* enum kms_trace_event */
+	int32_t error;
+	uint64_t arg0, arg1;
+};
+
+/*
+ * A slot of the ring. seq is 0 while the slot is being written, then
+ * the sequence number of its entry plus 1, so that a dump can tell
+ * entries overwritten under its feet.
+ */
+struct kms_trace_record {
+	uint64_t seq;
+	struct kms_trace_entry entry;
+};
+
+struct kms_trace {
+	uint64_t head;			/* sequence number of the next entry */
+	uint64_t mask;			/* number of slots - 1 */
+
+	/* dumped on SIGUSR2 */
+	char *path;
+	struct wl_list signal_link;	/* kms_trace_signal_list */
+	struct wl_event_loop *loop;	/* of the display traced */
+
+	struct kms_trace_record records[];
+};
+
+/*
+ * SIGUSR2 is handled once for all the traces of the process, on the
+ * loop of one of them; it moves when the last trace of that loop goes.
+ */
+static struct wl_list kms_trace_signal_list = {
+	&kms_trace_signal_list, &kms_trace_signal_list
+};
+static struct wl_event_source *kms_trace_signal_source;
+static struct wl_event_loop *kms_trace_signal_loop;
+
+static int kms_trace_signal(int signal_number, void *data);
+
+static int
+kms_trace_signal_attach(struct wl_event_loop *loop)
+{
+	kms_trace_signal_source =
+		wl_event_loop_add_signal(loop, SIGUSR2, kms_trace_signal, NULL);
+	if (!kms_trace_signal_source)
+		return -1;
+
+	kms_trace_signal_loop = loop;
+	return 0;
+}
+
+static void
+kms_trace_signal_detach(void)
+{
+	struct kms_trace *trace;
+
+	wl_list_for_each(trace, &kms_trace_signal_list, signal_link) {
+		if (trace->loop == kms_trace_signal_loop)
+			return;
+	}
+
+	/* the loop may go away with its display */
+	wl_event_source_remove(kms_trace_signal_source);
+	kms_trace_signal_source = NULL;
+	kms_trace_signal_loop = NULL;
+
+	if (wl_list_empty(&kms_trace_signal_list))
+		return;
+
+	trace = wl_container_of(kms_trace_signal_list.next, trace, signal_link);
+	if (kms_trace_signal_attach(trace->loop) < 0)
+		WLKMS_DEBUG("%s: %s: SIGUSR2 is no longer handled\n", __FILE__, __func__);
+}
+
+struct kms_trace *
+kms_trace_create(int events)
+{
+	struct kms_trace *trace;
+	uint64_t size = 1;
+
+	while (size < (uint64_t)events)
+		size <<= 1;
+
+	trace = calloc(1, sizeof(struct kms_trace) +
+		       size * sizeof(struct kms_trace_record));
+	if (!trace)
+		return NULL;
+
+	trace->mask = size - 1;
+	wl_list_init(&trace->signal_link);
+
+	return trace;
+}
+
+void
+kms_trace_destroy(struct kms_trace *trace)
+{
+	if (!trace)
+		return;
+
+	wl_list_remove(&trace->signal_link);
+	if (kms_trace_signal_source && trace->loop == kms_trace_signal_loop)
+		kms_trace_signal_detach();
+
+	free(trace->path);
+	free(trace);
+}
+
+/*
+ * Lock free; entries recorded concurrently get their own slots. The
+ * oldest entries are overwritten once the ring is full.
+ */
+void
+kms_trace_record(struct kms_trace *trace, enum kms_trace_event event,
+		 int error, uint64_t arg0, uint64_t arg1)
+{
+	uint64_t seq = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+	struct kms_trace_record *r = &trace->records[seq & trace->mask];
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	r->entry.time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	r->entry.event = event;
+	r->entry.error = error;
+	r->entry.arg0 = arg0;
+	r->entry.arg1 = arg1;
+
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static int
+kms_trace_write(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write(fd, p, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		p += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/* Writes the entries currently in the ring to fd */
+int
+kms_trace_dump(struct kms_trace *trace, int fd)
+{
+	struct kms_trace_header header = {
+		.magic = KMS_TRACE_MAGIC,
+		.version = KMS_TRACE_VERSION,
+		.record_size = sizeof(struct kms_trace_entry),
+	};
+	struct kms_trace_entry *entries;
+	struct kms_trace_record *r;
+	uint64_t head, seq;
+	int ret;
+
+	head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	seq = head > trace->mask ? head - trace->mask - 1 : 0;
+
+	if (!(entries = calloc(head - seq + 1, sizeof(struct kms_trace_entry))))
+		return -1;
+
+	for (; seq < head; seq++) {
+		r = &trace->records[seq & trace->mask];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq + 1)
+			continue;
+
+		entries[header.count] = r->entry;
+
+		/* skip it if it was overwritten while we copied it */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq + 1)
+			header.count++;
+	}
+
+	ret = kms_trace_write(fd, &header, sizeof header);
+	if (ret == 0)
+		ret = kms_trace_write(fd, entries,
+				      header.count * sizeof(struct kms_trace_entry));
+
+	free(entries);
+	return ret;
+}
+
+static int
+kms_trace_signal(int signal_number, void *data)
+{
+	struct kms_trace *trace;
+	int fd;
+
+	wl_list_for_each(trace, &kms_trace_signal_list, signal_link) {
+		fd = open(trace->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			WLKMS_DEBUG("%s: %s: can't open %s (%s)\n", __FILE__, __func__,
+				    trace->path, strerror(errno));
+			continue;
+		}
+
+		kms_trace_dump(trace, fd);
+		close(fd);
+	}
+
+	return 0;
+}
+
+/* Dump the trace to path each time the process gets SIGUSR2 */
+int
+kms_trace_dump_on_signal(struct kms_trace *trace, struct wl_event_loop *loop,
+			 const char *path)
+{
+	char *copy;
+
+	if (!(copy = strdup(path)))
+		return -1;
+
+	if (!kms_trace_signal_source && kms_trace_signal_attach(loop) < 0) {
+		free(copy);
+		return -1;
+	}
+
+	free(trace->path);
+	trace->path = copy;
+	trace->loop = loop;
+
+	wl_list_remove(&trace->signal_link);
+	wl_list_insert(kms_trace_signal_list.prev, &trace->signal_link);
+
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef WAYLAND_KMS_TRACE_H
+#define WAYLAND_KMS_TRACE_H
+
+struct kms_trace;
+struct wl_event_loop;
+
+/*
+ * Events recorded in the trace ring. The values are part of the dump
+ * format; only add new ones at the end.
+ */
+enum kms_trace_event {
+	KMS_TRACE_BIND = 1,		/* arg0: version, arg1: client pid */
+	KMS_TRACE_AUTH_START,		/* arg0: magic */
+	KMS_TRACE_AUTH_END,		/* arg0: magic, error: result */
+	KMS_TRACE_IMPORT,		/* arg0: fd, arg1: GEM handle, error: errno */
+	KMS_TRACE_CREATE,		/* arg0: format, arg1: duration in ns */
+	KMS_TRACE_DESTROY,		/* arg0: format, arg1: duration in ns */
+	KMS_TRACE_ERROR,		/* arg0: WL_KMS_ERROR_*, error: errno */
+	KMS_TRACE_ALLOCATE,		/* arg0: format, arg1: duration in ns, error: errno */
+};
+
+extern struct kms_trace *kms_trace_create(int events);
+extern void kms_trace_destroy(struct kms_trace *trace);
+extern void kms_trace_record(struct kms_trace *trace, enum kms_trace_event event,
+			     int error, uint64_t arg0, uint64_t arg1);
+extern int kms_trace_dump(struct kms_trace *trace, int fd);
+extern int kms_trace_dump_on_signal(struct kms_trace *trace,
+				    struct wl_event_loop *loop, const char *path);
+
+/* tracing is off unless a trace ring was created */
+static inline void
+kms_trace(struct kms_trace *trace, enum kms_trace_event event, int error,
+	  uint64_t arg0, uint64_t arg1)
+{
+	if (trace)
+		kms_trace_record(trace, event, error, arg0, arg1);
+}
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <wayland-server-core.h>
+#include "wayland-kms-workqueue.h"
+
+#if defined(DEBUG)
+#	define WLKMS_DEBUG(s, x...) { printf(s, ##x); }
+#else
+#	define WLKMS_DEBUG(s, x...) { }
+#endif
+
+struct kms_workqueue {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;		/* work was submitted, or we quit */
+	pthread_cond_t finished;	/* some work finished */
+	struct wl_list queue;		/* kms_work::link, not started yet */
+	struct wl_list done;		/* kms_work::link, finished */
+	int quit;
+
+	/* the threads signal finished work to the event loop through it */
+	int efd;			/* -1 without a loop */
+	struct wl_event_source *source;
+
+	int num_threads;
+	pthread_t threads[];
+};
+
+static void *kms_workqueue_thread(void *data)
+{
+	struct kms_workqueue *wq = data;
+	struct kms_work *work;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&wq->lock);
+	for (;;) {
+		while (wl_list_empty(&wq->queue) && !wq->quit)
+			pthread_cond_wait(&wq->queued, &wq->lock);
+
+		/* what was submitted is still done before quitting */
+		if (wl_list_empty(&wq->queue))
+			break;
+
+		work = wl_container_of(wq->queue.next, work, link);
+		wl_list_remove(&work->link);
+		pthread_mutex_unlock(&wq->lock);
+
+		work->func(work);
+
+		pthread_mutex_lock(&wq->lock);
+		work->finished = 1;
+		wl_list_insert(wq->done.prev, &work->link);
+		pthread_cond_broadcast(&wq->finished);
+		if (wq->efd >= 0 && write(wq->efd, &one, sizeof one) < 0)
+			WLKMS_DEBUG("%s: %s: %s\n", __FILE__, __func__, strerror(errno));
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	return NULL;
+}
+
+/* Runs done() for the finished work, oldest first */
+static void kms_workqueue_run_done(struct kms_workqueue *wq)
+{
+	struct kms_work *work;
+
+	for (;;) {
+		pthread_mutex_lock(&wq->lock);
+		if (wl_list_empty(&wq->done)) {
+			pthread_mutex_unlock(&wq->lock);
+			return;
+		}
+		work = wl_container_of(wq->done.next, work, link);
+		wl_list_remove(&work->link);
+		pthread_mutex_unlock(&wq->lock);
+
+		work->done(work);
+	}
+}
+
+static int kms_workqueue_handle_event(int fd, uint32_t mask, void *data)
+{
+	struct kms_workqueue *wq = data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		WLKMS_DEBUG("%s: %s: %s\n", __FILE__, __func__, strerror(errno));
+
+	kms_workqueue_run_done(wq);
+	return 0;
+}
+
+struct kms_workqueue *
+kms_workqueue_create(struct wl_event_loop *loop, int threads)
+{
+	struct kms_workqueue *wq;
+
+	if (!(wq = calloc(1, sizeof(struct kms_workqueue) + threads * sizeof(pthread_t))))
+		return NULL;
+
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->queued, NULL);
+	pthread_cond_init(&wq->finished, NULL);
+	wl_list_init(&wq->queue);
+	wl_list_init(&wq->done);
+	wq->efd = -1;
+
+	if (loop) {
+		if ((wq->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+			goto error;
+
+		wq->source = wl_event_loop_add_fd(loop, wq->efd, WL_EVENT_READABLE,
+						  kms_workqueue_handle_event, wq);
+		if (!wq->source)
+			goto error;
+	}
+
+	/* make do with the threads we could start */
+	for (; wq->num_threads < threads; wq->num_threads++) {
+		if (pthread_create(&wq->threads[wq->num_threads], NULL,
+				   kms_workqueue_thread, wq))
+			break;
+	}
+	if (wq->num_threads == 0)
+		goto error;
+
+	return wq;
+
+error:
+	kms_workqueue_destroy(wq);
+	return NULL;
+}
+
+/* Finishes the work submitted so far, and runs its done() */
+void
+kms_workqueue_destroy(struct kms_workqueue *wq)
+{
+	int i;
+
+	if (!wq)
+		return;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->quit = 1;
+	pthread_cond_broadcast(&wq->queued);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->num_threads; i++)
+		pthread_join(wq->threads[i], NULL);
+
+	kms_workqueue_run_done(wq);
+
+	if (wq->source)
+		wl_event_source_remove(wq->source);
+	if (wq->efd >= 0)
+		close(wq->efd);
+
+	pthread_cond_destroy(&wq->finished);
+	pthread_cond_destroy(&wq->queued);
+	pthread_mutex_destroy(&wq->lock);
+	free(wq);
+}
+
+void
+kms_workqueue_submit(struct kms_workqueue *wq, struct kms_work *work)
+{
+	work->finished = 0;
+
+	pthread_mutex_lock(&wq->lock);
+	wl_list_insert(wq->queue.prev, &work->link);
+	pthread_cond_signal(&wq->queued);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* Waits for the work to finish, and runs its done() right away */
+void
+kms_workqueue_wait(struct kms_workqueue *wq, struct kms_work *work)
+{
+	pthread_mutex_lock(&wq->lock);
+	while (!work->finished)
+		pthread_cond_wait(&wq->finished, &wq->lock);
+	wl_list_remove(&work->link);
+	pthread_mutex_unlock(&wq->lock);
+
+	work->done(work);
+}
@@ -0,0 +1,38 @@
+#ifndef WAYLAND_KMS_WORKQUEUE_H
+#define WAYLAND_KMS_WORKQUEUE_H
+
+#include <wayland-util.h>
+
+struct kms_workqueue;
+struct wl_event_loop;
+struct wl_kms;
+
+/*
+ * A unit of work: func runs on one of the threads of the queue, then
+ * done runs on the event loop. done may free the work.
+ */
+struct kms_work {
+	struct wl_list link;
+	void (*func)(struct kms_work *work);
+	void (*done)(struct kms_work *work);
+	int finished;
+};
+
+/*
+ * Without a loop, done only runs from kms_workqueue_wait(), or from
+ * kms_workqueue_destroy() for work nobody waited for.
+ */
+extern struct kms_workqueue *kms_workqueue_create(struct wl_event_loop *loop,
+						  int threads);
+extern void kms_workqueue_destroy(struct kms_workqueue *wq);
+extern void kms_workqueue_submit(struct kms_workqueue *wq, struct kms_work *work);
+extern void kms_workqueue_wait(struct kms_workqueue *wq, struct kms_work *work);
+
+/*
+ * The threads of wayland_kms_map_convert(), started on first use and
+ * kept until wayland_kms_uninit(); NULL if none could be started.
+ */
+extern struct kms_workqueue *kms_get_convert_workqueue(struct wl_kms *kms,
+						       int threads);
+
+#endif
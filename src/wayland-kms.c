@@ -35,13 +35,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 
 #include <xf86drm.h>
+#include <xf86drmMode.h>
 #include <wayland-server.h>
 #include "wayland-kms.h"
 #include "wayland-kms-auth.h"
+#include "wayland-kms-format.h"
+#include "wayland-kms-trace.h"
+#include "wayland-kms-workqueue.h"
 #include "wayland-kms-server-protocol.h"
 
 #include <EGL/egl.h>
@@ -53,20 +63,250 @@
 #	define WLKMS_DEBUG(s, x...) { }
 #endif
 
+/* USDT probes, e.g. for "perf probe sdt_wayland_kms:*" or bpftrace */
+#if defined(HAVE_SYS_SDT_H)
+#	include <sys/sdt.h>
+#	define WLKMS_PROBE(name, x...) STAP_PROBEV(wayland_kms, name, ##x)
+#else
+#	define WLKMS_PROBE(name, x...) { }
+#endif
+
+#define WL_KMS_VERSION 9
+
+/* number of authenticated magics remembered per client */
+#define WL_KMS_AUTH_CACHE_SIZE 4
+
+/* buckets of the GEM handle cache; must be a power of 2 */
+#define KMS_GEM_HASH_SIZE 64
+
+/* wl_kms_buffer pool defaults, and how long it has to be idle to shrink */
+#define KMS_POOL_MIN 8
+#define KMS_POOL_MAX 64
+#define KMS_POOL_IDLE_MS 1000
+
+#define KMS_CACHELINE_SIZE 64
+
+/* worker threads for WL_KMS_FLAG_ASYNC_IMPORT */
+#define KMS_IMPORT_THREADS 2
+
+/* events kept in the trace ring when enabled through the environment */
+#define KMS_TRACE_EVENTS 8192
+
+/* wl_kms.allocate_buffer limits: size if the device has none, and bytes per client */
+#define KMS_ALLOC_MAX_SIZE 16384
+#define KMS_ALLOC_CLIENT_LIMIT (256ull << 20)
+
+#ifndef DMA_BUF_MAGIC
+#define DMA_BUF_MAGIC 0x444d4142	/* "DMAB", since Linux 5.3 */
+#endif
+
 struct wl_kms {
+	struct wl_list link;		/* kms_instances */
+	int refcount;			/* one per wayland_kms_init*() call */
 	struct wl_display *display;
+	struct wl_global *global;
 	int fd;				/* FD for DRM */
+	dev_t rdev;			/* of fd, to tell devices apart */
 	char *device_name;
+	char *render_node_name;		/* advertised to version 3 clients */
+	uint32_t flags;			/* WL_KMS_FLAG_* */
+	struct kms_format_table *format_table;
+
+	/* for wl_kms.allocate_buffer */
+	wl_kms_alloc_func_t alloc;
+	void *alloc_data;
+	int32_t max_width, max_height;	/* of the device */
+	uint64_t alloc_limit;		/* per client, 0 for none */
+
+	struct wl_list clients;		/* wl_kms_client::link */
+	struct wl_list pending;		/* wl_kms_auth_pending::link */
+
+	/* made inert by wayland_kms_uninit() */
+	struct wl_list resources;	/* wl_kms resources */
+	struct wl_list buffers;		/* kms_buffer::kms_link */
+	struct wl_list batches;		/* kms_batch::link */
 
 	struct kms_auth *auth;		/* for nested authentication */
 	int authenticated;
+	struct kms_auth_request *self_auth;	/* our own pending request */
+
+	struct wl_list gem_hash[KMS_GEM_HASH_SIZE];	/* kms_gem::link */
+
+	/* WL_KMS_FLAG_ASYNC_IMPORT */
+	struct kms_workqueue *import_wq;
+	int imports_in_flight;
+	struct wl_array deferred_closes;	/* uint32_t GEM handles */
+	wl_kms_ready_func_t ready;
+	void *ready_data;
+	struct wl_list foreign;		/* kms_foreign_import::kms_link */
+	struct kms_workqueue *convert_wq;	/* wayland_kms_map_convert() */
+	struct wl_kms_stats stats;
+	struct kms_trace *trace;	/* NULL unless tracing */
+	char *trace_path;		/* from WAYLAND_KMS_TRACE */
+
+	/* free kms_buffers kept for reuse */
+	struct {
+		struct kms_buffer *free;
+		int count, min, max;
+		int busy;		/* used since the idle timer last fired */
+		struct wl_event_source *idle_timer;
+	} pool;
+};
+
+/*
+ * A GEM handle imported from a dma-buf. The kernel returns the same
+ * handle each time the same dma-buf is imported, so it is shared by
+ * all the buffers (and planes) using that dma-buf, and closed when the
+ * last of them goes away.
+ *
+ * A dma-buf is identified by its inode, on the dma-buf filesystem. On
+ * kernels without one, dev and ino are 0 and the handle is looked up
+ * after the import instead.
+ */
+struct kms_gem {
+	struct wl_list link;		/* wl_kms::gem_hash */
+	dev_t dev;
+	ino_t ino;
+	uint32_t handle;
+	int refcount;
+};
+
+/* Our view of a wl_kms_buffer */
+struct kms_buffer {
+	struct wl_kms_buffer base;
+	struct wl_kms_buffer_desc desc;	/* what renderers look at each frame */
+	const struct kms_format_info *info;
+	struct wl_list kms_link;	/* wl_kms::buffers */
+	struct wl_resource *kms_resource;	/* wl_kms the buffer came from */
+	int imported;			/* 0: not yet, 1: done, -1: failed */
+	struct kms_gem *gem[MAX_PLANES];
+	struct kms_import_job *import_job;	/* while imported by a worker */
+	struct kms_buffer *next_free;	/* wl_kms::pool */
+	int format_index;		/* in wl_kms::stats.formats */
+	uint64_t alloc_size;		/* allocated by us for the client */
+
+	/* KMS framebuffer, created on demand */
+	int fb_state;			/* 0: not yet, 1: created, -1: failed */
+	uint32_t fb_id;
+
+	/* imports into other devices */
+	struct wl_list foreign;		/* kms_foreign_import::buffer_link */
+
+	/* passed on to our server, see wayland_kms_buffer_forward() */
+	struct kms_auth_buffer *forward;
+
+	/* last scanout_hint sent */
+	uint32_t hint_format;
+	int32_t hint_width, hint_height;
+
+	/* explicit synchronization */
+	int acquire_fence;
+	struct wl_list fence_waits;	/* wl_kms_fence_wait::link */
+	struct wl_list releases;	/* wl_kms_buffer_release resources */
+
+	/* while waiting in a wl_kms_buffer_batch */
+	struct wl_list link;		/* kms_batch::buffers */
+	struct wl_listener batch_destroy_listener;
+};
+
+/*
+ * An import done by a worker thread for WL_KMS_FLAG_ASYNC_IMPORT. The
+ * worker only gets the GEM handles; they are matched with the cache
+ * back on the event loop.
+ */
+struct kms_import_job {
+	struct kms_work work;
+	struct wl_kms *kms;
+	struct kms_buffer *kb;		/* NULL once the buffer is gone */
+	int num_planes;
+	int32_t fds[MAX_PLANES];	/* the buffer's, ours once it is gone */
+
+	/* results for the first num_imported planes */
+	int num_imported;
+	uint32_t handles[MAX_PLANES];
+	dev_t devs[MAX_PLANES];
+	ino_t inos[MAX_PLANES];
+	int error;			/* errno of the failed import */
+};
+
+/* A buffer imported into a wl_kms other than the one it belongs to */
+struct kms_foreign_import {
+	struct wl_list buffer_link;	/* kms_buffer::foreign */
+	struct wl_list kms_link;	/* wl_kms::foreign */
+	struct wl_kms *kms;
+	int num_planes;
+	struct kms_gem *gem[MAX_PLANES];
+};
+
+struct wl_kms_fence_wait {
+	struct wl_list link;		/* kms_buffer::fence_waits */
+	struct wl_kms_buffer *buffer;
+	struct wl_event_source *source;
+	int fence;
+	wl_kms_fence_func_t func;
+	void *data;
 };
 
+struct kms_batch {
+	struct wl_list link;		/* wl_kms::batches */
+	struct wl_resource *resource;
+	struct wl_kms *kms;		/* NULL once wl_kms is gone */
+	struct wl_resource *kms_resource;
+	int32_t width, height;
+	const struct kms_format_info *info;
+	int committed;
+	struct wl_list buffers;		/* kms_buffer::link */
+};
+
+/*
+ * Magics a client got authenticated already. A reconnecting client
+ * sends the magic of the same DRM file again; we answer right away.
+ */
+struct wl_kms_client {
+	struct wl_list link;		/* wl_kms::clients */
+	struct wl_client *client;
+	struct wl_listener destroy_listener;
+
+	uint32_t magics[WL_KMS_AUTH_CACHE_SIZE];
+	int num_magics, next_magic;
+};
+
+/* A client authentication forwarded to our server, waiting for its reply */
+struct wl_kms_auth_pending {
+	struct wl_list link;		/* wl_kms::pending */
+	struct wl_resource *resource;
+	uint32_t magic;
+	struct kms_auth_request *request;
+	struct wl_listener destroy_listener;
+	uint64_t start;			/* for wl_kms::stats.auth_latency */
+};
+
+/* all the wl_kms, of all displays */
+static struct wl_list kms_instances = { &kms_instances, &kms_instances };
+
 /*
  * wl_kms server
  */
 
-static void close_drm_handle(int fd, uint32_t handle)
+static uint64_t kms_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void kms_stats_auth_latency(struct wl_kms *kms, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (bucket >= WL_KMS_STATS_LATENCY_BUCKETS)
+		bucket = WL_KMS_STATS_LATENCY_BUCKETS - 1;
+	kms->stats.auth_latency[bucket]++;
+}
+
+static int close_drm_handle(int fd, uint32_t handle)
 {
 	struct drm_gem_close gem_close = { .handle = handle };
 	int ret;
@@ -76,359 +316,2526 @@ static void close_drm_handle(int fd, uint32_t handle)
 		WLKMS_DEBUG("%s: %s: DRM_IOCTL_GEM_CLOSE failed.(%s)\n",
 			 __FILE__, __func__, strerror(errno));
 
+	return ret;
 }
 
-static void destroy_buffer(struct wl_resource *resource)
+/*
+ * Gets what identifies the dma-buf fd is, for the cache. Only dma-bufs
+ * are looked up there: any other file could have the same inode
+ * number, and would get the GEM handle of another client's buffer.
+ */
+static int kms_gem_identify(int fd, dev_t *dev, ino_t *ino)
 {
-	struct wl_kms_buffer *buffer = resource->data;
-	int i;
+	struct statfs sfs;
+	struct stat st;
 
-	for (i = 0; i < buffer->num_planes; i++) {
-		close(buffer->planes[i].fd);
-		close_drm_handle(buffer->kms->fd, buffer->planes[i].handle);
-	}
+	*dev = 0;
+	*ino = 0;
 
-	free(buffer);
+	if (fstatfs(fd, &sfs) || sfs.f_type != DMA_BUF_MAGIC || fstat(fd, &st))
+		return -1;
+
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+	return 0;
 }
 
-static void
-buffer_destroy(struct wl_client *client, struct wl_resource *resource)
+static struct wl_list *kms_gem_bucket(struct wl_kms *kms, dev_t dev, ino_t ino)
 {
-	wl_resource_destroy(resource);
-}
+	uint32_t hash = (uint32_t)(ino ^ dev) * 2654435761u;
 
-const static struct wl_buffer_interface kms_buffer_interface = {
-	.destroy = buffer_destroy
-};
+	return &kms->gem_hash[hash >> 26 & (KMS_GEM_HASH_SIZE - 1)];
+}
 
-static void
-kms_authenticate(struct wl_client *client, struct wl_resource *resource,
-		 uint32_t magic)
+static struct kms_gem *kms_gem_find(struct wl_list *bucket, dev_t dev, ino_t ino)
 {
-	struct wl_kms *kms = resource->data;
-	int err;
-
-	WLKMS_DEBUG("%s: %s: magic=%lu\n", __FILE__, __func__, magic);
+	struct kms_gem *gem;
 
-	if (kms->auth) {
-		err = kms_auth_request(kms->auth, magic);
-	} else {
-		err = drmAuthMagic(kms->fd, magic);
+	wl_list_for_each(gem, bucket, link) {
+		if (gem->ino == ino && gem->dev == dev)
+			return gem;
 	}
 
-	if (err < 0) {
-		wl_resource_post_error(resource, WL_KMS_ERROR_AUTHENTICATION_FAILED,
-				       "authentication failed");
-		WLKMS_DEBUG("%s: %s: authentication failed.\n", __FILE__, __func__);
-	} else {
-		wl_resource_post_event(resource, WL_KMS_AUTHENTICATED);
-		WLKMS_DEBUG("%s: %s: authentication succeeded.\n", __FILE__, __func__);
-	}
+	return NULL;
 }
 
-/* Note: This API closes unused fds passed through its call. */
-static void
-kms_create_mp_buffer(struct wl_client *client, struct wl_resource *resource,
-		     uint32_t id, int32_t width, int32_t height, uint32_t format,
-		     int32_t fd0, uint32_t stride0, int32_t fd1, uint32_t stride1,
-		     int32_t fd2, uint32_t stride2)
+/* For dma-bufs we can't identify; only the kernel knows it is the same */
+static struct kms_gem *kms_gem_find_handle(struct wl_kms *kms, uint32_t handle)
 {
-	struct wl_kms *kms = resource->data;
-	struct wl_kms_buffer *buffer;
-	int err, nplanes;
-
-	switch (format) {
-	case WL_KMS_FORMAT_ARGB8888:
-	case WL_KMS_FORMAT_XRGB8888:
-	case WL_KMS_FORMAT_ABGR8888:
-	case WL_KMS_FORMAT_XBGR8888:
-	case WL_KMS_FORMAT_RGB888:
-	case WL_KMS_FORMAT_BGR888:
-	case WL_KMS_FORMAT_YUYV:
-	case WL_KMS_FORMAT_YVYU:
-	case WL_KMS_FORMAT_UYVY:
-	case WL_KMS_FORMAT_RGB565:
-	case WL_KMS_FORMAT_BGR565:
-	case WL_KMS_FORMAT_RGB332:
-		nplanes = 1;
-		break;
-
-	case WL_KMS_FORMAT_NV12:
-	case WL_KMS_FORMAT_NV21:
-	case WL_KMS_FORMAT_NV16:
-	case WL_KMS_FORMAT_NV61:
-		nplanes = 2;
-		break;
-
-	case WL_KMS_FORMAT_YUV420:
-		nplanes = 3;
-		break;
+	struct kms_gem *gem;
+	int i;
 
-	default:
-		wl_resource_post_error(resource,
-				       WL_KMS_ERROR_INVALID_FORMAT,
-				       "invalid format");
-		return;
+	for (i = 0; i < KMS_GEM_HASH_SIZE; i++) {
+		wl_list_for_each(gem, &kms->gem_hash[i], link) {
+			if (gem->handle == handle)
+				return gem;
+		}
 	}
 
-	/* Wayland passes dup'd fds that must be closed when
-	   no longer needed. Close the unused ones
-	   immediately to avoid leaking them. */
-	if (fd1 != WL_KMS_INVALID_FD && nplanes < 2)
-		close(fd1);
-	if (fd2 != WL_KMS_INVALID_FD && nplanes < 3)
-		close(fd2);
+	return NULL;
+}
 
-	if (!kms->authenticated) {
-		drm_magic_t magic;
+static struct kms_gem *kms_gem_lookup(struct wl_kms *kms, dev_t dev, ino_t ino,
+				      uint32_t handle)
+{
+	if (!ino)
+		return kms_gem_find_handle(kms, handle);
 
-		/* authenticate myself */
-		if (drmGetMagic(kms->fd, &magic) ||
-		    kms_auth_request(kms->auth, magic)) {
-			wl_resource_post_error(resource,
-				    WL_KMS_ERROR_AUTHENTICATION_FAILED, "authentication failed");
-			WLKMS_DEBUG("%s: %s: authentication failed.\n", __FILE__, __func__);
-			return;
-		}
+	return kms_gem_find(kms_gem_bucket(kms, dev, ino), dev, ino);
+}
 
-		kms->authenticated = 1;
+/* Caches a handle that no kms_gem holds */
+static struct kms_gem *kms_gem_insert(struct wl_kms *kms, dev_t dev, ino_t ino,
+				      uint32_t handle)
+{
+	struct kms_gem *gem;
+	uint32_t *h;
+
+	if (!(gem = calloc(1, sizeof(struct kms_gem))))
+		return NULL;
+
+	/* the handle is alive again if its close was deferred */
+	wl_array_for_each(h, &kms->deferred_closes) {
+		if (*h == handle)
+			*h = 0;
 	}
 
-	buffer = calloc(1, sizeof *buffer);
-	if (buffer == NULL) {
-		wl_resource_post_no_memory(resource);
-		return;
+	gem->dev = dev;
+	gem->ino = ino;
+	gem->handle = handle;
+	gem->refcount = 1;
+	wl_list_insert(kms_gem_bucket(kms, dev, ino), &gem->link);
+	kms->stats.import.handles++;
+
+	return gem;
+}
+
+static struct kms_gem *kms_gem_import(struct wl_kms *kms, int fd)
+{
+	struct kms_gem *gem;
+	uint32_t handle;
+	dev_t dev;
+	ino_t ino;
+
+	if (kms_gem_identify(fd, &dev, &ino) == 0 &&
+	    (gem = kms_gem_find(kms_gem_bucket(kms, dev, ino), dev, ino))) {
+		gem->refcount++;
+		kms->stats.import.hits++;
+		kms_trace(kms->trace, KMS_TRACE_IMPORT, 0, fd, gem->handle);
+		return gem;
 	}
 
-	buffer->kms = kms;
-	buffer->width = width;
-	buffer->height = height;
-	buffer->format = format;
-	buffer->num_planes = nplanes;
-	buffer->stride = buffer->planes[0].stride = stride0;
-	buffer->fd = buffer->planes[0].fd = fd0;
+	if (drmPrimeFDToHandle(kms->fd, fd, &handle)) {
+		WLKMS_PROBE(import_failed, fd, errno);
+		kms_trace(kms->trace, KMS_TRACE_IMPORT, errno, fd, 0);
+		kms->stats.import_failures++;
+		return NULL;
+	}
 
-	err = drmPrimeFDToHandle(kms->fd, fd0, &buffer->planes[0].handle);
-	if (err)
-		goto invalid_fd_error;
-	buffer->handle = buffer->planes[0].handle;
+	WLKMS_PROBE(import, fd, handle);
+	kms_trace(kms->trace, KMS_TRACE_IMPORT, 0, fd, handle);
 
-	if (nplanes > 1) {
-		buffer->planes[1].stride = stride1;
-		buffer->planes[1].fd = fd1;
-		err = drmPrimeFDToHandle(kms->fd, fd1, &buffer->planes[1].handle);
-		if (err) {
-			close_drm_handle(kms->fd, buffer->planes[0].handle);
-			goto invalid_fd_error;
-		}
+	if (!ino && (gem = kms_gem_find_handle(kms, handle))) {
+		gem->refcount++;
+		kms->stats.import.hits++;
+		return gem;
 	}
 
-	if (nplanes > 2) {
-		buffer->planes[2].stride = stride2;
-		buffer->planes[2].fd = fd2;
-		err = drmPrimeFDToHandle(kms->fd, fd2, &buffer->planes[2].handle);
-		if (err) {
-			close_drm_handle(kms->fd, buffer->planes[0].handle);
-			close_drm_handle(kms->fd, buffer->planes[1].handle);
-			goto invalid_fd_error;
-		}
+	if (!(gem = kms_gem_insert(kms, dev, ino, handle))) {
+		close_drm_handle(kms->fd, handle);
+		return NULL;
 	}
+	kms->stats.import.misses++;
 
-	WLKMS_DEBUG("%s: %s: %d planes (%d, %d, %d)\n", __FILE__, __func__, nplanes, fd0, fd1, fd2);
+	return gem;
+}
 
-	// XXX: Do we need to support multiplaner KMS BO?
+/*
+ * Like kms_gem_import(), for a dma-buf we have the handle of already,
+ * e.g. because we exported it. The handle is closed with the kms_gem.
+ */
+static struct kms_gem *kms_gem_adopt(struct wl_kms *kms, dev_t dev, ino_t ino,
+				     uint32_t handle)
+{
+	struct kms_gem *gem;
 
-	// We create a wl_buffer
-	buffer->resource = wl_resource_create(client, &wl_buffer_interface, 1, id);
-	if (!buffer->resource) {
-		wl_resource_post_no_memory(resource);
-		free(buffer);
-		return;
+	/* a GEM object has one handle per DRM file; it is this one */
+	if ((gem = kms_gem_lookup(kms, dev, ino, handle))) {
+		gem->refcount++;
+		return gem;
 	}
 
-	wl_resource_set_implementation(buffer->resource, &kms_buffer_interface,
-				       buffer, destroy_buffer);
-	return;
+	return kms_gem_insert(kms, dev, ino, handle);
+}
 
-invalid_fd_error:
-	WLKMS_DEBUG("%s: %s: drmPrimeFDToHandle() failed...%d (%s)\n", __FILE__, __func__, err, strerror(errno));
-	wl_resource_post_error(resource, WL_KMS_ERROR_INVALID_FD, "invalid prime FD");
-	free(buffer);
+/*
+ * A worker importing a dma-buf we are closing the handle of would get
+ * the same handle, and lose it under its feet. So handles are only
+ * closed while no import is in flight.
+ */
+static void kms_gem_close(struct wl_kms *kms, uint32_t handle)
+{
+	uint32_t *h;
+
+	if (kms->imports_in_flight > 0 &&
+	    (h = wl_array_add(&kms->deferred_closes, sizeof *h))) {
+		*h = handle;
+		return;
+	}
+
+	if (close_drm_handle(kms->fd, handle))
+		kms->stats.gem_close_failures++;
 }
 
+static void kms_gem_close_deferred(struct wl_kms *kms)
+{
+	uint32_t *h;
+
+	wl_array_for_each(h, &kms->deferred_closes) {
+		if (*h && close_drm_handle(kms->fd, *h))
+			kms->stats.gem_close_failures++;
+	}
+	kms->deferred_closes.size = 0;
+}
 
-static void
-kms_create_buffer(struct wl_client *client, struct wl_resource *resource,
-		  uint32_t id, int32_t prime_fd, int32_t width, int32_t height,
-		  uint32_t stride, uint32_t format, uint32_t handle)
+static void kms_gem_unref(struct wl_kms *kms, struct kms_gem *gem)
 {
-	kms_create_mp_buffer(client, resource, id, width, height, format, prime_fd, stride,
-			     WL_KMS_INVALID_FD, 0, WL_KMS_INVALID_FD, 0);
+	if (--gem->refcount > 0)
+		return;
+
+	kms_gem_close(kms, gem->handle);
+	kms->stats.gem_closes++;
+	wl_list_remove(&gem->link);
+	free(gem);
+	kms->stats.import.handles--;
 }
 
-const static struct wl_kms_interface kms_interface = {
-	.authenticate = kms_authenticate,
-	.create_buffer = kms_create_buffer,
-	.create_mp_buffer = kms_create_mp_buffer,
-};
+/*
+ * kms_buffer pool
+ *
+ * Clients cycling through buffers would otherwise hit malloc for each
+ * of them. Buffers are kept on a free list up to pool.max, and the
+ * pool shrinks back to pool.min once it has been idle for a while.
+ */
 
-static void
-bind_kms(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+static size_t kms_buffer_slot_size(void)
 {
-	struct wl_kms *kms = data;
-	struct wl_resource *resource;
+	return (sizeof(struct kms_buffer) + KMS_CACHELINE_SIZE - 1) &
+		~(size_t)(KMS_CACHELINE_SIZE - 1);
+}
 
-	resource = wl_resource_create(client, &wl_kms_interface, version, id);
-	if (!resource) {
-		wl_client_post_no_memory(client);
-		return;
+static void kms_pool_trim(struct wl_kms *kms, int count)
+{
+	struct kms_buffer *kb;
+
+	while (kms->pool.count > count) {
+		kb = kms->pool.free;
+		kms->pool.free = kb->next_free;
+		kms->pool.count--;
+		free(kb);
 	}
+}
 
-	wl_resource_set_implementation(resource, &kms_interface, data, NULL);
+static void kms_pool_fill(struct wl_kms *kms, int count)
+{
+	struct kms_buffer *kb;
 
-	wl_resource_post_event(resource, WL_KMS_DEVICE, kms->device_name);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_ARGB8888);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_XRGB8888);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_ABGR8888);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_XBGR8888);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_RGB888);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_BGR888);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_YUYV);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_YVYU);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_UYVY);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_RGB565);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_BGR565);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_RGB332);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_NV12);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_NV21);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_NV16);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_NV61);
-	wl_resource_post_event(resource, WL_KMS_FORMAT, WL_KMS_FORMAT_YUV420);
+	while (kms->pool.count < count) {
+		if (posix_memalign((void **)&kb, KMS_CACHELINE_SIZE,
+				   kms_buffer_slot_size()))
+			return;
+		kb->next_free = kms->pool.free;
+		kms->pool.free = kb;
+		kms->pool.count++;
+	}
 }
 
-int wayland_kms_fd_get(struct wl_kms* kms)
+static int kms_pool_idle(void *data)
 {
-	return kms->fd;
-}
+	struct wl_kms *kms = data;
+
+	if (kms->pool.busy) {
+		kms->pool.busy = 0;
+		wl_event_source_timer_update(kms->pool.idle_timer, KMS_POOL_IDLE_MS);
+	} else {
+		kms_pool_trim(kms, kms->pool.min);
+	}
 
-static struct wl_kms *wl_kms_entity = NULL;
+	return 0;
+}
 
-struct wl_kms_buffer *wayland_kms_buffer_get(struct wl_resource *resource)
+static void kms_pool_mark_busy(struct wl_kms *kms)
 {
-	if (!wl_kms_entity || resource == NULL)
-		return NULL;
+	/* the timer is armed only once per idle period */
+	if (kms->pool.busy || !kms->pool.idle_timer)
+		return;
 
-	if (wl_resource_instance_of(resource, &wl_buffer_interface,
-				    &kms_buffer_interface))
-		return wl_resource_get_user_data(resource);
-	else
-		return NULL;
+	kms->pool.busy = 1;
+	wl_event_source_timer_update(kms->pool.idle_timer, KMS_POOL_IDLE_MS);
 }
 
-struct wl_kms *wayland_kms_init(struct wl_display *display,
-				struct wl_display *server, char *device_name, int fd)
+static struct kms_buffer *kms_buffer_alloc(struct wl_kms *kms)
 {
-	if (wl_kms_entity)
-		return wl_kms_entity;
+	struct kms_buffer *kb;
 
-	if (!(wl_kms_entity = calloc(1, sizeof(struct wl_kms))))
+	kms_pool_mark_busy(kms);
+
+	if ((kb = kms->pool.free)) {
+		kms->pool.free = kb->next_free;
+		kms->pool.count--;
+	} else if (posix_memalign((void **)&kb, KMS_CACHELINE_SIZE,
+				  kms_buffer_slot_size())) {
 		return NULL;
+	}
 
-	wl_kms_entity->display = display;
-	wl_kms_entity->device_name = strdup(device_name);
-	wl_kms_entity->fd = fd;
+	memset(kb, 0, sizeof *kb);
+	return kb;
+}
 
-	if (!wl_global_create(display, &wl_kms_interface, 2, wl_kms_entity, bind_kms))
-		goto error;
+static void kms_buffer_free(struct wl_kms *kms, struct kms_buffer *kb)
+{
+	kms_pool_mark_busy(kms);
 
-	/*
-	 * we're the server in the middle. we should forward the all
-	 * client authentication requests to our server.  We may
-	 * also need to authenticate ourselves later if we provide buffers
-	 * to clients.
-	 */
-	if (server) {
-		if (!(wl_kms_entity->auth = kms_auth_init(server)))
-			goto error;
-	} else {
-		wl_kms_entity->authenticated = 1;
+	if (kms->pool.count >= kms->pool.max) {
+		free(kb);
+		return;
 	}
 
-	return wl_kms_entity;
-
-error:
-	kms_auth_uninit(wl_kms_entity->auth);
-	free(wl_kms_entity->device_name);
-	free(wl_kms_entity);
-	wl_kms_entity = NULL;
+	kb->next_free = kms->pool.free;
+	kms->pool.free = kb;
+	kms->pool.count++;
+}
 
-	return NULL;
+static void kms_fence_wait_destroy(struct wl_kms_fence_wait *wait)
+{
+	wl_list_remove(&wait->link);
+	if (wait->source)
+		wl_event_source_remove(wait->source);
+	if (wait->fence >= 0)
+		close(wait->fence);
+	free(wait);
 }
 
-void wayland_kms_uninit(struct wl_kms *kms)
+static void kms_foreign_import_destroy(struct kms_foreign_import *fi)
 {
-	if (kms != wl_kms_entity)
-		return;
+	int i;
 
-	kms_auth_uninit(kms->auth);
-	free(kms->device_name);
-	free(kms);
+	for (i = 0; i < fi->num_planes; i++)
+		kms_gem_unref(fi->kms, fi->gem[i]);
 
-	/* FIXME: need wl_display_del_{object,global} */
-	wl_kms_entity = NULL;
+	wl_list_remove(&fi->buffer_link);
+	wl_list_remove(&fi->kms_link);
+	free(fi);
 }
 
-uint32_t wayland_kms_buffer_get_format(struct wl_kms_buffer *buffer)
+static void kms_buffer_close_fds(struct kms_buffer *kb)
 {
-	return buffer->format;
+	struct wl_kms_buffer *buffer = &kb->base;
+	int i;
+
+	for (i = 0; i < buffer->num_planes; i++) {
+		if (buffer->planes[i].fd == WL_KMS_INVALID_FD)
+			continue;
+		close(buffer->planes[i].fd);
+		buffer->planes[i].fd = WL_KMS_INVALID_FD;
+		buffer->kms->stats.fds--;
+	}
+	buffer->fd = WL_KMS_INVALID_FD;
 }
 
-static
-int wayland_kms_get_texture_format(struct wl_kms_buffer *buffer)
+/* WL_KMS_FLAG_DROP_FDS: once imported, the GEM handles keep the buffer */
+static void kms_buffer_drop_fds(struct kms_buffer *kb)
 {
-	switch (buffer->format) {
-	case WL_KMS_FORMAT_ARGB8888:
-	case WL_KMS_FORMAT_ABGR8888:
-		return EGL_TEXTURE_RGBA;
+	if ((kb->base.kms->flags & WL_KMS_FLAG_DROP_FDS) && kb->imported > 0)
+		kms_buffer_close_fds(kb);
+}
 
-	case WL_KMS_FORMAT_XRGB8888:
-	case WL_KMS_FORMAT_XBGR8888:
-	case WL_KMS_FORMAT_RGB888:
-	case WL_KMS_FORMAT_BGR888:
-	case WL_KMS_FORMAT_RGB565:
-	case WL_KMS_FORMAT_BGR565:
-	case WL_KMS_FORMAT_RGB332:
-		return EGL_TEXTURE_RGB;
+/*
+ * An fd for the plane, to be given back with kms_buffer_put_fd(). It is
+ * the one we hold, or exported again if it was dropped.
+ */
+static int kms_buffer_get_fd(struct kms_buffer *kb, int plane)
+{
+	if (kb->base.planes[plane].fd != WL_KMS_INVALID_FD)
+		return kb->base.planes[plane].fd;
 
-	case WL_KMS_FORMAT_NV12:
-	case WL_KMS_FORMAT_NV21:
-	case WL_KMS_FORMAT_NV16:
-	case WL_KMS_FORMAT_NV61:
-		return EGL_TEXTURE_EXTERNAL_WL;
+	return wayland_kms_buffer_get_plane_fd(&kb->base, plane);
+}
 
-	default:
-		return 0;
-	}
+static void kms_buffer_put_fd(struct kms_buffer *kb, int plane, int fd)
+{
+	if (fd >= 0 && fd != kb->base.planes[plane].fd)
+		close(fd);
 }
 
-int wayland_kms_query_buffer(struct wl_kms *kms, struct wl_resource *resource,
-				enum wl_kms_attribute attr, int *value)
+/* Close the fds and GEM handles of the buffer, and free it */
+static void kms_buffer_release(struct kms_buffer *kb)
 {
-	struct wl_kms_buffer *buffer = wayland_kms_buffer_get(resource);
-	if (!buffer)
-		return -1;
+	struct wl_kms_buffer *buffer = &kb->base;
+	struct wl_kms_fence_wait *wait, *wait_tmp;
+	struct kms_foreign_import *fi, *fi_tmp;
+	int i;
 
-	switch (attr) {
-	case WL_KMS_WIDTH:
-		*value = buffer->width;
-		return 0;
+	/* the buffer is gone; nothing will access it any more */
+	wayland_kms_buffer_send_release(buffer, -1);
+	wl_list_for_each_safe(wait, wait_tmp, &kb->fence_waits, link)
+		kms_fence_wait_destroy(wait);
+	if (kb->acquire_fence >= 0)
+		close(kb->acquire_fence);
 
-	case WL_KMS_HEIGHT:
-		*value = buffer->height;
+	if (kb->fb_state > 0)
+		drmModeRmFB(buffer->kms->fd, kb->fb_id);
+
+	kms_auth_buffer_destroy(kb->forward);
+
+	wl_list_for_each_safe(fi, fi_tmp, &kb->foreign, buffer_link)
+		kms_foreign_import_destroy(fi);
+
+	buffer->kms->stats.buffers--;
+	buffer->kms->stats.planes -= buffer->num_planes;
+	if (kb->format_index >= 0)
+		buffer->kms->stats.formats[kb->format_index].buffers--;
+
+	/* a worker still uses the fds; the job closes them once done */
+	if (kb->import_job) {
+		kb->import_job->kb = NULL;
+		kb->import_job = NULL;
+	} else {
+		kms_buffer_close_fds(kb);
+	}
+
+	for (i = 0; i < buffer->num_planes && kb->imported > 0; i++)
+		kms_gem_unref(buffer->kms, kb->gem[i]);
+
+	wl_list_remove(&kb->kms_link);
+	kms_buffer_free(buffer->kms, kb);
+}
+
+static void destroy_buffer(struct wl_resource *resource)
+{
+	struct wl_kms_buffer *buffer = resource->data;
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+	struct wl_kms *kms = buffer->kms;
+	uint32_t format = buffer->format;
+	uint64_t start = kms_stats_now(), time;
+
+	WLKMS_PROBE(destroy_buffer, buffer);
+
+	if (kb->imported == 0 && !kb->import_job)
+		kms->stats.import.avoided++;
+
+	kms_buffer_release(kb);
+
+	time = kms_stats_now() - start;
+	kms->stats.destroys++;
+	kms->stats.destroy_ns += time;
+	kms_trace(kms->trace, KMS_TRACE_DESTROY, 0, format, time);
+}
+
+static void
+buffer_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+const static struct wl_buffer_interface kms_buffer_interface = {
+	.destroy = buffer_destroy
+};
+
+/*
+ * The wl_kms resources left after wayland_kms_uninit() have no wl_kms.
+ * Their requests still create the objects the client asked for, which
+ * never get a wl_kms_buffer attached.
+ */
+static struct wl_resource *
+kms_create_inert_buffer(struct wl_client *client, struct wl_resource *resource,
+			uint32_t id)
+{
+	struct wl_resource *buffer_resource;
+
+	buffer_resource = wl_resource_create(client, &wl_buffer_interface, 1, id);
+	if (!buffer_resource) {
+		wl_resource_post_no_memory(resource);
+		return NULL;
+	}
+
+	wl_resource_set_implementation(buffer_resource, &kms_buffer_interface,
+				       NULL, NULL);
+	return buffer_resource;
+}
+
+static void
+kms_client_destroy(struct wl_listener *listener, void *data)
+{
+	struct wl_kms_client *kc = wl_container_of(listener, kc, destroy_listener);
+
+	wl_list_remove(&kc->link);
+	free(kc);
+}
+
+static struct wl_kms_client *
+kms_client_get(struct wl_kms *kms, struct wl_client *client, int create)
+{
+	struct wl_kms_client *kc;
+
+	wl_list_for_each(kc, &kms->clients, link) {
+		if (kc->client == client)
+			return kc;
+	}
+
+	if (!create || !(kc = calloc(1, sizeof(struct wl_kms_client))))
+		return NULL;
+
+	kc->client = client;
+	kc->destroy_listener.notify = kms_client_destroy;
+	wl_client_add_destroy_listener(client, &kc->destroy_listener);
+	wl_list_insert(&kms->clients, &kc->link);
+
+	return kc;
+}
+
+static int
+kms_client_is_authenticated(struct wl_kms *kms, struct wl_client *client,
+			    uint32_t magic)
+{
+	struct wl_kms_client *kc = kms_client_get(kms, client, 0);
+	int i;
+
+	if (!kc)
+		return 0;
+
+	for (i = 0; i < kc->num_magics; i++) {
+		if (kc->magics[i] == magic)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+kms_client_set_authenticated(struct wl_kms *kms, struct wl_client *client,
+			     uint32_t magic)
+{
+	struct wl_kms_client *kc = kms_client_get(kms, client, 1);
+
+	/* not caching only costs us another authentication later */
+	if (!kc)
+		return;
+
+	kc->magics[kc->next_magic] = magic;
+	kc->next_magic = (kc->next_magic + 1) % WL_KMS_AUTH_CACHE_SIZE;
+	if (kc->num_magics < WL_KMS_AUTH_CACHE_SIZE)
+		kc->num_magics++;
+}
+
+static void
+kms_send_auth_result(struct wl_resource *resource, uint32_t magic, int err)
+{
+	struct wl_kms *kms = resource->data;
+
+	kms_trace(kms->trace, KMS_TRACE_AUTH_END, err, magic, 0);
+
+	if (err < 0) {
+		kms->stats.auth_failures++;
+		wl_resource_post_error(resource, WL_KMS_ERROR_AUTHENTICATION_FAILED,
+				       "authentication failed");
+		WLKMS_DEBUG("%s: %s: authentication failed.\n", __FILE__, __func__);
+	} else {
+		kms_client_set_authenticated(kms, wl_resource_get_client(resource),
+					     magic);
+		wl_resource_post_event(resource, WL_KMS_AUTHENTICATED);
+		WLKMS_DEBUG("%s: %s: authentication succeeded.\n", __FILE__, __func__);
+	}
+}
+
+static void
+kms_auth_pending_free(struct wl_kms_auth_pending *pending)
+{
+	wl_list_remove(&pending->link);
+	wl_list_remove(&pending->destroy_listener.link);
+	free(pending);
+}
+
+static void
+kms_auth_pending_done(void *data, int result)
+{
+	struct wl_kms_auth_pending *pending = data;
+	struct wl_kms *kms = pending->resource->data;
+
+	kms_stats_auth_latency(kms, kms_stats_now() - pending->start);
+	WLKMS_PROBE(auth_done, pending->magic, result);
+
+	kms_send_auth_result(pending->resource, pending->magic, result);
+	kms_auth_pending_free(pending);
+}
+
+static void
+kms_auth_pending_destroy(struct wl_listener *listener, void *data)
+{
+	struct wl_kms_auth_pending *pending =
+		wl_container_of(listener, pending, destroy_listener);
+
+	/* the client went away before our server replied */
+	kms_auth_cancel(pending->request);
+	kms_auth_pending_free(pending);
+}
+
+static void
+kms_authenticate(struct wl_client *client, struct wl_resource *resource,
+		 uint32_t magic)
+{
+	struct wl_kms *kms = resource->data;
+	struct wl_kms_auth_pending *pending;
+
+	if (!kms)
+		return;
+
+	WLKMS_DEBUG("%s: %s: magic=%lu\n", __FILE__, __func__, magic);
+	WLKMS_PROBE(auth_request, magic);
+	kms_trace(kms->trace, KMS_TRACE_AUTH_START, 0, magic, 0);
+
+	kms->stats.auth_requests++;
+
+	if (kms_client_is_authenticated(kms, client, magic)) {
+		kms->stats.auth_cached++;
+		kms_trace(kms->trace, KMS_TRACE_AUTH_END, 0, magic, 0);
+		wl_resource_post_event(resource, WL_KMS_AUTHENTICATED);
+		return;
+	}
+
+	if (!kms->auth) {
+		kms_send_auth_result(resource, magic, drmAuthMagic(kms->fd, magic));
+		return;
+	}
+
+	/*
+	 * The reply is sent once our server answers, so that we keep
+	 * serving other clients in the meantime.
+	 */
+	if (!(pending = calloc(1, sizeof(struct wl_kms_auth_pending)))) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	pending->resource = resource;
+	pending->magic = magic;
+	pending->start = kms_stats_now();
+	pending->request = kms_auth_request(kms->auth, magic,
+					    kms_auth_pending_done, pending);
+	if (!pending->request) {
+		free(pending);
+		kms_send_auth_result(resource, magic, -1);
+		return;
+	}
+
+	pending->destroy_listener.notify = kms_auth_pending_destroy;
+	wl_resource_add_destroy_listener(resource, &pending->destroy_listener);
+	wl_list_insert(&kms->pending, &pending->link);
+}
+
+static void
+kms_self_auth_done(void *data, int result)
+{
+	struct wl_kms *kms = data;
+
+	kms->self_auth = NULL;
+	kms->authenticated = result < 0 ? -1 : 1;
+}
+
+static int
+kms_self_auth_start(struct wl_kms *kms)
+{
+	drm_magic_t magic;
+
+	if (drmGetMagic(kms->fd, &magic))
+		return -1;
+
+	kms->self_auth = kms_auth_request(kms->auth, magic, kms_self_auth_done, kms);
+	return kms->self_auth ? 0 : -1;
+}
+
+/*
+ * Make sure we are authenticated ourselves before importing buffers.
+ * The request is sent at init time, so this normally returns at once.
+ */
+static int
+kms_self_auth_wait(struct wl_kms *kms)
+{
+	if (kms->authenticated == 0 && !kms->self_auth &&
+	    kms_self_auth_start(kms) < 0)
+		return -1;
+
+	while (kms->self_auth) {
+		if (kms_auth_dispatch(kms->auth) < 0)
+			break;
+	}
+
+	return kms->authenticated > 0 ? 0 : -1;
+}
+
+/*
+ * Import the planes of the buffer into our device. Errors are posted
+ * to error_resource, which is the wl_kms the buffer was created from,
+ * unless it is NULL.
+ */
+static int
+kms_buffer_import(struct kms_buffer *kb, struct wl_resource *error_resource)
+{
+	struct wl_kms_buffer *buffer = &kb->base;
+	struct wl_kms *kms = buffer->kms;
+	int i;
+
+	/* needed before the worker is done with it; wait for it */
+	if (kb->import_job)
+		kms_workqueue_wait(kms->import_wq, &kb->import_job->work);
+
+	if (kb->imported)
+		return kb->imported > 0 ? 0 : -1;
+
+	/* authenticate myself */
+	if (kms->authenticated <= 0 && kms_self_auth_wait(kms) < 0) {
+		if (error_resource)
+			wl_resource_post_error(error_resource,
+				    WL_KMS_ERROR_AUTHENTICATION_FAILED, "authentication failed");
+		WLKMS_DEBUG("%s: %s: authentication failed.\n", __FILE__, __func__);
+		kms_trace(kms->trace, KMS_TRACE_ERROR, 0,
+			  WL_KMS_ERROR_AUTHENTICATION_FAILED, 0);
+		kb->imported = -1;
+		return -1;
+	}
+
+	/* planes sharing a dma-buf share the GEM handle */
+	for (i = 0; i < buffer->num_planes; i++) {
+		if (!(kb->gem[i] = kms_gem_import(kms, buffer->planes[i].fd)))
+			goto invalid_fd_error;
+		buffer->planes[i].handle = kb->gem[i]->handle;
+		kb->desc.planes[i].handle = kb->gem[i]->handle;
+	}
+
+	buffer->handle = buffer->planes[0].handle;
+	kb->imported = 1;
+	kms_buffer_drop_fds(kb);
+	return 0;
+
+invalid_fd_error:
+	WLKMS_DEBUG("%s: %s: drmPrimeFDToHandle() failed... (%s)\n", __FILE__, __func__, strerror(errno));
+	kms_trace(kms->trace, KMS_TRACE_ERROR, errno, WL_KMS_ERROR_INVALID_FD, 0);
+	if (error_resource)
+		wl_resource_post_error(error_resource, WL_KMS_ERROR_INVALID_FD, "invalid prime FD");
+	while (i-- > 0) {
+		kms_gem_unref(kms, kb->gem[i]);
+		buffer->planes[i].handle = 0;
+		kb->desc.planes[i].handle = 0;
+	}
+	kb->imported = -1;
+	return -1;
+}
+
+/*
+ * Asynchronous import
+ */
+
+static void
+kms_import_work(struct kms_work *work)
+{
+	struct kms_import_job *job = wl_container_of(work, job, work);
+	struct wl_kms *kms = job->kms;
+	int i;
+
+	/* nothing but the syscalls here; the rest is done on the event loop */
+	for (i = 0; i < job->num_planes; i++) {
+		kms_gem_identify(job->fds[i], &job->devs[i], &job->inos[i]);
+		if (drmPrimeFDToHandle(kms->fd, job->fds[i], &job->handles[i])) {
+			job->error = errno;
+			return;
+		}
+
+		job->num_imported = i + 1;
+	}
+}
+
+static void
+kms_import_done(struct kms_work *work)
+{
+	struct kms_import_job *job = wl_container_of(work, job, work);
+	struct wl_kms *kms = job->kms;
+	struct kms_buffer *kb = job->kb;
+	struct kms_gem *gem[MAX_PLANES];
+	int i, j, k, n = 0;
+
+	kms->imports_in_flight--;
+
+	/* match the handles with the cache, as kms_gem_import() would */
+	for (i = 0; i < job->num_imported; i++) {
+		kms_trace(kms->trace, KMS_TRACE_IMPORT, 0, job->fds[i], job->handles[i]);
+		if (kms_gem_lookup(kms, job->devs[i], job->inos[i], job->handles[i]))
+			kms->stats.import.hits++;
+		else
+			kms->stats.import.misses++;
+
+		if (!(gem[i] = kms_gem_adopt(kms, job->devs[i], job->inos[i],
+					     job->handles[i]))) {
+			kms_gem_close(kms, job->handles[i]);
+			job->error = ENOMEM;
+			break;
+		}
+		n++;
+	}
+
+	/* the handles left unmatched are only the worker's; close them once each */
+	for (j = i + 1; j < job->num_imported; j++) {
+		for (k = i; k < j && job->handles[k] != job->handles[j]; k++)
+			;
+		if (k == j && !kms_gem_lookup(kms, job->devs[j], job->inos[j],
+					      job->handles[j]))
+			kms_gem_close(kms, job->handles[j]);
+	}
+
+	if (job->error) {
+		if (i < job->num_planes)
+			kms_trace(kms->trace, KMS_TRACE_IMPORT, job->error, job->fds[i], 0);
+		kms->stats.import_failures++;
+	}
+
+	if (!kb || job->error) {
+		while (n-- > 0)
+			kms_gem_unref(kms, gem[n]);
+	}
+
+	if (!kb) {
+		for (i = 0; i < job->num_planes; i++)
+			close(job->fds[i]);
+		kms->stats.fds -= job->num_planes;
+	} else {
+		kb->import_job = NULL;
+		if (!job->error) {
+			for (i = 0; i < job->num_planes; i++) {
+				kb->gem[i] = gem[i];
+				kb->base.planes[i].handle = gem[i]->handle;
+				kb->desc.planes[i].handle = gem[i]->handle;
+			}
+			kb->base.handle = kb->base.planes[0].handle;
+			kb->imported = 1;
+			kms_buffer_drop_fds(kb);
+		} else {
+			kb->imported = -1;
+		}
+	}
+
+	if (kms->imports_in_flight == 0)
+		kms_gem_close_deferred(kms);
+
+	if (kb && kb->imported < 0) {
+		WLKMS_DEBUG("%s: %s: drmPrimeFDToHandle() failed... (%s)\n", __FILE__, __func__,
+			    strerror(job->error));
+		kms_trace(kms->trace, KMS_TRACE_ERROR, job->error, WL_KMS_ERROR_INVALID_FD, 0);
+		wl_resource_post_error(kb->kms_resource, WL_KMS_ERROR_INVALID_FD,
+				       "invalid prime FD");
+	}
+
+	free(job);
+
+	if (kb && kms->ready)
+		kms->ready(&kb->base, kb->imported > 0 ? 0 : -1, kms->ready_data);
+}
+
+/* Hands the import of the buffer to a worker; -1 if it can't */
+static int
+kms_import_queue(struct kms_buffer *kb)
+{
+	struct wl_kms_buffer *buffer = &kb->base;
+	struct wl_kms *kms = buffer->kms;
+	struct kms_import_job *job;
+	int i;
+
+	/* we need to be authenticated first, see kms_buffer_import() */
+	if (kms->authenticated <= 0)
+		return -1;
+
+	if (!kms->import_wq) {
+		kms->import_wq = kms_workqueue_create(wl_display_get_event_loop(kms->display),
+						      KMS_IMPORT_THREADS);
+		if (!kms->import_wq)
+			return -1;
+	}
+
+	if (!(job = calloc(1, sizeof(struct kms_import_job))))
+		return -1;
+
+	job->work.func = kms_import_work;
+	job->work.done = kms_import_done;
+	job->kms = kms;
+	job->kb = kb;
+	job->num_planes = buffer->num_planes;
+	for (i = 0; i < buffer->num_planes; i++)
+		job->fds[i] = buffer->planes[i].fd;
+
+	kb->import_job = job;
+	kms->imports_in_flight++;
+	kms->stats.import.queued++;
+	kms_workqueue_submit(kms->import_wq, &job->work);
+
+	return 0;
+}
+
+struct kms_workqueue *kms_get_convert_workqueue(struct wl_kms *kms, int threads)
+{
+	if (!kms->convert_wq)
+		kms->convert_wq = kms_workqueue_create(NULL, threads);
+
+	return kms->convert_wq;
+}
+
+/*
+ * Wayland passes dup'd fds that must be closed when
+ * no longer needed. Close the unused ones
+ * immediately to avoid leaking them.
+ */
+static void
+kms_close_unused_fds(int32_t *fds, int nplanes)
+{
+	int i;
+
+	for (i = nplanes; i < MAX_PLANES; i++) {
+		if (fds[i] != WL_KMS_INVALID_FD)
+			close(fds[i]);
+	}
+}
+
+/*
+ * Closes the fds of the planes in use, the others having been closed by
+ * kms_close_unused_fds() already. The slots are left invalid, so that
+ * nothing is closed twice.
+ */
+static void
+kms_close_fds(int32_t *fds, int nplanes)
+{
+	int i;
+
+	for (i = 0; i < nplanes; i++) {
+		if (fds[i] != WL_KMS_INVALID_FD)
+			close(fds[i]);
+		fds[i] = WL_KMS_INVALID_FD;
+	}
+}
+
+/* Checks the planes against the size of their dma-bufs */
+static int
+kms_check_layout(const struct kms_format_info *info, int32_t width,
+		 int32_t height, int32_t *fds, uint32_t *offsets, uint32_t *strides)
+{
+	uint64_t sizes[MAX_PLANES] = { 0 };
+	struct stat st;
+	off_t size;
+	int i;
+
+	/*
+	 * memfds report their size to fstat(), dma-bufs to lseek(); the
+	 * offset is the client's too, so it is put back. Other fds are
+	 * left unchecked.
+	 */
+	for (i = 0; i < info->num_planes; i++) {
+		if (fstat(fds[i], &st) == 0 && S_ISREG(st.st_mode)) {
+			sizes[i] = st.st_size;
+		} else if ((size = lseek(fds[i], 0, SEEK_END)) > 0) {
+			sizes[i] = size;
+			lseek(fds[i], 0, SEEK_SET);
+		}
+	}
+
+	return kms_format_check_layout(info, width, height, offsets, strides, sizes);
+}
+
+static void
+kms_buffer_init(struct kms_buffer *kb, struct wl_resource *kms_resource,
+		int32_t width, int32_t height, const struct kms_format_info *info,
+		int32_t *fds, uint32_t *offsets, uint32_t *strides)
+{
+	struct wl_kms_buffer *buffer = &kb->base;
+	uint32_t format = info->format;
+	int nplanes = info->num_planes;
+	int i;
+
+	kb->kms_resource = kms_resource;
+	buffer->kms = kms_resource->data;
+	buffer->width = width;
+	buffer->height = height;
+	buffer->format = format;
+	buffer->num_planes = nplanes;
+
+	for (i = 0; i < nplanes; i++) {
+		buffer->planes[i].fd = fds[i];
+		buffer->planes[i].offset = offsets[i];
+		buffer->planes[i].stride = strides[i];
+	}
+
+	buffer->stride = buffer->planes[0].stride;
+	buffer->fd = buffer->planes[0].fd;
+
+	kb->desc.width = width;
+	kb->desc.height = height;
+	kb->desc.format = format;
+	kb->info = info;
+	if ((buffer->kms->flags & WL_KMS_FLAG_PLANAR_TEXTURES) &&
+	    info->planar_texture_format)
+		kb->desc.texture_format = info->planar_texture_format;
+	else
+		kb->desc.texture_format = info->texture_format;
+	kb->desc.num_planes = nplanes;
+	for (i = 0; i < nplanes; i++) {
+		kb->desc.planes[i].stride = strides[i];
+		kb->desc.planes[i].offset = offsets[i];
+	}
+
+	/* like EGL_WAYLAND_Y_INVERTED_WL, our buffers start at the top */
+	kb->desc.flags = WL_KMS_BUFFER_Y_INVERTED;
+	if (info->has_alpha)
+		kb->desc.flags |= WL_KMS_BUFFER_HAS_ALPHA;
+
+	buffer->kms->stats.buffers++;
+	buffer->kms->stats.planes += nplanes;
+	buffer->kms->stats.fds += nplanes;
+	kb->format_index = kms_format_index(format);
+	if (kb->format_index >= WL_KMS_STATS_MAX_FORMATS)
+		kb->format_index = -1;
+	if (kb->format_index >= 0)
+		buffer->kms->stats.formats[kb->format_index].buffers++;
+
+	wl_list_insert(&buffer->kms->buffers, &kb->kms_link);
+	kb->acquire_fence = -1;
+	wl_list_init(&kb->foreign);
+	wl_list_init(&kb->fence_waits);
+	wl_list_init(&kb->releases);
+}
+
+static void
+kms_buffer_create(struct wl_client *client, struct wl_resource *resource,
+		  uint32_t id, int32_t width, int32_t height, uint32_t format,
+		  int32_t *fds, uint32_t *offsets, uint32_t *strides)
+{
+	struct wl_kms *kms = resource->data;
+	const struct kms_format_info *info;
+	struct kms_buffer *kb;
+	struct wl_kms_buffer *buffer;
+	int nplanes;
+
+	if (!(info = kms_format_get_info(format))) {
+		kms_close_unused_fds(fds, 0);
+		kms_trace(kms->trace, KMS_TRACE_ERROR, 0, WL_KMS_ERROR_INVALID_FORMAT, 0);
+		wl_resource_post_error(resource,
+				       WL_KMS_ERROR_INVALID_FORMAT,
+				       "invalid format");
+		return;
+	}
+
+	nplanes = info->num_planes;
+	kms_close_unused_fds(fds, nplanes);
+
+	if (kms_check_layout(info, width, height, fds, offsets, strides) < 0) {
+		kms_close_fds(fds, nplanes);
+		kms_trace(kms->trace, KMS_TRACE_ERROR, 0, WL_KMS_ERROR_INVALID_SIZE, 0);
+		wl_resource_post_error(resource, WL_KMS_ERROR_INVALID_SIZE,
+				       "planes don't fit in their buffers");
+		return;
+	}
+
+	kb = kms_buffer_alloc(kms);
+	if (kb == NULL) {
+		kms_close_fds(fds, nplanes);
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	buffer = &kb->base;
+
+	kms_buffer_init(kb, resource, width, height, info, fds, offsets, strides);
+
+	/* planes sharing a dma-buf are imported once, see kms_gem_import() */
+	if (kms->flags & WL_KMS_FLAG_LAZY_IMPORT) {
+		kms->stats.import.deferred++;
+	} else if ((kms->flags & WL_KMS_FLAG_ASYNC_IMPORT) && kms_import_queue(kb) == 0) {
+		/* kms_import_done() tells how it went */
+	} else if (kms_buffer_import(kb, resource) < 0) {
+		kms_buffer_release(kb);
+		return;
+	}
+
+	WLKMS_DEBUG("%s: %s: %d planes (%d, %d, %d, %d)\n", __FILE__, __func__,
+		    nplanes, fds[0], fds[1], fds[2], fds[3]);
+
+	// We create a wl_buffer
+	buffer->resource = wl_resource_create(client, &wl_buffer_interface, 1, id);
+	if (!buffer->resource) {
+		wl_resource_post_no_memory(resource);
+		kms_buffer_release(kb);
+		return;
+	}
+
+	wl_resource_set_implementation(buffer->resource, &kms_buffer_interface,
+				       buffer, destroy_buffer);
+	WLKMS_PROBE(create_buffer, buffer, format, nplanes);
+}
+
+/*
+ * Note: This API owns the fds passed through its call. Unused ones are
+ * closed right away, the others along with the buffer or on errors.
+ */
+static void
+kms_create_planar(struct wl_client *client, struct wl_resource *resource,
+		  uint32_t id, int32_t width, int32_t height, uint32_t format,
+		  int32_t *fds, uint32_t *offsets, uint32_t *strides)
+{
+	struct wl_kms *kms = resource->data;
+	uint64_t start = kms_stats_now(), time;
+
+	if (!kms) {
+		kms_close_unused_fds(fds, 0);
+		kms_create_inert_buffer(client, resource, id);
+		return;
+	}
+
+	kms_buffer_create(client, resource, id, width, height, format,
+			  fds, offsets, strides);
+
+	time = kms_stats_now() - start;
+	kms->stats.creates++;
+	kms->stats.create_ns += time;
+	kms_trace(kms->trace, KMS_TRACE_CREATE, 0, format, time);
+}
+
+static void
+kms_create_mp_buffer(struct wl_client *client, struct wl_resource *resource,
+		     uint32_t id, int32_t width, int32_t height, uint32_t format,
+		     int32_t fd0, uint32_t stride0, int32_t fd1, uint32_t stride1,
+		     int32_t fd2, uint32_t stride2)
+{
+	int32_t fds[MAX_PLANES] = { fd0, fd1, fd2, WL_KMS_INVALID_FD };
+	uint32_t offsets[MAX_PLANES] = { 0 };
+	uint32_t strides[MAX_PLANES] = { stride0, stride1, stride2, 0 };
+
+	kms_create_planar(client, resource, id, width, height, format,
+			  fds, offsets, strides);
+}
+
+static void
+kms_create_planar_buffer(struct wl_client *client, struct wl_resource *resource,
+			 uint32_t id, int32_t width, int32_t height, uint32_t format,
+			 int32_t fd0, uint32_t offset0, uint32_t stride0,
+			 int32_t fd1, uint32_t offset1, uint32_t stride1,
+			 int32_t fd2, uint32_t offset2, uint32_t stride2,
+			 int32_t fd3, uint32_t offset3, uint32_t stride3)
+{
+	int32_t fds[MAX_PLANES] = { fd0, fd1, fd2, fd3 };
+	uint32_t offsets[MAX_PLANES] = { offset0, offset1, offset2, offset3 };
+	uint32_t strides[MAX_PLANES] = { stride0, stride1, stride2, stride3 };
+
+	kms_create_planar(client, resource, id, width, height, format,
+			  fds, offsets, strides);
+}
+
+static void
+kms_create_buffer(struct wl_client *client, struct wl_resource *resource,
+		  uint32_t id, int32_t prime_fd, int32_t width, int32_t height,
+		  uint32_t stride, uint32_t format, uint32_t handle)
+{
+	kms_create_mp_buffer(client, resource, id, width, height, format, prime_fd, stride,
+			     WL_KMS_INVALID_FD, 0, WL_KMS_INVALID_FD, 0);
+}
+
+/*
+ * Explicit synchronization
+ */
+
+static void
+kms_set_acquire_fence(struct wl_client *client, struct wl_resource *resource,
+		      struct wl_resource *buffer_resource, int32_t fence)
+{
+	struct wl_kms_buffer *buffer = wayland_kms_buffer_get(buffer_resource);
+	struct kms_buffer *kb;
+
+	if (!resource->data) {
+		close(fence);
+		return;
+	}
+
+	if (!buffer || buffer->kms != resource->data) {
+		close(fence);
+		wl_resource_post_error(resource, WL_KMS_ERROR_INVALID_BUFFER,
+				       "invalid buffer");
+		return;
+	}
+
+	kb = wl_container_of(buffer, kb, base);
+	if (kb->acquire_fence >= 0)
+		close(kb->acquire_fence);
+	kb->acquire_fence = fence;
+}
+
+static void
+destroy_release(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+kms_get_release(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id, struct wl_resource *buffer_resource)
+{
+	struct wl_kms_buffer *buffer = wayland_kms_buffer_get(buffer_resource);
+	struct wl_resource *release;
+	struct kms_buffer *kb;
+
+	if (resource->data && (!buffer || buffer->kms != resource->data)) {
+		wl_resource_post_error(resource, WL_KMS_ERROR_INVALID_BUFFER,
+				       "invalid buffer");
+		return;
+	}
+
+	release = wl_resource_create(client, &wl_kms_buffer_release_interface, 1, id);
+	if (!release) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	/* the buffer went away along with wl_kms */
+	if (!resource->data) {
+		wl_resource_post_event(release, WL_KMS_BUFFER_RELEASE_IMMEDIATE_RELEASE);
+		wl_resource_destroy(release);
+		return;
+	}
+
+	kb = wl_container_of(buffer, kb, base);
+	wl_resource_set_implementation(release, NULL, NULL, destroy_release);
+	wl_list_insert(kb->releases.prev, wl_resource_get_link(release));
+}
+
+/*
+ * Server side allocation
+ */
+
+/* Dumb buffers can be scanned out, so they are contiguous if they have to be */
+static int
+kms_dumb_alloc(struct wl_kms *kms, int32_t width, int32_t height,
+	       uint32_t format, uint32_t flags, int32_t *fds,
+	       uint32_t *offsets, uint32_t *strides, uint32_t *handles,
+	       void *data)
+{
+	const struct kms_format_info *info = kms_format_get_info(format);
+	struct drm_mode_create_dumb create_arg;
+	int i;
+
+	for (i = 0; i < info->num_planes; i++) {
+		memset(&create_arg, 0, sizeof create_arg);
+		create_arg.bpp = info->cpp[i] * 8;
+		create_arg.width = width;
+		create_arg.height = height;
+		if (i > 0) {
+			create_arg.width = (width + info->hsub - 1) / info->hsub;
+			create_arg.height = (height + info->vsub - 1) / info->vsub;
+		}
+
+		if (drmIoctl(kms->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg))
+			goto error;
+
+		handles[i] = create_arg.handle;
+		offsets[i] = 0;
+		strides[i] = create_arg.pitch;
+
+		if (drmPrimeHandleToFD(kms->fd, handles[i], DRM_CLOEXEC | DRM_RDWR,
+				       &fds[i])) {
+			i++;
+			goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	WLKMS_DEBUG("%s: %s: plane %d: %s\n", __FILE__, __func__, i, strerror(errno));
+	while (i-- > 0) {
+		if (fds[i] != WL_KMS_INVALID_FD)
+			close(fds[i]);
+		close_drm_handle(kms->fd, handles[i]);
+		fds[i] = WL_KMS_INVALID_FD;
+		handles[i] = 0;
+	}
+	return -1;
+}
+
+/*
+ * Gets the GEM handles of an allocated buffer: those the allocator
+ * returned are taken over, the other planes are imported.
+ */
+static int
+kms_buffer_adopt(struct kms_buffer *kb, uint32_t *handles)
+{
+	struct wl_kms_buffer *buffer = &kb->base;
+	struct wl_kms *kms = buffer->kms;
+	dev_t dev;
+	ino_t ino;
+	int i, j, k;
+
+	for (i = 0; i < buffer->num_planes; i++) {
+		if (!handles[i]) {
+			kb->gem[i] = kms_gem_import(kms, buffer->planes[i].fd);
+		} else {
+			kms_gem_identify(buffer->planes[i].fd, &dev, &ino);
+			kb->gem[i] = kms_gem_adopt(kms, dev, ino, handles[i]);
+		}
+		if (!kb->gem[i])
+			goto error;
+		buffer->planes[i].handle = kb->gem[i]->handle;
+		kb->desc.planes[i].handle = kb->gem[i]->handle;
+	}
+
+	buffer->handle = buffer->planes[0].handle;
+	kb->imported = 1;
+	return 0;
+
+error:
+	/* close the handles not taken over yet, once each */
+	for (j = i; j < buffer->num_planes; j++) {
+		for (k = 0; k < j && handles[k] != handles[j]; k++)
+			;
+		if (handles[j] && k == j)
+			close_drm_handle(kms->fd, handles[j]);
+	}
+	while (i-- > 0) {
+		kms_gem_unref(kms, kb->gem[i]);
+		buffer->planes[i].handle = 0;
+		kb->desc.planes[i].handle = 0;
+	}
+	return -1;
+}
+
+/* What the planes of an allocation take at least */
+static uint64_t
+kms_alloc_size(const struct kms_format_info *info, int32_t width, int32_t height)
+{
+	uint64_t size = (uint64_t)width * height * info->cpp[0];
+	int i;
+
+	for (i = 1; i < info->num_planes; i++)
+		size += (uint64_t)((width + info->hsub - 1) / info->hsub) *
+			((height + info->vsub - 1) / info->vsub) * info->cpp[i];
+
+	return size;
+}
+
+/* What the buffers we allocated for the client take */
+static uint64_t
+kms_client_allocated(struct wl_kms *kms, struct wl_client *client)
+{
+	struct kms_buffer *kb;
+	uint64_t size = 0;
+
+	wl_list_for_each(kb, &kms->buffers, kms_link) {
+		if (kb->alloc_size && kb->base.resource &&
+		    wl_resource_get_client(kb->base.resource) == client)
+			size += kb->alloc_size;
+	}
+
+	return size;
+}
+
+/*
+ * The wl_buffer is created right away, but has no wl_kms_buffer
+ * attached unless the allocation succeeds. Planes are sent with the
+ * fds we keep; libwayland sends copies.
+ */
+static void
+kms_allocate_buffer(struct wl_client *client, struct wl_resource *resource,
+		    uint32_t id, int32_t width, int32_t height, uint32_t format,
+		    uint32_t flags)
+{
+	struct wl_kms *kms = resource->data;
+	const struct kms_format_info *info;
+	struct wl_resource *buffer_resource;
+	struct kms_buffer *kb;
+	int32_t fds[MAX_PLANES] = {
+		WL_KMS_INVALID_FD, WL_KMS_INVALID_FD,
+		WL_KMS_INVALID_FD, WL_KMS_INVALID_FD
+	};
+	uint32_t offsets[MAX_PLANES] = { 0 };
+	uint32_t strides[MAX_PLANES] = { 0 };
+	uint32_t handles[MAX_PLANES] = { 0 };
+	uint64_t start = kms_stats_now(), time, size;
+	int i;
+
+	if (!kms) {
+		if ((buffer_resource = kms_create_inert_buffer(client, resource, id)))
+			wl_resource_post_event(resource, WL_KMS_ALLOCATION_FAILED,
+					       buffer_resource);
+		return;
+	}
+
+	if (!(info = kms_format_get_info(format))) {
+		kms_trace(kms->trace, KMS_TRACE_ERROR, 0, WL_KMS_ERROR_INVALID_FORMAT, 0);
+		wl_resource_post_error(resource, WL_KMS_ERROR_INVALID_FORMAT,
+				       "invalid format");
+		return;
+	}
+
+	if (width <= 0 || height <= 0 ||
+	    width > kms->max_width || height > kms->max_height) {
+		kms_trace(kms->trace, KMS_TRACE_ERROR, 0, WL_KMS_ERROR_INVALID_SIZE, 0);
+		wl_resource_post_error(resource, WL_KMS_ERROR_INVALID_SIZE,
+				       "invalid size");
+		return;
+	}
+
+	size = kms_alloc_size(info, width, height);
+	if (kms->alloc_limit &&
+	    kms_client_allocated(kms, client) + size > kms->alloc_limit) {
+		kms_trace(kms->trace, KMS_TRACE_ERROR, 0, WL_KMS_ERROR_INVALID_SIZE, 0);
+		wl_resource_post_error(resource, WL_KMS_ERROR_INVALID_SIZE,
+				       "allocation limit of %" PRIu64 " bytes reached",
+				       kms->alloc_limit);
+		return;
+	}
+
+	buffer_resource = wl_resource_create(client, &wl_buffer_interface, 1, id);
+	if (!buffer_resource) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	wl_resource_set_implementation(buffer_resource, &kms_buffer_interface,
+				       NULL, NULL);
+
+	if (!(kb = kms_buffer_alloc(kms)))
+		goto failed;
+
+	/* the allocation may need us to be authenticated */
+	if ((kms->authenticated <= 0 && kms_self_auth_wait(kms) < 0) ||
+	    kms->alloc(kms, width, height, format, flags, fds, offsets, strides,
+		       handles, kms->alloc_data) < 0) {
+		kms_buffer_free(kms, kb);
+		goto failed;
+	}
+
+	kms_buffer_init(kb, resource, width, height, info, fds, offsets, strides);
+	if (kms_buffer_adopt(kb, handles) < 0) {
+		kms_buffer_release(kb);
+		goto failed;
+	}
+
+	kb->base.resource = buffer_resource;
+	kb->alloc_size = size;
+	wl_resource_set_implementation(buffer_resource, &kms_buffer_interface,
+				       &kb->base, destroy_buffer);
+
+	for (i = 0; i < info->num_planes; i++)
+		wl_resource_post_event(resource, WL_KMS_PLANE, buffer_resource,
+				       fds[i], offsets[i], strides[i]);
+	wl_resource_post_event(resource, WL_KMS_ALLOCATED, buffer_resource);
+	kms_buffer_drop_fds(kb);
+
+	time = kms_stats_now() - start;
+	kms->stats.allocations++;
+	kms->stats.allocation_ns += time;
+	kms_trace(kms->trace, KMS_TRACE_ALLOCATE, 0, format, time);
+	WLKMS_PROBE(allocate_buffer, &kb->base, format, info->num_planes);
+	return;
+
+failed:
+	kms->stats.allocation_failures++;
+	kms_trace(kms->trace, KMS_TRACE_ALLOCATE, errno, format,
+		  kms_stats_now() - start);
+	wl_resource_post_event(resource, WL_KMS_ALLOCATION_FAILED, buffer_resource);
+}
+
+/*
+ * wl_kms_buffer_batch
+ *
+ * The wl_buffers are created as soon as they are added, but have no
+ * wl_kms_buffer attached until the batch is successfully committed.
+ */
+
+static void
+kms_batch_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct kms_buffer *kb = wl_container_of(listener, kb, batch_destroy_listener);
+
+	/* destroyed by the client before the commit */
+	wl_list_remove(&kb->link);
+	kms_buffer_release(kb);
+}
+
+static void
+kms_batch_drop_buffers(struct kms_batch *batch)
+{
+	struct kms_buffer *kb, *tmp;
+
+	wl_list_for_each_safe(kb, tmp, &batch->buffers, link) {
+		wl_list_remove(&kb->link);
+		wl_list_remove(&kb->batch_destroy_listener.link);
+		kms_buffer_release(kb);
+	}
+}
+
+static void
+destroy_batch(struct wl_resource *resource)
+{
+	struct kms_batch *batch = resource->data;
+
+	kms_batch_drop_buffers(batch);
+	wl_list_remove(&batch->link);
+	free(batch);
+}
+
+static void
+batch_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+batch_add(struct wl_client *client, struct wl_resource *resource,
+	  uint32_t id, int32_t fd0, uint32_t stride0, int32_t fd1,
+	  uint32_t stride1, int32_t fd2, uint32_t stride2)
+{
+	struct kms_batch *batch = resource->data;
+	struct kms_buffer *kb;
+	int32_t fds[MAX_PLANES] = { fd0, fd1, fd2, WL_KMS_INVALID_FD };
+	uint32_t offsets[MAX_PLANES] = { 0 };
+	uint32_t strides[MAX_PLANES] = { stride0, stride1, stride2, 0 };
+
+	if (batch->committed) {
+		kms_close_unused_fds(fds, 0);
+		wl_resource_post_error(resource, WL_KMS_BUFFER_BATCH_ERROR_ALREADY_USED,
+				       "batch already committed");
+		return;
+	}
+
+	if (!batch->kms) {
+		kms_close_unused_fds(fds, 0);
+		kms_create_inert_buffer(client, resource, id);
+		return;
+	}
+
+	kms_close_unused_fds(fds, batch->info->num_planes);
+
+	if (kms_check_layout(batch->info, batch->width, batch->height,
+			     fds, offsets, strides) < 0) {
+		kms_close_fds(fds, batch->info->num_planes);
+		wl_resource_post_error(batch->kms_resource, WL_KMS_ERROR_INVALID_SIZE,
+				       "planes don't fit in their buffers");
+		return;
+	}
+
+	if (!(kb = kms_buffer_alloc(batch->kms))) {
+		kms_close_fds(fds, batch->info->num_planes);
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	kms_buffer_init(kb, batch->kms_resource, batch->width, batch->height,
+			batch->info, fds, offsets, strides);
+
+	kb->base.resource = wl_resource_create(client, &wl_buffer_interface, 1, id);
+	if (!kb->base.resource) {
+		wl_resource_post_no_memory(resource);
+		kms_buffer_release(kb);
+		return;
+	}
+
+	wl_resource_set_implementation(kb->base.resource, &kms_buffer_interface,
+				       NULL, NULL);
+	kb->batch_destroy_listener.notify = kms_batch_buffer_destroy;
+	wl_resource_add_destroy_listener(kb->base.resource, &kb->batch_destroy_listener);
+	wl_list_insert(batch->buffers.prev, &kb->link);
+}
+
+static void
+batch_commit(struct wl_client *client, struct wl_resource *resource)
+{
+	struct kms_batch *batch = resource->data;
+	struct wl_kms *kms = batch->kms;
+	struct kms_buffer *kb, *tmp;
+
+	if (batch->committed) {
+		wl_resource_post_error(resource, WL_KMS_BUFFER_BATCH_ERROR_ALREADY_USED,
+				       "batch already committed");
+		return;
+	}
+	batch->committed = 1;
+
+	if (!kms) {
+		wl_resource_post_event(resource, WL_KMS_BUFFER_BATCH_FAILED);
+		return;
+	}
+
+	wl_list_for_each(kb, &batch->buffers, link) {
+		if (kms->flags & WL_KMS_FLAG_LAZY_IMPORT) {
+			kms->stats.import.deferred++;
+		} else if (kms_buffer_import(kb, NULL) < 0) {
+			/* all or nothing */
+			kms_batch_drop_buffers(batch);
+			wl_resource_post_event(resource, WL_KMS_BUFFER_BATCH_FAILED);
+			return;
+		}
+	}
+
+	wl_list_for_each_safe(kb, tmp, &batch->buffers, link) {
+		wl_list_remove(&kb->link);
+		wl_list_remove(&kb->batch_destroy_listener.link);
+		wl_resource_set_implementation(kb->base.resource, &kms_buffer_interface,
+					       &kb->base, destroy_buffer);
+	}
+
+	wl_resource_post_event(resource, WL_KMS_BUFFER_BATCH_CREATED);
+}
+
+const static struct wl_kms_buffer_batch_interface kms_batch_interface = {
+	.destroy = batch_destroy,
+	.add = batch_add,
+	.commit = batch_commit,
+};
+
+static void
+kms_create_buffer_batch(struct wl_client *client, struct wl_resource *resource,
+			uint32_t id, int32_t width, int32_t height, uint32_t format)
+{
+	const struct kms_format_info *info;
+	struct kms_batch *batch;
+
+	if (!(info = kms_format_get_info(format))) {
+		wl_resource_post_error(resource,
+				       WL_KMS_ERROR_INVALID_FORMAT,
+				       "invalid format");
+		return;
+	}
+
+	if (!(batch = calloc(1, sizeof(struct kms_batch)))) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	batch->kms = resource->data;
+	batch->kms_resource = resource;
+	batch->width = width;
+	batch->height = height;
+	batch->info = info;
+	wl_list_init(&batch->buffers);
+
+	batch->resource = wl_resource_create(client, &wl_kms_buffer_batch_interface, 1, id);
+	if (!batch->resource) {
+		wl_resource_post_no_memory(resource);
+		free(batch);
+		return;
+	}
+
+	wl_resource_set_implementation(batch->resource, &kms_batch_interface,
+				       batch, destroy_batch);
+	if (batch->kms)
+		wl_list_insert(&batch->kms->batches, &batch->link);
+	else
+		wl_list_init(&batch->link);
+}
+
+const static struct wl_kms_interface kms_interface = {
+	.authenticate = kms_authenticate,
+	.create_buffer = kms_create_buffer,
+	.create_mp_buffer = kms_create_mp_buffer,
+	.create_planar_buffer = kms_create_planar_buffer,
+	.create_buffer_batch = kms_create_buffer_batch,
+	.set_acquire_fence = kms_set_acquire_fence,
+	.get_release = kms_get_release,
+	.allocate_buffer = kms_allocate_buffer,
+};
+
+static void
+unbind_kms(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+bind_kms(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_kms *kms = data;
+	struct wl_resource *resource;
+	const struct kms_format_info *formats;
+	int i, count;
+	pid_t pid;
+
+	if (kms->trace) {
+		wl_client_get_credentials(client, &pid, NULL, NULL);
+		kms_trace_record(kms->trace, KMS_TRACE_BIND, 0, version, pid);
+	}
+
+	resource = wl_resource_create(client, &wl_kms_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &kms_interface, data, unbind_kms);
+	wl_list_insert(&kms->resources, wl_resource_get_link(resource));
+
+	/* version 3 clients can skip authentication on a render node */
+	if (version >= 3 && kms->render_node_name)
+		wl_resource_post_event(resource, WL_KMS_DEVICE, kms->render_node_name);
+	else
+		wl_resource_post_event(resource, WL_KMS_DEVICE, kms->device_name);
+
+	if (version >= 6 && kms->format_table) {
+		wl_resource_post_event(resource, WL_KMS_FORMAT_TABLE,
+				       kms_format_table_get_fd(kms->format_table),
+				       kms_format_table_get_size(kms->format_table));
+		return;
+	}
+
+	formats = kms_format_list(&count);
+	for (i = 0; i < count; i++)
+		wl_resource_post_event(resource, WL_KMS_FORMAT, formats[i].format);
+}
+
+int wayland_kms_fd_get(struct wl_kms* kms)
+{
+	return kms->fd;
+}
+
+struct wl_kms_buffer *wayland_kms_buffer_get(struct wl_resource *resource)
+{
+	if (resource == NULL)
+		return NULL;
+
+	if (wl_resource_instance_of(resource, &wl_buffer_interface,
+				    &kms_buffer_interface))
+		return wl_resource_get_user_data(resource);
+	else
+		return NULL;
+}
+
+struct wl_kms_buffer *wayland_kms_buffer_get_imported(struct wl_resource *resource)
+{
+	struct wl_kms_buffer *buffer = wayland_kms_buffer_get(resource);
+	struct kms_buffer *kb;
+
+	if (!buffer)
+		return NULL;
+
+	kb = wl_container_of(buffer, kb, base);
+	if (kb->imported <= 0 && kms_buffer_import(kb, kb->kms_resource) < 0)
+		return NULL;
+
+	return buffer;
+}
+
+static struct kms_foreign_import *
+kms_foreign_import_create(struct wl_kms *kms, struct kms_buffer *kb)
+{
+	struct wl_kms_buffer *buffer = &kb->base;
+	struct kms_foreign_import *fi;
+	int i, fd;
+
+	if (kms->authenticated <= 0 && kms_self_auth_wait(kms) < 0)
+		return NULL;
+
+	if (!(fi = calloc(1, sizeof(struct kms_foreign_import))))
+		return NULL;
+
+	fi->kms = kms;
+
+	/* goes through the cache of kms, shared with its own buffers */
+	for (i = 0; i < buffer->num_planes; i++) {
+		if ((fd = kms_buffer_get_fd(kb, i)) < 0)
+			goto error;
+		fi->gem[i] = kms_gem_import(kms, fd);
+		kms_buffer_put_fd(kb, i, fd);
+		if (!fi->gem[i])
+			goto error;
+		fi->num_planes++;
+	}
+
+	wl_list_insert(&kb->foreign, &fi->buffer_link);
+	wl_list_insert(&kms->foreign, &fi->kms_link);
+	return fi;
+
+error:
+	WLKMS_DEBUG("%s: %s: import into %s failed (%s)\n", __FILE__, __func__,
+		    kms->device_name, strerror(errno));
+	while (fi->num_planes-- > 0)
+		kms_gem_unref(kms, fi->gem[fi->num_planes]);
+	free(fi);
+	return NULL;
+}
+
+int wayland_kms_buffer_import(struct wl_kms *kms, struct wl_kms_buffer *buffer,
+			      uint32_t handles[MAX_PLANES])
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+	struct kms_foreign_import *fi;
+	int i;
+
+	if (buffer->kms == kms) {
+		if (kms_buffer_import(kb, kb->kms_resource) < 0)
+			return -1;
+		for (i = 0; i < buffer->num_planes; i++)
+			handles[i] = buffer->planes[i].handle;
+		return 0;
+	}
+
+	wl_list_for_each(fi, &kb->foreign, buffer_link) {
+		if (fi->kms == kms)
+			goto found;
+	}
+
+	if (!(fi = kms_foreign_import_create(kms, kb)))
+		return -1;
+
+found:
+	for (i = 0; i < buffer->num_planes; i++)
+		handles[i] = fi->gem[i]->handle;
+	return 0;
+}
+
+static int kms_trace_start(struct wl_kms *kms, int events)
+{
+	struct kms_trace *trace;
+
+	if (!(trace = kms_trace_create(events)))
+		return -1;
+
+	if (kms->trace_path &&
+	    kms_trace_dump_on_signal(trace, wl_display_get_event_loop(kms->display),
+				     kms->trace_path) < 0) {
+		kms_trace_destroy(trace);
+		return -1;
+	}
+
+	kms_trace_destroy(kms->trace);
+	kms->trace = trace;
+	return 0;
+}
+
+static void kms_trace_init_from_env(struct wl_kms *kms)
+{
+	const char *path = getenv("WAYLAND_KMS_TRACE");
+	const char *device;
+	size_t size;
+
+	if (!path || !*path)
+		return;
+
+	device = strrchr(kms->device_name, '/');
+	device = device ? device + 1 : kms->device_name;
+	size = strlen(path) + strlen(device) + 2;
+	if (!(kms->trace_path = malloc(size)))
+		return;
+	snprintf(kms->trace_path, size, "%s.%s", path, device);
+
+	kms_trace_start(kms, KMS_TRACE_EVENTS);
+}
+
+/* Allocations are bounded by the largest framebuffer of the device */
+static void kms_get_max_size(struct wl_kms *kms)
+{
+	drmModeResPtr res;
+
+	kms->max_width = kms->max_height = KMS_ALLOC_MAX_SIZE;
+
+	/* render-only devices have no KMS resources */
+	if (!(res = drmModeGetResources(kms->fd)))
+		return;
+
+	if (res->max_width > 0)
+		kms->max_width = res->max_width;
+	if (res->max_height > 0)
+		kms->max_height = res->max_height;
+	drmModeFreeResources(res);
+}
+
+static struct wl_kms *kms_create(struct wl_display *display,
+				 struct wl_display *server, char *device_name, int fd)
+{
+	struct wl_kms *kms;
+	const struct kms_format_info *formats;
+	struct stat st;
+	int i, count, is_render_node;
+
+	if (!(kms = calloc(1, sizeof(struct wl_kms))))
+		return NULL;
+
+	kms->refcount = 1;
+	kms->display = display;
+	kms->device_name = strdup(device_name);
+	kms->fd = fd;
+	if (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode))
+		kms->rdev = st.st_rdev;
+	kms->alloc = kms_dumb_alloc;
+	kms->alloc_limit = KMS_ALLOC_CLIENT_LIMIT;
+	kms_get_max_size(kms);
+	wl_list_init(&kms->clients);
+	wl_list_init(&kms->pending);
+	wl_list_init(&kms->resources);
+	wl_list_init(&kms->buffers);
+	wl_list_init(&kms->batches);
+	wl_list_init(&kms->foreign);
+	wl_array_init(&kms->deferred_closes);
+	for (i = 0; i < KMS_GEM_HASH_SIZE; i++)
+		wl_list_init(&kms->gem_hash[i]);
+
+	formats = kms_format_list(&count);
+	for (i = 0; i < count && i < WL_KMS_STATS_MAX_FORMATS; i++)
+		kms->stats.formats[i].format = formats[i].format;
+	kms->stats.num_formats = i;
+
+	/*
+	 * If we were given a render node, we need no authentication at all.
+	 * Otherwise, look for the render node of the same device.
+	 */
+	is_render_node = drmGetNodeTypeFromFd(fd) == DRM_NODE_RENDER;
+	if (is_render_node)
+		kms->render_node_name = strdup(device_name);
+	else
+		kms->render_node_name = drmGetRenderDeviceNameFromFd(fd);
+
+	/* version 6 clients get all the formats at once */
+	kms->format_table = kms_format_table_create(fd);
+
+	kms->global = wl_global_create(display, &wl_kms_interface, WL_KMS_VERSION,
+				       kms, bind_kms);
+	if (!kms->global)
+		goto error;
+
+	/*
+	 * we're the server in the middle. we should forward the all
+	 * client authentication requests to our server.  We may
+	 * also need to authenticate ourselves later if we provide buffers
+	 * to clients.
+	 */
+	if (server) {
+		kms->auth = kms_auth_init(server, wl_display_get_event_loop(display),
+					  fd);
+		if (!kms->auth)
+			goto error;
+	}
+
+	if (server && !is_render_node) {
+		/* get the reply in the background; it is waited for on first use */
+		kms_self_auth_start(kms);
+	} else {
+		kms->authenticated = 1;
+	}
+
+	kms->pool.min = KMS_POOL_MIN;
+	kms->pool.max = KMS_POOL_MAX;
+	kms->pool.idle_timer =
+		wl_event_loop_add_timer(wl_display_get_event_loop(display),
+					kms_pool_idle, kms);
+	kms_pool_fill(kms, kms->pool.min);
+
+	/* WAYLAND_KMS_TRACE=<file>: trace, and dump to <file>.<device> on SIGUSR2 */
+	kms_trace_init_from_env(kms);
+
+	wl_list_insert(kms_instances.prev, &kms->link);
+	return kms;
+
+error:
+	if (kms->global)
+		wl_global_destroy(kms->global);
+	kms_auth_uninit(kms->auth);
+	kms_format_table_destroy(kms->format_table);
+	free(kms->render_node_name);
+	free(kms->device_name);
+	free(kms);
+
+	return NULL;
+}
+
+/* The same node, or a node given by the same name */
+static int kms_is_device(struct wl_kms *kms, const char *device_name, int fd)
+{
+	struct stat st;
+
+	if (kms->rdev && fstat(fd, &st) == 0 && st.st_rdev == kms->rdev)
+		return 1;
+
+	return strcmp(kms->device_name, device_name) == 0;
+}
+
+struct wl_kms *wayland_kms_init(struct wl_display *display,
+				struct wl_display *server, char *device_name, int fd)
+{
+	struct wl_kms *kms;
+
+	/*
+	 * Callers expect the wl_kms of the display, whatever the device;
+	 * a second device takes wayland_kms_init_device().
+	 */
+	wl_list_for_each(kms, &kms_instances, link) {
+		if (kms->display == display) {
+			if (!kms_is_device(kms, device_name, fd))
+				WLKMS_DEBUG("%s: %s: %s asked, the wl_kms of %s returned.\n",
+					    __FILE__, __func__, device_name, kms->device_name);
+			kms->refcount++;
+			return kms;
+		}
+	}
+
+	return kms_create(display, server, device_name, fd);
+}
+
+struct wl_kms *wayland_kms_init_device(struct wl_display *display,
+				       struct wl_display *server,
+				       char *device_name, int fd)
+{
+	struct wl_kms *kms;
+
+	wl_list_for_each(kms, &kms_instances, link) {
+		if (kms->display == display && kms_is_device(kms, device_name, fd)) {
+			kms->refcount++;
+			return kms;
+		}
+	}
+
+	return kms_create(display, server, device_name, fd);
+}
+
+void wayland_kms_uninit(struct wl_kms *kms)
+{
+	struct wl_kms_client *kc, *kc_tmp;
+	struct wl_kms_auth_pending *pending, *pending_tmp;
+	struct kms_foreign_import *fi, *fi_tmp;
+	struct kms_buffer *kb, *kb_tmp;
+	struct kms_batch *batch, *batch_tmp;
+	struct wl_resource *resource, *resource_tmp;
+
+	if (!kms || --kms->refcount > 0)
+		return;
+
+	wl_list_remove(&kms->link);
+
+	/* no more clients binding to us */
+	wl_global_destroy(kms->global);
+
+	/* lets the imports in flight finish */
+	kms_workqueue_destroy(kms->import_wq);
+	kms_workqueue_destroy(kms->convert_wq);
+	kms_gem_close_deferred(kms);
+	wl_array_release(&kms->deferred_closes);
+
+	wl_list_for_each_safe(batch, batch_tmp, &kms->batches, link) {
+		kms_batch_drop_buffers(batch);
+		batch->kms = NULL;
+		wl_list_remove(&batch->link);
+		wl_list_init(&batch->link);
+	}
+
+	wl_list_for_each_safe(kb, kb_tmp, &kms->buffers, kms_link) {
+		if (kb->base.resource)
+			wl_resource_set_implementation(kb->base.resource,
+						       &kms_buffer_interface,
+						       NULL, NULL);
+		kms_buffer_release(kb);
+	}
+
+	wl_list_for_each_safe(kc, kc_tmp, &kms->clients, link) {
+		wl_list_remove(&kc->destroy_listener.link);
+		wl_list_remove(&kc->link);
+		free(kc);
+	}
+
+	wl_list_for_each_safe(pending, pending_tmp, &kms->pending, link) {
+		kms_auth_cancel(pending->request);
+		kms_auth_pending_free(pending);
+	}
+
+	wl_resource_for_each_safe(resource, resource_tmp, &kms->resources) {
+		wl_list_remove(wl_resource_get_link(resource));
+		wl_list_init(wl_resource_get_link(resource));
+		wl_resource_set_user_data(resource, NULL);
+	}
+
+	/* buffers of other devices imported into this one */
+	wl_list_for_each_safe(fi, fi_tmp, &kms->foreign, kms_link)
+		kms_foreign_import_destroy(fi);
+
+	if (kms->pool.idle_timer)
+		wl_event_source_remove(kms->pool.idle_timer);
+	kms_pool_trim(kms, 0);
+
+	kms_trace_destroy(kms->trace);
+	free(kms->trace_path);
+
+	kms_auth_uninit(kms->auth);
+	kms_format_table_destroy(kms->format_table);
+	free(kms->render_node_name);
+	free(kms->device_name);
+	free(kms);
+}
+
+void wayland_kms_set_flags(struct wl_kms *kms, uint32_t flags)
+{
+	kms->flags = flags;
+}
+
+int wayland_kms_buffer_get_plane_fd(struct wl_kms_buffer *buffer, int plane)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+	int fd;
+
+	if (plane < 0 || plane >= buffer->num_planes)
+		return -1;
+
+	if (buffer->planes[plane].fd != WL_KMS_INVALID_FD)
+		return fcntl(buffer->planes[plane].fd, F_DUPFD_CLOEXEC, 0);
+
+	/* dropped, so imported already */
+	if (kms_buffer_import(kb, kb->kms_resource) < 0)
+		return -1;
+
+	if (drmPrimeHandleToFD(buffer->kms->fd, buffer->planes[plane].handle,
+			       DRM_CLOEXEC | DRM_RDWR, &fd))
+		return -1;
+
+	buffer->kms->stats.fd_exports++;
+	return fd;
+}
+
+void wayland_kms_set_ready_callback(struct wl_kms *kms, wl_kms_ready_func_t func,
+				    void *data)
+{
+	kms->ready = func;
+	kms->ready_data = data;
+}
+
+int wayland_kms_buffer_is_ready(struct wl_kms_buffer *buffer)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+
+	return !kb->import_job;
+}
+
+void wayland_kms_set_allocator(struct wl_kms *kms, wl_kms_alloc_func_t func,
+			       void *data)
+{
+	kms->alloc = func ? func : kms_dumb_alloc;
+	kms->alloc_data = func ? data : NULL;
+}
+
+void wayland_kms_set_allocation_limit(struct wl_kms *kms, uint64_t bytes)
+{
+	kms->alloc_limit = bytes;
+}
+
+void wayland_kms_set_buffer_pool(struct wl_kms *kms, int min, int max)
+{
+	if (min < 0)
+		min = 0;
+	if (max < min)
+		max = min;
+
+	kms->pool.min = min;
+	kms->pool.max = max;
+
+	kms_pool_trim(kms, max);
+	kms_pool_fill(kms, min);
+}
+
+void wayland_kms_get_import_stats(struct wl_kms *kms,
+				  struct wl_kms_import_stats *stats)
+{
+	*stats = kms->stats.import;
+}
+
+void wayland_kms_get_stats(struct wl_kms *kms, struct wl_kms_stats *stats)
+{
+	*stats = kms->stats;
+}
+
+int wayland_kms_set_trace(struct wl_kms *kms, int events)
+{
+	if (events <= 0) {
+		kms_trace_destroy(kms->trace);
+		kms->trace = NULL;
+		return 0;
+	}
+
+	return kms_trace_start(kms, events);
+}
+
+int wayland_kms_dump_trace(struct wl_kms *kms, int fd)
+{
+	if (!kms->trace) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return kms_trace_dump(kms->trace, fd);
+}
+
+char *wayland_kms_stats_to_json(const struct wl_kms_stats *stats)
+{
+	char *json = NULL;
+	size_t size;
+	FILE *fp;
+	int i;
+
+	if (!(fp = open_memstream(&json, &size)))
+		return NULL;
+
+	fprintf(fp, "{\"buffers\":%" PRIu32 ",\"planes\":%" PRIu32 ",",
+		stats->buffers, stats->planes);
+
+	fprintf(fp, "\"fds\":{\"open\":%" PRIu32 ",\"exports\":%" PRIu64 "},",
+		stats->fds, stats->fd_exports);
+
+	fprintf(fp, "\"import\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64
+		",\"handles\":%" PRIu32 ",\"deferred\":%" PRIu64
+		",\"avoided\":%" PRIu64 ",\"queued\":%" PRIu64
+		",\"failures\":%" PRIu64 "},",
+		stats->import.hits, stats->import.misses, stats->import.handles,
+		stats->import.deferred, stats->import.avoided,
+		stats->import.queued, stats->import_failures);
+
+	fprintf(fp, "\"gem_close\":{\"count\":%" PRIu64 ",\"failures\":%" PRIu64 "},",
+		stats->gem_closes, stats->gem_close_failures);
+
+	fprintf(fp, "\"auth\":{\"requests\":%" PRIu64 ",\"cached\":%" PRIu64
+		",\"failures\":%" PRIu64 ",\"latency_us_log2\":[",
+		stats->auth_requests, stats->auth_cached, stats->auth_failures);
+	for (i = 0; i < WL_KMS_STATS_LATENCY_BUCKETS; i++)
+		fprintf(fp, "%s%" PRIu64, i ? "," : "", stats->auth_latency[i]);
+	fprintf(fp, "]},");
+
+	fprintf(fp, "\"formats\":{");
+	for (i = 0; i < stats->num_formats; i++)
+		fprintf(fp, "%s\"%.4s\":%" PRIu32, i ? "," : "",
+			(const char *)&stats->formats[i].format,
+			stats->formats[i].buffers);
+	fprintf(fp, "},");
+
+	fprintf(fp, "\"create\":{\"count\":%" PRIu64 ",\"ns\":%" PRIu64 "},"
+		"\"destroy\":{\"count\":%" PRIu64 ",\"ns\":%" PRIu64 "},",
+		stats->creates, stats->create_ns,
+		stats->destroys, stats->destroy_ns);
+
+	fprintf(fp, "\"allocate\":{\"count\":%" PRIu64 ",\"ns\":%" PRIu64
+		",\"failures\":%" PRIu64 "},",
+		stats->allocations, stats->allocation_ns,
+		stats->allocation_failures);
+
+	fprintf(fp, "\"forward\":{\"count\":%" PRIu64 ",\"releases\":%" PRIu64 "}}",
+		stats->forwards, stats->forward_releases);
+
+	if (fclose(fp)) {
+		free(json);
+		return NULL;
+	}
+
+	return json;
+}
+
+uint32_t wayland_kms_buffer_get_format(struct wl_kms_buffer *buffer)
+{
+	return buffer->format;
+}
+
+int wayland_kms_buffer_query_fb(struct wl_kms_buffer *buffer, uint32_t *fb_id)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+
+	*fb_id = kb->fb_state > 0 ? kb->fb_id : 0;
+	return kb->fb_state != 0;
+}
+
+uint32_t wayland_kms_buffer_get_fb(struct wl_kms_buffer *buffer)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+	int i;
+
+	if (kb->fb_state)
+		return kb->fb_id;
+
+	if (kms_buffer_import(kb, kb->kms_resource) < 0)
+		return 0;
+
+	for (i = 0; i < buffer->num_planes; i++) {
+		handles[i] = buffer->planes[i].handle;
+		pitches[i] = buffer->planes[i].stride;
+		offsets[i] = buffer->planes[i].offset;
+	}
+
+	if (drmModeAddFB2(buffer->kms->fd, buffer->width, buffer->height,
+			  buffer->format, handles, pitches, offsets, &kb->fb_id, 0)) {
+		WLKMS_DEBUG("%s: %s: drmModeAddFB2() failed (%s)\n",
+			    __FILE__, __func__, strerror(errno));
+		kb->fb_id = 0;
+
+		/*
+		 * Don't try again for buffers the device can't scan out;
+		 * running out of memory or being interrupted may pass.
+		 */
+		if (errno == EINVAL || errno == ERANGE)
+			kb->fb_state = -1;
+		return 0;
+	}
+
+	kb->fb_state = 1;
+	return kb->fb_id;
+}
+
+static void kms_buffer_forward_release(void *data)
+{
+	struct kms_buffer *kb = data;
+
+	kb->base.kms->stats.forward_releases++;
+	wayland_kms_buffer_send_release(&kb->base, -1);
+	if (kb->base.resource)
+		wl_buffer_send_release(kb->base.resource);
+}
+
+struct wl_buffer *wayland_kms_buffer_forward(struct wl_kms_buffer *buffer)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+	struct wl_kms *kms = buffer->kms;
+	int32_t fds[MAX_PLANES] = {
+		WL_KMS_INVALID_FD, WL_KMS_INVALID_FD,
+		WL_KMS_INVALID_FD, WL_KMS_INVALID_FD
+	};
+	uint32_t offsets[MAX_PLANES] = { 0 };
+	uint32_t strides[MAX_PLANES] = { 0 };
+	int i;
+
+	if (!kms->auth)
+		return NULL;
+
+	/* either the server waits for the fence, or the compositor has to */
+	if (kb->acquire_fence >= 0 && !kms_auth_can_fence(kms->auth))
+		return NULL;
+
+	if (!kb->forward) {
+		for (i = 0; i < buffer->num_planes; i++) {
+			fds[i] = kms_buffer_get_fd(kb, i);
+			offsets[i] = buffer->planes[i].offset;
+			strides[i] = buffer->planes[i].stride;
+		}
+
+		for (i = 0; i < buffer->num_planes && fds[i] >= 0; i++)
+			;
+		if (i == buffer->num_planes)
+			kb->forward = kms_auth_buffer_create(kms->auth, buffer->width,
+							     buffer->height, buffer->format,
+							     buffer->num_planes, fds, offsets,
+							     strides, kms_buffer_forward_release,
+							     kb);
+
+		/* the fds were sent already */
+		for (i = 0; i < buffer->num_planes; i++)
+			kms_buffer_put_fd(kb, i, fds[i]);
+
+		if (!kb->forward)
+			return NULL;
+		kms->stats.forwards++;
+	}
+
+	if (kb->acquire_fence >= 0) {
+		if (kms_auth_buffer_set_fence(kb->forward, kb->acquire_fence) < 0)
+			return NULL;
+		close(kb->acquire_fence);
+		kb->acquire_fence = -1;
+	}
+
+	return kms_auth_buffer_get(kb->forward);
+}
+
+void wayland_kms_buffer_send_scanout_hint(struct wl_kms_buffer *buffer,
+					  uint32_t format, int32_t width,
+					  int32_t height)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+
+	if (wl_resource_get_version(kb->kms_resource) < 8)
+		return;
+
+	if (kb->hint_format == format && kb->hint_width == width &&
+	    kb->hint_height == height)
+		return;
+
+	kb->hint_format = format;
+	kb->hint_width = width;
+	kb->hint_height = height;
+
+	wl_resource_post_event(kb->kms_resource, WL_KMS_SCANOUT_HINT,
+			       buffer->resource, format, width, height);
+}
+
+int wayland_kms_buffer_take_acquire_fence(struct wl_kms_buffer *buffer)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+	int fence = kb->acquire_fence;
+
+	kb->acquire_fence = -1;
+	return fence;
+}
+
+static int kms_fence_signaled(int fd, uint32_t mask, void *data)
+{
+	struct wl_kms_fence_wait *wait = data;
+	struct wl_kms_buffer *buffer = wait->buffer;
+	wl_kms_fence_func_t func = wait->func;
+	void *func_data = wait->data;
+
+	/* an error on the fence won't get any better by waiting */
+	kms_fence_wait_destroy(wait);
+	func(buffer, func_data);
+
+	return 0;
+}
+
+static void kms_fence_none(void *data)
+{
+	struct wl_kms_fence_wait *wait = data;
+
+	/* idle sources are removed by the event loop itself */
+	wait->source = NULL;
+	kms_fence_signaled(-1, 0, wait);
+}
+
+struct wl_kms_fence_wait *
+wayland_kms_buffer_wait_acquire(struct wl_kms_buffer *buffer,
+				wl_kms_fence_func_t func, void *data)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+	struct wl_event_loop *loop = wl_display_get_event_loop(buffer->kms->display);
+	struct wl_kms_fence_wait *wait;
+
+	if (!(wait = calloc(1, sizeof(struct wl_kms_fence_wait))))
+		return NULL;
+
+	wait->buffer = buffer;
+	wait->func = func;
+	wait->data = data;
+	wait->fence = wayland_kms_buffer_take_acquire_fence(buffer);
+
+	/* a sync_file becomes readable once signaled */
+	if (wait->fence >= 0)
+		wait->source = wl_event_loop_add_fd(loop, wait->fence, WL_EVENT_READABLE,
+						    kms_fence_signaled, wait);
+	else
+		wait->source = wl_event_loop_add_idle(loop, kms_fence_none, wait);
+
+	if (!wait->source) {
+		if (wait->fence >= 0)
+			close(wait->fence);
+		free(wait);
+		return NULL;
+	}
+
+	wl_list_insert(&kb->fence_waits, &wait->link);
+	return wait;
+}
+
+void wayland_kms_fence_wait_cancel(struct wl_kms_fence_wait *wait)
+{
+	kms_fence_wait_destroy(wait);
+}
+
+void wayland_kms_buffer_send_release(struct wl_kms_buffer *buffer, int fence)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+	struct wl_resource *release, *tmp;
+
+	wl_resource_for_each_safe(release, tmp, &kb->releases) {
+		if (fence >= 0)
+			wl_resource_post_event(release, WL_KMS_BUFFER_RELEASE_FENCED_RELEASE,
+					       fence);
+		else
+			wl_resource_post_event(release, WL_KMS_BUFFER_RELEASE_IMMEDIATE_RELEASE);
+		wl_resource_destroy(release);
+	}
+}
+
+const struct wl_kms_buffer_desc *
+wayland_kms_buffer_get_desc(struct wl_kms_buffer *buffer)
+{
+	struct kms_buffer *kb = wl_container_of(buffer, kb, base);
+
+	return &kb->desc;
+}
+
+int wayland_kms_query_buffer(struct wl_kms *kms, struct wl_resource *resource,
+				enum wl_kms_attribute attr, int *value)
+{
+	struct wl_kms_buffer *buffer = wayland_kms_buffer_get(resource);
+	const struct wl_kms_buffer_desc *desc;
+
+	if (!buffer)
+		return -1;
+
+	desc = wayland_kms_buffer_get_desc(buffer);
+
+	switch (attr) {
+	case WL_KMS_WIDTH:
+		*value = desc->width;
+		return 0;
+
+	case WL_KMS_HEIGHT:
+		*value = desc->height;
 		return 0;
 	
 	case WL_KMS_TEXTURE_FORMAT:
-		*value = wayland_kms_get_texture_format(buffer);
+		*value = desc->texture_format;
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+int wayland_kms_query_plane(struct wl_kms *kms, struct wl_resource *resource,
+			    int plane, enum wl_kms_plane_attribute attr, int *value)
+{
+	struct wl_kms_buffer *buffer = wayland_kms_buffer_get(resource);
+	const struct wl_kms_buffer_desc *desc;
+	struct kms_buffer *kb;
+	int num_planes, i, xuxv;
+
+	if (!buffer)
+		return -1;
+
+	kb = wl_container_of(buffer, kb, base);
+	desc = &kb->desc;
+
+	/* Y and XUXV are both read from the packed plane */
+	xuxv = desc->texture_format == EGL_TEXTURE_Y_XUXV_WL;
+	num_planes = xuxv ? 2 : desc->num_planes;
+	if (plane < 0 || plane >= num_planes)
+		return -1;
+	i = xuxv ? 0 : plane;
+
+	switch (attr) {
+	case WL_KMS_PLANE_HANDLE:
+		if (kms_buffer_import(kb, kb->kms_resource) < 0)
+			return -1;
+		*value = desc->planes[i].handle;
+		return 0;
+
+	case WL_KMS_PLANE_STRIDE:
+		*value = desc->planes[i].stride;
+		return 0;
+
+	case WL_KMS_PLANE_OFFSET:
+		*value = desc->planes[i].offset;
+		return 0;
+
+	case WL_KMS_PLANE_WIDTH:
+		if (plane == 0)
+			*value = desc->width;
+		else if (xuxv)
+			*value = (desc->width + 1) / 2;
+		else
+			*value = (desc->width + kb->info->hsub - 1) / kb->info->hsub;
+		return 0;
+
+	case WL_KMS_PLANE_HEIGHT:
+		if (plane == 0 || xuxv)
+			*value = desc->height;
+		else
+			*value = (desc->height + kb->info->vsub - 1) / kb->info->vsub;
 		return 0;
 
 	default:
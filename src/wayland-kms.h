@@ -43,12 +43,13 @@
 
 struct wl_kms;
 
-#define MAX_PLANES 3
+#define MAX_PLANES 4
 
 struct wl_kms_planes {
 	int fd;
 	uint32_t stride;
 	uint32_t handle;
+	uint32_t offset;	/* of the plane in its dma-buf */
 };
 
 struct wl_kms_buffer {
@@ -69,12 +70,102 @@ extern int wayland_kms_fd_get(struct wl_kms *kms);
 
 extern struct wl_kms_buffer *wayland_kms_buffer_get(struct wl_resource *resource);
 
+/*
+ * Same as wayland_kms_buffer_get(), but makes sure the GEM handles of
+ * the buffer are valid. With WL_KMS_FLAG_LAZY_IMPORT, this is where
+ * the buffer is imported; if that fails, the error is sent to the
+ * client and NULL is returned.
+ */
+extern struct wl_kms_buffer *wayland_kms_buffer_get_imported(struct wl_resource *resource);
+
+/*
+ * Returns the wl_kms of the display, created on the given device the
+ * first time. Later calls return the same one, whatever their device,
+ * and each is to be matched by a wayland_kms_uninit().
+ */
 extern struct wl_kms *wayland_kms_init(struct wl_display *display,
 				       struct wl_display *server,
 				       char *device_name, int fd);
 
+/*
+ * Same, but for the device given: the wl_kms of the display on that
+ * device if there is one, or a new one with a wl_kms global of its own.
+ * This is how a compositor driving several devices advertises each.
+ */
+extern struct wl_kms *wayland_kms_init_device(struct wl_display *display,
+					      struct wl_display *server,
+					      char *device_name, int fd);
+
+/*
+ * Undoes a wayland_kms_init*() call. Once the last one is undone, the
+ * buffers still alive are released, and are not to be used any more.
+ * Clients may outlive the wl_kms: their resources are left inert, and
+ * what they request from then on fails quietly.
+ */
 extern void wayland_kms_uninit(struct wl_kms *kms);
 
+/*
+ * Gets GEM handles of the buffer planes valid on the device of kms,
+ * which may not be the wl_kms the buffer belongs to (buffer->kms).
+ * A buffer is imported into another device only once; the handles
+ * remain valid until the buffer is destroyed.
+ */
+extern int wayland_kms_buffer_import(struct wl_kms *kms,
+				     struct wl_kms_buffer *buffer,
+				     uint32_t handles[MAX_PLANES]);
+
+/*
+ * Returns a dma-buf fd for a plane of the buffer, which the caller has
+ * to close. With WL_KMS_FLAG_DROP_FDS, it is exported again from the
+ * GEM handle of the plane, so only ask for it when really needed.
+ */
+extern int wayland_kms_buffer_get_plane_fd(struct wl_kms_buffer *buffer,
+					   int plane);
+
+enum wl_kms_flags {
+	/* import buffers on first use instead of at creation */
+	WL_KMS_FLAG_LAZY_IMPORT = (1 << 0),
+
+	/*
+	 * report EGL_TEXTURE_Y_UV_WL, EGL_TEXTURE_Y_U_V_WL and
+	 * EGL_TEXTURE_Y_XUXV_WL for YUV buffers, to be sampled plane by
+	 * plane, instead of EGL_TEXTURE_EXTERNAL_WL or nothing; the
+	 * order of U and V still follows the format (NV21, YVU420...)
+	 */
+	WL_KMS_FLAG_PLANAR_TEXTURES = (1 << 1),
+
+	/*
+	 * import buffers on worker threads, keeping the event loop going;
+	 * see wayland_kms_set_ready_callback()
+	 */
+	WL_KMS_FLAG_ASYNC_IMPORT = (1 << 2),
+
+	/*
+	 * close the dma-buf fds of buffers once they are imported; their
+	 * planes[].fd and fd are WL_KMS_INVALID_FD from then on, see
+	 * wayland_kms_buffer_get_plane_fd()
+	 */
+	WL_KMS_FLAG_DROP_FDS = (1 << 3),
+};
+
+/* to be set before clients create buffers */
+extern void wayland_kms_set_flags(struct wl_kms *kms, uint32_t flags);
+
+/*
+ * With WL_KMS_FLAG_ASYNC_IMPORT, func is called from the event loop
+ * once the import of a new buffer is done, with result 0 if the buffer
+ * can be used, or -1 if its client was sent an error. That is the time
+ * to create framebuffers or EGLImages for it. Until then, the buffer
+ * isn't ready, and wayland_kms_buffer_get_imported() waits for the
+ * import.
+ */
+typedef void (*wl_kms_ready_func_t)(struct wl_kms_buffer *buffer, int result,
+				    void *data);
+
+extern void wayland_kms_set_ready_callback(struct wl_kms *kms,
+					   wl_kms_ready_func_t func, void *data);
+extern int wayland_kms_buffer_is_ready(struct wl_kms_buffer *buffer);
+
 extern uint32_t wayland_kms_buffer_get_format(struct wl_kms_buffer *buffer);
 
 enum wl_kms_attribute {
@@ -87,6 +178,308 @@ extern int wayland_kms_query_buffer(struct wl_kms *kms,
 				    struct wl_resource *resource,
 				    enum wl_kms_attribute attr, int *value);
 
+enum wl_kms_plane_attribute {
+	WL_KMS_PLANE_HANDLE,		/* imports the buffer if needed */
+	WL_KMS_PLANE_STRIDE,
+	WL_KMS_PLANE_OFFSET,
+	WL_KMS_PLANE_WIDTH,		/* subsampled size */
+	WL_KMS_PLANE_HEIGHT,
+};
+
+/*
+ * Queries a plane of the texture format of the buffer, so that YUV
+ * planes can be sampled directly. With EGL_TEXTURE_Y_XUXV_WL, planes
+ * 0 and 1 are both in the single plane of the buffer.
+ */
+extern int wayland_kms_query_plane(struct wl_kms *kms,
+				   struct wl_resource *resource, int plane,
+				   enum wl_kms_plane_attribute attr, int *value);
+
+enum wl_kms_buffer_flags {
+	WL_KMS_BUFFER_Y_INVERTED = (1 << 0),	/* as EGL_WAYLAND_Y_INVERTED_WL */
+	WL_KMS_BUFFER_HAS_ALPHA = (1 << 1),
+};
+
+/* Everything a renderer needs to know about a buffer, computed once */
+struct wl_kms_buffer_desc {
+	int32_t width, height;
+	uint32_t format;		/* WL_KMS_FORMAT_* */
+	int texture_format;		/* as WL_KMS_TEXTURE_FORMAT */
+	uint32_t flags;			/* WL_KMS_BUFFER_* */
+	int num_planes;
+	struct {
+		uint32_t stride;
+		uint32_t offset;
+		uint32_t handle;	/* 0 until the buffer is imported */
+	} planes[MAX_PLANES];
+};
+
+/*
+ * Returns the description of the buffer, valid as long as the buffer.
+ * Unlike wayland_kms_query_buffer(), this is a plain pointer lookup.
+ */
+extern const struct wl_kms_buffer_desc *
+wayland_kms_buffer_get_desc(struct wl_kms_buffer *buffer);
+
+/*
+ * Keep between min and max wl_kms_buffer structures ready for reuse.
+ * The pool is filled up to min right away, grows up to max while
+ * buffers are being created and destroyed, and goes back to min once
+ * idle.
+ */
+extern void wayland_kms_set_buffer_pool(struct wl_kms *kms, int min, int max);
+
+/* PRIME imports, and how many of them reused a GEM handle we had */
+struct wl_kms_import_stats {
+	uint64_t hits;		/* imports served from the handle cache */
+	uint64_t misses;	/* imports that went to the kernel */
+	uint32_t handles;	/* GEM handles currently open */
+
+	/* WL_KMS_FLAG_LAZY_IMPORT */
+	uint64_t deferred;	/* buffers created without importing them */
+	uint64_t avoided;	/* buffers destroyed before their import */
+
+	/* WL_KMS_FLAG_ASYNC_IMPORT */
+	uint64_t queued;	/* buffers imported by the worker threads */
+};
+
+extern void wayland_kms_get_import_stats(struct wl_kms *kms,
+					 struct wl_kms_import_stats *stats);
+
+#define WL_KMS_STATS_LATENCY_BUCKETS 16
+#define WL_KMS_STATS_MAX_FORMATS 64
+
+/*
+ * Counters kept by a wl_kms at all times. They are plain increments on
+ * paths that do a syscall anyway, so taking a snapshot every frame is
+ * fine.
+ */
+struct wl_kms_stats {
+	/* live objects */
+	uint32_t buffers;
+	uint32_t planes;
+
+	/* dma-buf fds held open, and those exported again for consumers */
+	uint32_t fds;
+	uint64_t fd_exports;
+
+	/* PRIME imports and GEM handles; import.handles are the live ones */
+	struct wl_kms_import_stats import;
+	uint64_t import_failures;
+	uint64_t gem_closes;
+	uint64_t gem_close_failures;
+
+	/* client authentication */
+	uint64_t auth_requests;
+	uint64_t auth_cached;		/* answered from the per-client cache */
+	uint64_t auth_failures;
+
+	/*
+	 * Round trips of the requests forwarded to our server: bucket i
+	 * counts those under 2^i microseconds, the last one the rest.
+	 */
+	uint64_t auth_latency[WL_KMS_STATS_LATENCY_BUCKETS];
+
+	/* live buffers per format, in the order formats are advertised */
+	int num_formats;
+	struct {
+		uint32_t format;
+		uint32_t buffers;
+	} formats[WL_KMS_STATS_MAX_FORMATS];
+
+	/* wl_kms.create_mp_buffer/create_planar_buffer, and wl_buffer.destroy */
+	uint64_t creates, create_ns;
+	uint64_t destroys, destroy_ns;
+
+	/* wl_kms.allocate_buffer */
+	uint64_t allocations, allocation_ns;
+	uint64_t allocation_failures;
+
+	/* wayland_kms_buffer_forward(); forwards are wl_buffers created upstream */
+	uint64_t forwards, forward_releases;
+};
+
+extern void wayland_kms_get_stats(struct wl_kms *kms, struct wl_kms_stats *stats);
+
+/*
+ * Formats a snapshot as a single line JSON object, for logging and
+ * tracking the numbers over time. The string is to be freed by the
+ * caller; NULL is returned if memory ran out.
+ */
+extern char *wayland_kms_stats_to_json(const struct wl_kms_stats *stats);
+
+/*
+ * Event tracing
+ *
+ * Records timestamped binds, authentications, imports, buffer creations
+ * and destructions, and errors in a ring of the given number of events
+ * (rounded up to a power of 2). Recording takes no lock and no syscall
+ * besides the clock; 0 turns tracing off. It is also turned on at init
+ * when WAYLAND_KMS_TRACE is set to a file name, and the ring is then
+ * dumped to <file>.<device> each time the process gets SIGUSR2.
+ *
+ * tools/wayland-kms-trace.py converts dumps into Chrome trace JSON,
+ * which Perfetto opens as well.
+ */
+extern int wayland_kms_set_trace(struct wl_kms *kms, int events);
+
+/* Writes the events of the ring to fd; -1 if tracing is off */
+extern int wayland_kms_dump_trace(struct wl_kms *kms, int fd);
+
+/*
+ * Returns the KMS framebuffer of the buffer, for direct scanout. It is
+ * created on the first call and removed along with the buffer. 0 is
+ * returned if the buffer can't be a framebuffer; that result is kept
+ * as well when the device refused the buffer (EINVAL, ERANGE), and the
+ * next call tries again after other errors.
+ */
+extern uint32_t wayland_kms_buffer_get_fb(struct wl_kms_buffer *buffer);
+
+/*
+ * Returns 0 if wayland_kms_buffer_get_fb() wasn't called for the buffer
+ * yet, or if its result wasn't kept. Otherwise, returns 1 and sets
+ * fb_id to its result.
+ */
+extern int wayland_kms_buffer_query_fb(struct wl_kms_buffer *buffer,
+				       uint32_t *fb_id);
+
+/*
+ * For nested compositors: returns a wl_buffer of the server given to
+ * wayland_kms_init() holding the same planes as the buffer, to attach
+ * there instead of compositing the buffer. Nothing is copied or
+ * imported. The wl_buffer is created on the first call and destroyed
+ * along with the buffer; it belongs to a private queue of that
+ * connection, dispatched from our event loop.
+ *
+ * The pending acquire fence of the buffer is passed on. The client gets
+ * the buffer released whenever the server releases the wl_buffer, so
+ * the compositor should not release it itself. NULL is returned if we
+ * are not nested, if the server doesn't support the format, or if it
+ * can't take the acquire fence the buffer has.
+ */
+extern struct wl_buffer *wayland_kms_buffer_forward(struct wl_kms_buffer *buffer);
+
+/*
+ * Tells the client the buffer would have been scanned out had it been
+ * of that format and size, on the output it is mostly shown on.
+ * Nothing is sent if the hint didn't change since the last call.
+ */
+extern void wayland_kms_buffer_send_scanout_hint(struct wl_kms_buffer *buffer,
+						 uint32_t format, int32_t width,
+						 int32_t height);
+
+/*
+ * Explicit synchronization
+ *
+ * Clients may attach a sync_file acquire fence to a buffer, and ask
+ * for a release fence back.
+ */
+
+struct wl_kms_fence_wait;
+
+typedef void (*wl_kms_fence_func_t)(struct wl_kms_buffer *buffer, void *data);
+
+/* Takes the pending acquire fence of the buffer; -1 if there is none */
+extern int wayland_kms_buffer_take_acquire_fence(struct wl_kms_buffer *buffer);
+
+/*
+ * Calls func from the event loop once the pending acquire fence of
+ * the buffer signals, or on the next idle if there is none. The wait
+ * is freed before func is called, and cancelled if the buffer is
+ * destroyed.
+ */
+extern struct wl_kms_fence_wait *
+wayland_kms_buffer_wait_acquire(struct wl_kms_buffer *buffer,
+				wl_kms_fence_func_t func, void *data);
+
+extern void wayland_kms_fence_wait_cancel(struct wl_kms_fence_wait *wait);
+
+/*
+ * Tells the clients waiting for the buffer release that it is done
+ * once fence signals, or right away if fence is -1. The fence fd is
+ * not consumed.
+ */
+extern void wayland_kms_buffer_send_release(struct wl_kms_buffer *buffer,
+					    int fence);
+
+/*
+ * Server side allocation, for wl_kms.allocate_buffer
+ */
+
+/* Hints from the client, as the allocation_flag enum of the protocol */
+enum wl_kms_alloc_flags {
+	WL_KMS_ALLOC_CONTIGUOUS = (1 << 0),
+	WL_KMS_ALLOC_CACHED = (1 << 1),
+};
+
+/*
+ * Allocates the planes of a buffer for the device of the wl_kms. On
+ * success, fds holds a dma-buf fd per plane (dup'd if planes share a
+ * dma-buf), which the caller then owns, along with the offsets and
+ * strides of the planes. handles may be set to the GEM handles of the
+ * planes on wayland_kms_fd_get(); they are then used instead of
+ * importing the fds, and closed along with the buffer. Returns 0 on
+ * success, -1 on errors with nothing left allocated.
+ */
+typedef int (*wl_kms_alloc_func_t)(struct wl_kms *kms, int32_t width,
+				   int32_t height, uint32_t format,
+				   uint32_t flags, int32_t *fds,
+				   uint32_t *offsets, uint32_t *strides,
+				   uint32_t *handles, void *data);
+
+/*
+ * Replaces the default allocator, which creates a dumb buffer per
+ * plane and ignores the hints. NULL restores it.
+ */
+extern void wayland_kms_set_allocator(struct wl_kms *kms,
+				      wl_kms_alloc_func_t func, void *data);
+
+/*
+ * Caps the size of the buffers a client may have allocated at once,
+ * 256 MiB by default; 0 lifts the cap. Requests beyond it, or beyond
+ * the largest framebuffer of the device, are invalid_size errors.
+ */
+extern void wayland_kms_set_allocation_limit(struct wl_kms *kms, uint64_t bytes);
+
+/*
+ * CPU access, for software composition
+ */
+
+enum wl_kms_map_flags {
+	WL_KMS_MAP_READ = (1 << 0),
+	WL_KMS_MAP_WRITE = (1 << 1),
+};
+
+struct wl_kms_map;
+
+struct wl_kms_rect {
+	int32_t x, y, width, height;
+};
+
+/*
+ * Maps all the planes of the buffer. CPU access is bracketed with
+ * DMA_BUF_IOCTL_SYNC from map to unmap, so keep mappings short lived.
+ */
+extern struct wl_kms_map *wayland_kms_buffer_map(struct wl_kms_buffer *buffer,
+						 uint32_t flags);
+
+extern void *wayland_kms_map_get_plane(struct wl_kms_map *map, int plane,
+				       uint32_t *stride);
+
+extern void wayland_kms_buffer_unmap(struct wl_kms_map *map);
+
+/*
+ * Converts the given rectangles of the mapped buffer, or all of it if
+ * num_rects is 0, to the same rectangles of an XRGB8888 image of the
+ * size of the buffer. Large areas are split between threads, kept by
+ * the wl_kms of the buffer until wayland_kms_uninit(), so call it from
+ * the thread of its event loop. Returns -1 if the format can't be
+ * converted.
+ */
+extern int wayland_kms_map_convert(struct wl_kms_map *map, void *dst,
+				   uint32_t dst_stride,
+				   const struct wl_kms_rect *rects, int num_rects);
+
 #define WL_KMS_INVALID_FD -1
 
 #endif
@@ -0,0 +1,155 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * Limits of wl_kms.allocate_buffer, on vgem: sizes beyond the device
+ * and allocations beyond the cap of a client are invalid_size errors,
+ * the cap counts the live buffers of each client on its own, and 0
+ * lifts it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 256
+#define HEIGHT 256
+
+/* room for four XRGB8888 buffers */
+#define LIMIT (4 * WIDTH * HEIGHT * 4)
+
+struct set_limit {
+	struct kms_test_server *server;
+	uint64_t bytes;
+};
+
+static void do_set_limit(void *data)
+{
+	struct set_limit *sl = data;
+
+	wayland_kms_set_allocation_limit(sl->server->kms, sl->bytes);
+}
+
+static void set_limit(struct kms_test_server *s, uint64_t bytes)
+{
+	struct set_limit sl = { .server = s, .bytes = bytes };
+
+	kms_test_server_call(s, do_set_limit, &sl);
+}
+
+static struct wl_buffer *allocate(struct kms_test_client *c, int32_t width,
+				  int32_t height)
+{
+	struct wl_buffer *buffer;
+
+	buffer = wl_kms_allocate_buffer(c->wl_kms, width, height,
+					WL_KMS_FORMAT_XRGB8888, 0);
+	kms_test_client_roundtrip(c);
+	kms_test_client_reset_planes(c);
+
+	return buffer;
+}
+
+/* Allocates count buffers, which all have to succeed */
+static void allocate_ok(struct kms_test_client *c, struct wl_buffer **buffers,
+			int count)
+{
+	int i, allocated = c->allocated;
+
+	for (i = 0; i < count; i++)
+		buffers[i] = allocate(c, WIDTH, HEIGHT);
+
+	kms_test_assert(kms_test_client_get_error(c) == -1);
+	kms_test_assert(c->allocated == allocated + count);
+	kms_test_assert(c->allocation_failed == 0);
+}
+
+static void destroy_all(struct kms_test_client *c, struct wl_buffer **buffers,
+			int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		wl_buffer_destroy(buffers[i]);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+}
+
+static void expect_invalid_size(struct kms_test_client *c, int32_t width,
+				int32_t height)
+{
+	allocate(c, width, height);
+	kms_test_assert(kms_test_client_get_error(c) == WL_KMS_ERROR_INVALID_SIZE);
+	kms_test_client_destroy(c);
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *a, *b;
+	struct wl_buffer *buffers[8], *others[4];
+	struct wl_kms_stats stats;
+
+	s = kms_test_server_create("vgem", 0, NULL);
+
+	/* vgem has no KMS resources, so the fallback bounds apply */
+	expect_invalid_size(kms_test_client_create(s, 9), 16385, 16);
+	expect_invalid_size(kms_test_client_create(s, 9), 16, 16385);
+
+	set_limit(s, LIMIT);
+	a = kms_test_client_create(s, 9);
+	b = kms_test_client_create(s, 9);
+
+	/* a client at its cap doesn't keep the others from allocating */
+	allocate_ok(a, buffers, 4);
+	allocate_ok(b, others, 4);
+
+	/* freed buffers no longer count */
+	destroy_all(a, buffers, 2);
+	allocate_ok(a, buffers, 2);
+
+	/* no cap at all */
+	set_limit(s, 0);
+	allocate_ok(a, buffers + 4, 4);
+	destroy_all(a, buffers + 4, 4);
+
+	/* one too many */
+	set_limit(s, LIMIT);
+	destroy_all(b, others, 4);
+	expect_invalid_size(a, WIDTH, HEIGHT);
+
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.buffers == 0);
+	kms_test_assert(stats.allocation_failures == 0);
+
+	kms_test_client_destroy(b);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * WL_KMS_FLAG_ASYNC_IMPORT on vgem: a pool of buffers is imported by the
+ * workers and reported ready one by one, a buffer destroyed while its
+ * import is in flight is never reported and leaves no handle behind,
+ * and a file that isn't a dma-buf is reported failed and gets its
+ * client an invalid_fd error.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+#define NUM_BUFFERS 32
+
+/* Ready callbacks so far; only touched on the server thread */
+struct ready {
+	struct kms_test_server *server;
+	int ready, failed;
+	int unimported;			/* ready buffers without GEM handles */
+};
+
+static void handle_ready(struct wl_kms_buffer *buffer, int result, void *data)
+{
+	struct ready *r = data;
+
+	if (result < 0) {
+		r->failed++;
+		return;
+	}
+
+	r->ready++;
+	if (!wayland_kms_buffer_is_ready(buffer) || !buffer->planes[0].handle)
+		r->unimported++;
+}
+
+static void do_set_ready(void *data)
+{
+	struct ready *r = data;
+
+	wayland_kms_set_ready_callback(r->server->kms, handle_ready, r);
+}
+
+struct count {
+	struct ready *r;
+	int ready, failed;
+};
+
+static void do_count(void *data)
+{
+	struct count *c = data;
+
+	c->ready = c->r->ready;
+	c->failed = c->r->failed;
+}
+
+/* Waits for as many callbacks in all */
+static void wait_ready(struct ready *r, int ready, int failed)
+{
+	uint64_t end = kms_test_now_ns() + KMS_TEST_TIMEOUT_MS * 1000000ull;
+	struct count c = { .r = r };
+
+	for (;;) {
+		kms_test_server_call(r->server, do_count, &c);
+		if (c.ready == ready && c.failed == failed)
+			return;
+		kms_test_assert(c.ready <= ready && c.failed <= failed);
+		kms_test_assert(kms_test_now_ns() < end);
+		usleep(1000);
+	}
+}
+
+/* Waits until as many GEM handles are left open */
+static void wait_handles(struct kms_test_server *s, uint32_t handles)
+{
+	uint64_t end = kms_test_now_ns() + KMS_TEST_TIMEOUT_MS * 1000000ull;
+	struct wl_kms_stats stats;
+
+	for (;;) {
+		kms_test_server_get_stats(s, &stats);
+		if (stats.import.handles == handles)
+			return;
+		kms_test_assert(kms_test_now_ns() < end);
+		usleep(1000);
+	}
+}
+
+static struct wl_buffer *create_buffer(struct kms_test_client *c, int fd,
+				       uint32_t stride)
+{
+	return wl_kms_create_buffer(c->wl_kms, fd, WIDTH, HEIGHT, stride,
+				    WL_KMS_FORMAT_XRGB8888, 0);
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *c, *bad;
+	struct kms_test_bo bos[NUM_BUFFERS];
+	struct wl_buffer *buffers[NUM_BUFFERS], *doomed;
+	struct ready r = { 0 };
+	struct wl_kms_stats stats;
+	int dev, memfd, i;
+
+	s = kms_test_server_create("vgem", WL_KMS_FLAG_ASYNC_IMPORT, NULL);
+	kms_test_assert((dev = kms_test_open_device("vgem", NULL)) >= 0);
+	r.server = s;
+	kms_test_server_call(s, do_set_ready, &r);
+
+	c = kms_test_client_create(s, 7);
+	for (i = 0; i < NUM_BUFFERS; i++)
+		kms_test_assert(kms_test_bo_create(&bos[i], dev, WIDTH, HEIGHT, 32) == 0);
+
+	/* a whole pool in one go, as a client starting up would */
+	for (i = 0; i < NUM_BUFFERS; i++)
+		buffers[i] = create_buffer(c, bos[i].fd, bos[i].stride);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	wait_ready(&r, NUM_BUFFERS, 0);
+	kms_test_assert(r.unimported == 0);
+	kms_test_assert(kms_test_client_get_error(c) == -1);
+
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.import.queued == NUM_BUFFERS);
+	kms_test_assert(stats.import.handles == NUM_BUFFERS);
+
+	/* gone before its import is done, so never reported */
+	doomed = create_buffer(c, bos[0].fd, bos[0].stride);
+	wl_buffer_destroy(doomed);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	for (i = 0; i < NUM_BUFFERS; i++)
+		wl_buffer_destroy(buffers[i]);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	/* the import of the doomed one may still be finishing */
+	wait_handles(s, 0);
+	wait_ready(&r, NUM_BUFFERS, 0);
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.buffers == 0);
+	kms_test_assert(stats.import.queued == NUM_BUFFERS + 1);
+
+	/* a memfd can't be imported; the client hears of it once it failed */
+	bad = kms_test_client_create(s, 7);
+	memfd = memfd_create("async-import-test", MFD_CLOEXEC);
+	kms_test_assert(memfd >= 0);
+	kms_test_assert(ftruncate(memfd, WIDTH * HEIGHT * 4) == 0);
+	create_buffer(bad, memfd, WIDTH * 4);
+	close(memfd);
+	kms_test_client_roundtrip(bad);
+	wait_ready(&r, NUM_BUFFERS, 1);
+	kms_test_client_roundtrip(bad);
+	kms_test_assert(kms_test_client_get_error(bad) == WL_KMS_ERROR_INVALID_FD);
+	kms_test_client_destroy(bad);
+
+	/* and the workers have let go of every handle */
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.buffers == 0);
+	kms_test_assert(stats.import.handles == 0);
+	kms_test_assert(stats.import_failures == 1);
+
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+	for (i = 0; i < NUM_BUFFERS; i++)
+		kms_test_bo_destroy(&bos[i]);
+	close(dev);
+
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * Nested authentication with an upstream server offering several
+ * wl_kms: requests go to the one of our device only, including once
+ * more of them show up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "wayland-kms-server-protocol.h"
+#include "kms-test.h"
+
+struct upstream_global {
+	struct wl_display *display;
+	const char *device;
+	struct wl_global *global;
+	int binds, requests;
+};
+
+static void upstream_authenticate(struct wl_client *client,
+				  struct wl_resource *resource, uint32_t magic)
+{
+	struct upstream_global *g = wl_resource_get_user_data(resource);
+
+	g->requests++;
+	wl_kms_send_authenticated(resource);
+}
+
+static const struct wl_kms_interface upstream_interface = {
+	.authenticate = upstream_authenticate,
+};
+
+static void upstream_bind(struct wl_client *client, void *data,
+			  uint32_t version, uint32_t id)
+{
+	struct upstream_global *g = data;
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &wl_kms_interface, version, id);
+	kms_test_assert(resource);
+	wl_resource_set_implementation(resource, &upstream_interface, g, NULL);
+
+	g->binds++;
+	wl_kms_send_device(resource, g->device);
+	wl_kms_send_format(resource, WL_KMS_FORMAT_XRGB8888);
+}
+
+static void add_global(void *data)
+{
+	struct upstream_global *g = data;
+
+	g->global = wl_global_create(g->display, &wl_kms_interface,
+				     wl_kms_interface.version, g, upstream_bind);
+	kms_test_assert(g->global);
+}
+
+static void do_nothing(void *data)
+{
+}
+
+static void authenticate(struct kms_test_client *c, uint32_t magic)
+{
+	int authenticated = c->authenticated;
+
+	wl_kms_authenticate(c->wl_kms, magic);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	while (c->authenticated == authenticated)
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+}
+
+int main(void)
+{
+	struct kms_test_server *up, *s;
+	struct kms_test_client *c;
+	struct wl_display *upstream_display;
+	struct upstream_global zero = { .device = "/dev/zero" };
+	struct upstream_global null = { .device = "/dev/null" };
+	struct upstream_global late = { .device = "/dev/null" };
+
+	/* ours is not the first one */
+	up = kms_test_display_create();
+	zero.display = null.display = late.display = up->display;
+	add_global(&zero);
+	add_global(&null);
+	kms_test_server_start(up);
+
+	upstream_display = kms_test_server_connect(up, NULL);
+	s = kms_test_server_create(NULL, 0, upstream_display);
+	c = kms_test_client_create(s, 9);
+
+	/* each was looked at, and only ours is kept */
+	kms_test_server_call(up, do_nothing, NULL);
+	kms_test_assert(zero.binds == 1 && null.binds == 2);
+
+	authenticate(c, 1);
+	authenticate(c, 2);
+	kms_test_server_call(up, do_nothing, NULL);
+	kms_test_assert(null.requests == 2 && zero.requests == 0);
+
+	/* a wl_kms showing up later doesn't get bound */
+	kms_test_server_call(up, add_global, &late);
+	authenticate(c, 3);
+	kms_test_server_call(up, do_nothing, NULL);
+	kms_test_assert(null.requests == 3);
+	kms_test_assert(late.binds == 0 && late.requests == 0);
+
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+	wl_display_disconnect(upstream_display);
+	kms_test_server_destroy(up);
+
+	return 0;
+}
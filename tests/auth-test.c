@@ -0,0 +1,151 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Nested authentication: requests of several clients are pipelined to
+ * the upstream server, replies are matched in order, and the reply of a
+ * client gone in the meantime is dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+/* how long we give a reply to show up where it shouldn't */
+#define SETTLE_MS 100
+
+static void settle(struct kms_test_client *c)
+{
+	uint64_t end = kms_test_now_ns() + SETTLE_MS * 1000000ull;
+
+	while (kms_test_now_ns() < end) {
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+		usleep(1000);
+	}
+}
+
+static void authenticate(struct kms_test_client *c, uint32_t magic)
+{
+	wl_kms_authenticate(c->wl_kms, magic);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+}
+
+int main(void)
+{
+	struct kms_test_upstream *upstream;
+	struct wl_display *upstream_display;
+	struct kms_test_server *s;
+	struct kms_test_client *a, *b, *c, *d, *e, *late;
+	struct wl_kms_stats stats;
+
+	upstream = kms_test_upstream_create();
+	upstream_display = kms_test_upstream_connect(upstream);
+	s = kms_test_server_create(NULL, 0, upstream_display);
+
+	kms_test_upstream_hold(upstream, 1);
+
+	a = kms_test_client_create(s, 9);
+	b = kms_test_client_create(s, 9);
+
+	/* both requests go upstream without waiting for the first reply */
+	authenticate(a, 1);
+	authenticate(b, 2);
+	kms_test_assert(kms_test_upstream_wait_requests(upstream, 2,
+							KMS_TEST_TIMEOUT_MS) == 0);
+	kms_test_assert(!a->authenticated && !b->authenticated);
+
+	/* and don't hold up the clients binding meanwhile */
+	late = kms_test_client_create(s, 9);
+	kms_test_assert(late->formats > 0);
+	kms_test_client_destroy(late);
+
+	/* replies come back in order */
+	kms_test_upstream_release(upstream, 1);
+	kms_test_assert(kms_test_client_wait(a, &a->authenticated,
+					     KMS_TEST_TIMEOUT_MS) == 0);
+	settle(b);
+	kms_test_assert(!b->authenticated);
+
+	kms_test_upstream_release(upstream, 1);
+	kms_test_assert(kms_test_client_wait(b, &b->authenticated,
+					     KMS_TEST_TIMEOUT_MS) == 0);
+	kms_test_assert(a->authenticated == 1 && b->authenticated == 1);
+
+	/* a client leaving with its request in flight */
+	c = kms_test_client_create(s, 9);
+	d = kms_test_client_create(s, 9);
+	authenticate(c, 3);
+	authenticate(d, 4);
+	kms_test_assert(kms_test_upstream_wait_requests(upstream, 4,
+							KMS_TEST_TIMEOUT_MS) == 0);
+	kms_test_client_destroy(c);
+
+	/* the reply to c is consumed, not given to d */
+	kms_test_upstream_release(upstream, 1);
+	settle(d);
+	kms_test_assert(!d->authenticated);
+
+	kms_test_upstream_release(upstream, 1);
+	kms_test_assert(kms_test_client_wait(d, &d->authenticated,
+					     KMS_TEST_TIMEOUT_MS) == 0);
+	settle(d);
+	kms_test_assert(d->authenticated == 1);
+
+	/* the same magic again is answered right away, upstream held */
+	authenticate(d, 4);
+	kms_test_assert(d->authenticated == 2);
+
+	/* but only for the client it was authenticated for */
+	e = kms_test_client_create(s, 9);
+	authenticate(e, 4);
+	kms_test_assert(kms_test_upstream_wait_requests(upstream, 5,
+							KMS_TEST_TIMEOUT_MS) == 0);
+	kms_test_upstream_release(upstream, 1);
+	kms_test_assert(kms_test_client_wait(e, &e->authenticated,
+					     KMS_TEST_TIMEOUT_MS) == 0);
+
+	kms_test_assert(kms_test_client_get_error(a) < 0);
+	kms_test_assert(kms_test_client_get_error(d) < 0);
+	kms_test_assert(kms_test_client_get_error(e) < 0);
+
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.auth_requests == 6);
+	kms_test_assert(stats.auth_cached == 1);
+	kms_test_assert(stats.auth_failures == 0);
+
+	kms_test_client_destroy(a);
+	kms_test_client_destroy(b);
+	kms_test_client_destroy(d);
+	kms_test_client_destroy(e);
+	kms_test_server_destroy(s);
+	wl_display_disconnect(upstream_display);
+	kms_test_upstream_destroy(upstream);
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Batched buffer creation: 32 buffers created through one
+ * wl_kms_buffer_batch, against creating them one by one with a round
+ * trip each (to see each result, as the batch tells), and against
+ * pipelining the creates into a single round trip. Runs on vgem if
+ * there is one, and with lazy import on no device otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 256
+#define HEIGHT 256
+#define BUFFERS 32
+
+struct batch_result {
+	int created, failed;
+};
+
+static void batch_handle_created(void *data, struct wl_kms_buffer_batch *batch)
+{
+	struct batch_result *result = data;
+
+	result->created = 1;
+}
+
+static void batch_handle_failed(void *data, struct wl_kms_buffer_batch *batch)
+{
+	struct batch_result *result = data;
+
+	result->failed = 1;
+}
+
+static const struct wl_kms_buffer_batch_listener batch_listener = {
+	.created = batch_handle_created,
+	.failed = batch_handle_failed,
+};
+
+enum mode {
+	MODE_SINGLE,
+	MODE_PIPELINED,
+	MODE_BATCH,
+};
+
+static struct wl_buffer *create_buffer(struct kms_test_client *c,
+				       struct kms_test_bo *bo)
+{
+	return wl_kms_create_buffer(c->wl_kms, bo->fd, WIDTH, HEIGHT, bo->stride,
+				    WL_KMS_FORMAT_XRGB8888, 0);
+}
+
+static uint64_t create_all(struct kms_test_client *c, struct kms_test_bo *bos,
+			   struct wl_buffer **buffers, enum mode mode)
+{
+	struct wl_kms_buffer_batch *batch;
+	struct batch_result result = { 0 };
+	uint64_t start = kms_test_now_ns();
+	int i;
+
+	switch (mode) {
+	case MODE_SINGLE:
+		for (i = 0; i < BUFFERS; i++) {
+			buffers[i] = create_buffer(c, &bos[i]);
+			kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+		}
+		break;
+	case MODE_PIPELINED:
+		for (i = 0; i < BUFFERS; i++)
+			buffers[i] = create_buffer(c, &bos[i]);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+		break;
+	case MODE_BATCH:
+		batch = wl_kms_create_buffer_batch(c->wl_kms, WIDTH, HEIGHT,
+						   WL_KMS_FORMAT_XRGB8888);
+		wl_kms_buffer_batch_add_listener(batch, &batch_listener, &result);
+		for (i = 0; i < BUFFERS; i++)
+			buffers[i] = wl_kms_buffer_batch_add(batch, bos[i].fd,
+							     bos[i].stride,
+							     bos[i].fd, 0,
+							     bos[i].fd, 0);
+		wl_kms_buffer_batch_commit(batch);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+		kms_test_assert(result.created && !result.failed);
+		wl_kms_buffer_batch_destroy(batch);
+		break;
+	}
+
+	return kms_test_now_ns() - start;
+}
+
+static void run(struct kms_test_client *c, struct kms_test_bo *bos,
+		enum mode mode, const char *name, int rounds)
+{
+	struct wl_buffer *buffers[BUFFERS];
+	struct wl_kms_stats stats;
+	uint64_t ns = 0;
+	char label[64];
+	int r, i;
+
+	for (r = 0; r < rounds; r++) {
+		ns += create_all(c, bos, buffers, mode);
+
+		for (i = 0; i < BUFFERS; i++)
+			wl_buffer_destroy(buffers[i]);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	}
+
+	kms_test_server_get_stats(c->server, &stats);
+	snprintf(label, sizeof label, "batch/%s", name);
+	kms_bench_report(label, (uint64_t)rounds * BUFFERS, ns, &stats);
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = kms_bench_iterations(argc, argv, 100);
+	struct kms_test_bo bos[BUFFERS];
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	int dev, i;
+
+	dev = kms_test_open_device("vgem", NULL);
+	s = kms_test_server_create(dev >= 0 ? "vgem" : NULL, 0, NULL);
+	c = kms_test_client_create(s, 9);
+
+	for (i = 0; i < BUFFERS; i++)
+		kms_test_assert(kms_test_bo_create(&bos[i], dev, WIDTH, HEIGHT, 32) == 0);
+
+	run(c, bos, MODE_SINGLE, "warmup", rounds / 10 + 1);
+	run(c, bos, MODE_SINGLE, "single", rounds);
+	run(c, bos, MODE_PIPELINED, "pipelined", rounds);
+	run(c, bos, MODE_BATCH, "batch", rounds);
+
+	for (i = 0; i < BUFFERS; i++)
+		kms_test_bo_destroy(&bos[i]);
+	if (dev >= 0)
+		close(dev);
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * wayland_kms_map_convert() of YUV buffers in memfds (or udmabufs),
+ * against a plain per pixel conversion: the SIMD rows, the edges they
+ * leave to the scalar code and the bands done by the threads of the
+ * wl_kms all have to give the very same pixels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+/* large enough to be split between threads */
+#define WIDTH 1024
+#define HEIGHT 640
+
+static uint8_t clamp(int value)
+{
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+/* BT.601 limited range, in the 6 bit fixed point of the library */
+static uint32_t yuv_pixel(int y, int u, int v)
+{
+	int c = 74 * (y - 16) + 32, d = u - 128, e = v - 128;
+
+	return 0xff000000 |
+	       clamp((c + 102 * e) >> 6) << 16 |
+	       clamp((c - 25 * d - 52 * e) >> 6) << 8 |
+	       clamp((c + 129 * d) >> 6);
+}
+
+struct layout {
+	uint32_t format;
+	const char *name;
+	int planes;
+	int rows;			/* of the bo, in luma rows */
+	int uv_step;			/* 2 for interleaved chroma */
+	int u, v;			/* chroma planes, or bytes in plane 1 */
+};
+
+static const struct layout layouts[] = {
+	{ WL_KMS_FORMAT_NV12, "NV12", 2, HEIGHT * 3 / 2, 2, 0, 1 },
+	{ WL_KMS_FORMAT_NV21, "NV21", 2, HEIGHT * 3 / 2, 2, 1, 0 },
+	{ WL_KMS_FORMAT_YUV420, "YUV420", 3, HEIGHT * 2, 1, 1, 2 },
+	{ WL_KMS_FORMAT_YVU420, "YVU420", 3, HEIGHT * 2, 1, 2, 1 },
+};
+
+#define NUM_LAYOUTS (sizeof(layouts) / sizeof(layouts[0]))
+
+/* the whole range of values, so that clamping is exercised too */
+static void fill(struct kms_test_bo *bo)
+{
+	uint32_t seed = 0x12345678, *p;
+	uint8_t *map;
+	uint64_t i;
+
+	map = mmap(NULL, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED, bo->fd, 0);
+	kms_test_assert(map != MAP_FAILED);
+
+	for (i = 0, p = (uint32_t *)map; i < bo->size / 4; i++) {
+		seed = seed * 1664525 + 1013904223;
+		p[i] = seed;
+	}
+
+	munmap(map, bo->size);
+}
+
+struct convert {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	const struct layout *layout;
+	const struct wl_kms_rect *rects;
+	int num_rects;
+	uint32_t *dst, *ref;
+};
+
+static const uint8_t *plane_row(struct wl_kms_map *map, int plane, int row)
+{
+	uint32_t stride;
+	uint8_t *p = wayland_kms_map_get_plane(map, plane, &stride);
+
+	kms_test_assert(p);
+	return p + (size_t)row * stride;
+}
+
+/* What the rectangles of the buffer should be converted to */
+static void reference(struct convert *cv, struct wl_kms_map *map)
+{
+	static const struct wl_kms_rect full = { 0, 0, WIDTH, HEIGHT };
+	const struct layout *l = cv->layout;
+	const struct wl_kms_rect *r;
+	const uint8_t *y, *u, *v;
+	int row, x, i, cx;
+
+	for (i = 0; i < (cv->num_rects ? cv->num_rects : 1); i++) {
+		r = cv->num_rects ? &cv->rects[i] : &full;
+
+		for (row = r->y; row < r->y + r->height; row++) {
+			if (row < 0 || row >= HEIGHT)
+				continue;
+
+			y = plane_row(map, 0, row);
+			if (l->uv_step == 2) {
+				u = plane_row(map, 1, row / 2) + l->u;
+				v = plane_row(map, 1, row / 2) + l->v;
+			} else {
+				u = plane_row(map, l->u, row / 2);
+				v = plane_row(map, l->v, row / 2);
+			}
+
+			for (x = r->x; x < r->x + r->width; x++) {
+				if (x < 0 || x >= WIDTH)
+					continue;
+				cx = x / 2 * l->uv_step;
+				cv->ref[row * WIDTH + x] = yuv_pixel(y[x], u[cx], v[cx]);
+			}
+		}
+	}
+}
+
+static void do_convert(void *data)
+{
+	struct convert *cv = data;
+	struct wl_kms_buffer *buffer;
+	struct wl_kms_map *map;
+
+	buffer = kms_test_client_get_buffer(cv->client, cv->buffer);
+	kms_test_assert(buffer);
+
+	map = wayland_kms_buffer_map(buffer, WL_KMS_MAP_READ);
+	kms_test_assert(map);
+
+	memset(cv->dst, 0, WIDTH * HEIGHT * 4);
+	memset(cv->ref, 0, WIDTH * HEIGHT * 4);
+	kms_test_assert(wayland_kms_map_convert(map, cv->dst, WIDTH * 4,
+						cv->rects, cv->num_rects) == 0);
+	reference(cv, map);
+
+	wayland_kms_buffer_unmap(map);
+}
+
+static void compare(const struct convert *cv, const char *what)
+{
+	int x, y;
+
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < WIDTH; x++) {
+			if (cv->dst[y * WIDTH + x] == cv->ref[y * WIDTH + x])
+				continue;
+			fprintf(stderr, "%s, %s: %08x instead of %08x at %d,%d\n",
+				cv->layout->name, what, cv->dst[y * WIDTH + x],
+				cv->ref[y * WIDTH + x], x, y);
+			abort();
+		}
+	}
+}
+
+int main(void)
+{
+	/* odd edges, so that rows start and end off the SIMD width */
+	static const struct wl_kms_rect odd[] = {
+		{ 3, 5, 501, 7 },
+		{ 1000, 1, 23, 3 },
+		{ 0, 600, 7, 40 },
+	};
+	/* clipped to the buffer */
+	static const struct wl_kms_rect clipped[] = {
+		{ -5, -3, 37, 19 },
+		{ WIDTH - 9, HEIGHT - 11, 100, 100 },
+	};
+	/* split in bands of rows */
+	static const struct wl_kms_rect large[] = {
+		{ 1, 1, WIDTH - 3, HEIGHT - 1 },
+	};
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct kms_test_bo bo;
+	struct convert cv = { 0 };
+	const struct layout *l;
+	uint32_t stride, offsets[3];
+	unsigned int i;
+	int j;
+
+	s = kms_test_server_create(NULL, 0, NULL);
+	c = kms_test_client_create(s, 7);
+
+	cv.client = c;
+	cv.dst = malloc(WIDTH * HEIGHT * 4);
+	cv.ref = malloc(WIDTH * HEIGHT * 4);
+	kms_test_assert(cv.dst && cv.ref);
+
+	for (i = 0; i < NUM_LAYOUTS; i++) {
+		l = &layouts[i];
+		kms_test_assert(kms_test_bo_create(&bo, -1, WIDTH, l->rows, 8) == 0);
+		fill(&bo);
+
+		/* chroma planes with the stride of the luma one */
+		stride = bo.stride;
+		offsets[0] = 0;
+		offsets[1] = stride * HEIGHT;
+		offsets[2] = offsets[1] + stride * HEIGHT / 2;
+		for (j = l->planes; j < 3; j++)
+			offsets[j] = 0;
+
+		/* the file offset is shared with us; nothing should move it */
+		kms_test_assert(lseek(bo.fd, 123, SEEK_SET) == 123);
+
+		cv.layout = l;
+		cv.buffer = wl_kms_create_planar_buffer(c->wl_kms, WIDTH, HEIGHT,
+							l->format,
+							bo.fd, offsets[0], stride,
+							bo.fd, offsets[1], stride,
+							bo.fd, offsets[2],
+							l->planes > 2 ? stride : 0,
+							bo.fd, 0, 0);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+		kms_test_assert(kms_test_client_get_error(c) < 0);
+
+		/* all of it */
+		cv.rects = NULL;
+		cv.num_rects = 0;
+		kms_test_server_call(s, do_convert, &cv);
+		compare(&cv, "full");
+
+		cv.rects = odd;
+		cv.num_rects = 3;
+		kms_test_server_call(s, do_convert, &cv);
+		compare(&cv, "odd");
+
+		cv.rects = clipped;
+		cv.num_rects = 2;
+		kms_test_server_call(s, do_convert, &cv);
+		compare(&cv, "clipped");
+
+		cv.rects = large;
+		cv.num_rects = 1;
+		kms_test_server_call(s, do_convert, &cv);
+		compare(&cv, "large");
+
+		kms_test_assert(lseek(bo.fd, 0, SEEK_CUR) == 123);
+
+		wl_buffer_destroy(cv.buffer);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+		kms_test_bo_destroy(&bo);
+	}
+
+	free(cv.dst);
+	free(cv.ref);
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
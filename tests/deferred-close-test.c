@@ -0,0 +1,194 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * GEM handle closes deferred while an asynchronous import is in flight,
+ * on vgem: a dma-buf re-sent by its client before the deferred close
+ * gets the very same handle from the kernel, which has to survive the
+ * close once the import is done. This is what a client recycling its
+ * swapchain does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+
+struct batch_result {
+	int created, failed;
+};
+
+static void batch_handle_created(void *data, struct wl_kms_buffer_batch *batch)
+{
+	struct batch_result *result = data;
+
+	result->created = 1;
+}
+
+static void batch_handle_failed(void *data, struct wl_kms_buffer_batch *batch)
+{
+	struct batch_result *result = data;
+
+	result->failed = 1;
+}
+
+static const struct wl_kms_buffer_batch_listener batch_listener = {
+	.created = batch_handle_created,
+	.failed = batch_handle_failed,
+};
+
+struct check {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	uint32_t handle;
+	int valid;
+};
+
+/* Whether the handle of the buffer is still open on the device */
+static void do_check(void *data)
+{
+	struct check *ch = data;
+	struct wl_kms_buffer *buffer;
+	int fd;
+
+	buffer = kms_test_client_get_buffer(ch->client, ch->buffer);
+	kms_test_assert(buffer);
+
+	ch->handle = buffer->planes[0].handle;
+	ch->valid = ch->handle &&
+		    !drmPrimeHandleToFD(ch->client->server->fd, ch->handle, DRM_CLOEXEC, &fd);
+	if (ch->valid)
+		close(fd);
+}
+
+static void check(struct kms_test_client *c, struct wl_buffer *buffer,
+		  uint32_t *handle)
+{
+	struct check ch = { .client = c, .buffer = buffer };
+
+	kms_test_server_call(c->server, do_check, &ch);
+	kms_test_assert(ch.valid);
+	if (handle)
+		*handle = ch.handle;
+}
+
+static struct wl_buffer *create_buffer(struct kms_test_client *c,
+				       struct kms_test_bo *bo)
+{
+	return wl_kms_create_buffer(c->wl_kms, bo->fd, WIDTH, HEIGHT, bo->stride,
+				    WL_KMS_FORMAT_XRGB8888, 0);
+}
+
+/* Waits for as many imports, queued ones included, to be done */
+static void wait_imports(struct kms_test_server *s, uint64_t queued,
+			 uint64_t imports)
+{
+	uint64_t end = kms_test_now_ns() + KMS_TEST_TIMEOUT_MS * 1000000ull;
+	struct wl_kms_stats stats;
+
+	for (;;) {
+		kms_test_server_get_stats(s, &stats);
+		if (stats.import.queued == queued &&
+		    stats.import.hits + stats.import.misses == imports)
+			return;
+		kms_test_assert(kms_test_now_ns() < end);
+		usleep(1000);
+	}
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct kms_test_bo recycled, other;
+	struct wl_buffer *first, *held, *again;
+	struct wl_kms_buffer_batch *batch;
+	struct batch_result result = { 0 };
+	struct wl_kms_stats stats;
+	uint32_t handle, handle_again;
+	int dev;
+
+	s = kms_test_server_create("vgem", WL_KMS_FLAG_ASYNC_IMPORT, NULL);
+	kms_test_assert((dev = kms_test_open_device("vgem", NULL)) >= 0);
+	c = kms_test_client_create(s, 7);
+
+	kms_test_assert(kms_test_bo_create(&recycled, dev, WIDTH, HEIGHT, 32) == 0);
+	kms_test_assert(kms_test_bo_create(&other, dev, WIDTH, HEIGHT, 32) == 0);
+
+	first = create_buffer(c, &recycled);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	wait_imports(s, 1, 1);
+	check(c, first, &handle);
+
+	/*
+	 * All in one go, so that the server handles it in a single dispatch,
+	 * before the import of held is reported done: held is in flight when
+	 * first goes, so the close of its handle is deferred, and the batch
+	 * imports the same dma-buf again right away.
+	 */
+	held = create_buffer(c, &other);
+	wl_buffer_destroy(first);
+	batch = wl_kms_create_buffer_batch(c->wl_kms, WIDTH, HEIGHT,
+					   WL_KMS_FORMAT_XRGB8888);
+	wl_kms_buffer_batch_add_listener(batch, &batch_listener, &result);
+	again = wl_kms_buffer_batch_add(batch, recycled.fd, recycled.stride,
+					recycled.fd, 0, recycled.fd, 0);
+	wl_kms_buffer_batch_commit(batch);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_assert(result.created && !result.failed);
+
+	/* held and the batch; the deferred close has run then */
+	wait_imports(s, 2, 3);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	check(c, held, NULL);
+	check(c, again, &handle_again);
+	kms_test_assert(handle_again == handle);
+
+	wl_kms_buffer_batch_destroy(batch);
+	wl_buffer_destroy(held);
+	wl_buffer_destroy(again);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.buffers == 0);
+	kms_test_assert(stats.import.handles == 0);
+	kms_test_assert(stats.gem_close_failures == 0);
+
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+	kms_test_bo_destroy(&recycled);
+	kms_test_bo_destroy(&other);
+	close(dev);
+
+	return 0;
+}
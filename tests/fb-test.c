@@ -0,0 +1,138 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * KMS framebuffers of client buffers, on vkms: created once and removed
+ * with the buffer, and a buffer the device refuses is not tried again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <xf86drmMode.h>
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+/* beyond the max_width of vkms, and of most devices */
+#define HUGE_WIDTH 16384
+
+struct get_fb {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	uint32_t fb_id;
+	int queried;
+	uint32_t queried_fb_id;
+};
+
+static void do_get_fb(void *data)
+{
+	struct get_fb *gf = data;
+	struct wl_kms_buffer *buffer;
+
+	buffer = kms_test_client_get_buffer(gf->client, gf->buffer);
+	kms_test_assert(buffer);
+	gf->fb_id = wayland_kms_buffer_get_fb(buffer);
+	gf->queried = wayland_kms_buffer_query_fb(buffer, &gf->queried_fb_id);
+}
+
+static void get_fb(struct kms_test_client *c, struct get_fb *gf,
+		   struct wl_buffer *buffer)
+{
+	gf->client = c;
+	gf->buffer = buffer;
+	kms_test_server_call(c->server, do_get_fb, gf);
+}
+
+static int fb_exists(int fd, uint32_t fb_id)
+{
+	drmModeFBPtr fb = drmModeGetFB(fd, fb_id);
+
+	drmModeFreeFB(fb);
+	return fb != NULL;
+}
+
+static struct wl_buffer *create_buffer(struct kms_test_client *c,
+				       struct kms_test_bo *bo, int32_t width,
+				       int32_t height)
+{
+	return wl_kms_create_buffer(c->wl_kms, bo->fd, width, height, bo->stride,
+				    WL_KMS_FORMAT_XRGB8888, 0);
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct kms_test_bo bo, huge;
+	struct wl_buffer *buffer;
+	struct get_fb gf;
+	uint32_t fb_id;
+	int dev;
+
+	s = kms_test_server_create("vkms", 0, NULL);
+	kms_test_assert((dev = kms_test_open_device("vkms", NULL)) >= 0);
+	c = kms_test_client_create(s, 9);
+
+	/* created on first use, then the same one */
+	kms_test_assert(kms_test_bo_create(&bo, dev, 256, 256, 32) == 0);
+	buffer = create_buffer(c, &bo, 256, 256);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	get_fb(c, &gf, buffer);
+	kms_test_assert(gf.fb_id != 0);
+	kms_test_assert(gf.queried && gf.queried_fb_id == gf.fb_id);
+	kms_test_assert(fb_exists(s->fd, gf.fb_id));
+	fb_id = gf.fb_id;
+
+	get_fb(c, &gf, buffer);
+	kms_test_assert(gf.fb_id == fb_id);
+
+	/* and removed with the buffer */
+	wl_buffer_destroy(buffer);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_assert(!fb_exists(s->fd, fb_id));
+
+	/* the device refuses it with EINVAL; that is kept */
+	kms_test_assert(kms_test_bo_create(&huge, dev, HUGE_WIDTH, 1, 32) == 0);
+	buffer = create_buffer(c, &huge, HUGE_WIDTH, 1);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	get_fb(c, &gf, buffer);
+	kms_test_assert(gf.fb_id == 0);
+	kms_test_assert(gf.queried && gf.queried_fb_id == 0);
+
+	wl_buffer_destroy(buffer);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	kms_test_bo_destroy(&huge);
+	kms_test_bo_destroy(&bo);
+	close(dev);
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
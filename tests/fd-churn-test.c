@@ -0,0 +1,143 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * WL_KMS_FLAG_DROP_FDS on vgem: under buffer churn, the fds of the
+ * process and those the wl_kms counts as held stay constant, live
+ * buffers holding none once imported, and fds exported again for
+ * consumers are the only ones they get.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+#define NUM_BUFFERS 16
+#define ROUNDS 64
+
+static int count_fds(void)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int count = 0;
+
+	if (!(dir = opendir("/proc/self/fd")))
+		return -1;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] != '.')
+			count++;
+	}
+	closedir(dir);
+
+	/* that of the directory itself */
+	return count - 1;
+}
+
+struct export {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	int held, fd;
+};
+
+static void do_export(void *data)
+{
+	struct export *e = data;
+	struct wl_kms_buffer *buffer;
+
+	buffer = kms_test_client_get_buffer(e->client, e->buffer);
+	kms_test_assert(buffer);
+
+	e->held = buffer->planes[0].fd != WL_KMS_INVALID_FD;
+	e->fd = wayland_kms_buffer_get_plane_fd(buffer, 0);
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct kms_test_bo bos[NUM_BUFFERS];
+	struct wl_buffer *buffers[NUM_BUFFERS];
+	struct export e = { 0 };
+	struct wl_kms_stats stats;
+	int dev, fds, round, i;
+
+	s = kms_test_server_create("vgem", WL_KMS_FLAG_DROP_FDS, NULL);
+	kms_test_assert((dev = kms_test_open_device("vgem", NULL)) >= 0);
+	c = kms_test_client_create(s, 7);
+
+	for (i = 0; i < NUM_BUFFERS; i++)
+		kms_test_assert(kms_test_bo_create(&bos[i], dev, WIDTH, HEIGHT, 32) == 0);
+
+	fds = count_fds();
+	kms_test_assert(fds > 0);
+
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < NUM_BUFFERS; i++)
+			buffers[i] = wl_kms_create_buffer(c->wl_kms, bos[i].fd, WIDTH,
+							  HEIGHT, bos[i].stride,
+							  WL_KMS_FORMAT_XRGB8888, 0);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+		kms_test_assert(kms_test_client_get_error(c) == -1);
+
+		/* imported, so the buffers hold no fd */
+		kms_test_server_get_stats(s, &stats);
+		kms_test_assert(stats.buffers == NUM_BUFFERS);
+		kms_test_assert(stats.fds == 0);
+		kms_test_assert(count_fds() == fds);
+
+		/* a consumer asking for one gets it exported again */
+		e.client = c;
+		e.buffer = buffers[round % NUM_BUFFERS];
+		kms_test_server_call(s, do_export, &e);
+		kms_test_assert(!e.held && e.fd >= 0);
+		kms_test_assert(count_fds() == fds + 1);
+		close(e.fd);
+
+		for (i = 0; i < NUM_BUFFERS; i++)
+			wl_buffer_destroy(buffers[i]);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+		kms_test_server_get_stats(s, &stats);
+		kms_test_assert(stats.buffers == 0 && stats.fds == 0);
+		kms_test_assert(stats.fd_exports == (uint64_t)round + 1);
+		kms_test_assert(count_fds() == fds);
+	}
+
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+	for (i = 0; i < NUM_BUFFERS; i++)
+		kms_test_bo_destroy(&bos[i]);
+	close(dev);
+
+	return 0;
+}
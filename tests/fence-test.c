@@ -0,0 +1,274 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Explicit synchronization with sw_sync fences: the acquire fence of a
+ * buffer is waited for, and release fences get to the client.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+
+/* drivers/dma-buf/sw_sync.c; not part of the uapi headers */
+struct sw_sync_create_fence_data {
+	__u32 value;
+	char name[32];
+	__s32 fence;
+};
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, __u32)
+
+static int timeline_create(void)
+{
+	int fd = open("/sys/kernel/debug/sync/sw_sync", O_RDWR | O_CLOEXEC);
+
+	if (fd < 0)
+		fd = open("/sys/kernel/sync/sw_sync", O_RDWR | O_CLOEXEC);
+	return fd;
+}
+
+static int fence_create(int timeline, uint32_t value)
+{
+	struct sw_sync_create_fence_data data;
+
+	memset(&data, 0, sizeof data);
+	data.value = value;
+	strcpy(data.name, "fence-test");
+	kms_test_assert(ioctl(timeline, SW_SYNC_IOC_CREATE_FENCE, &data) == 0);
+
+	return data.fence;
+}
+
+static void timeline_inc(int timeline)
+{
+	__u32 one = 1;
+
+	kms_test_assert(ioctl(timeline, SW_SYNC_IOC_INC, &one) == 0);
+}
+
+static int fence_is_signaled(int fence)
+{
+	struct pollfd pfd = { .fd = fence, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) == 1;
+}
+
+/* Server side */
+
+struct wait {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	struct wl_kms_fence_wait *wait;
+	int fence;
+	int done;
+};
+
+static void wait_done(struct wl_kms_buffer *buffer, void *data)
+{
+	struct wait *w = data;
+
+	w->done++;
+}
+
+static void do_wait_acquire(void *data)
+{
+	struct wait *w = data;
+	struct wl_kms_buffer *buffer;
+
+	buffer = kms_test_client_get_buffer(w->client, w->buffer);
+	kms_test_assert(buffer);
+	w->wait = wayland_kms_buffer_wait_acquire(buffer, wait_done, w);
+	kms_test_assert(w->wait);
+}
+
+static void do_send_release(void *data)
+{
+	struct wait *w = data;
+	struct wl_kms_buffer *buffer;
+
+	buffer = kms_test_client_get_buffer(w->client, w->buffer);
+	kms_test_assert(buffer);
+	wayland_kms_buffer_send_release(buffer, w->fence);
+}
+
+static void do_nothing(void *data)
+{
+}
+
+/* Checks w->done on the server thread, after the time it takes for a fence */
+static int wait_get_done(struct wait *w, int settle_ms)
+{
+	uint64_t end = kms_test_now_ns() + settle_ms * 1000000ull;
+
+	do {
+		kms_test_server_call(w->client->server, do_nothing, NULL);
+		if (w->done)
+			break;
+		usleep(1000);
+	} while (kms_test_now_ns() < end);
+
+	return w->done;
+}
+
+/* Client side */
+
+struct release {
+	int fence;
+	int immediate;
+};
+
+static void release_handle_fenced(void *data, struct wl_kms_buffer_release *r,
+				  int32_t fence)
+{
+	struct release *release = data;
+
+	release->fence = fence;
+}
+
+static void release_handle_immediate(void *data, struct wl_kms_buffer_release *r)
+{
+	struct release *release = data;
+
+	release->immediate = 1;
+}
+
+static const struct wl_kms_buffer_release_listener release_listener = {
+	.fenced_release = release_handle_fenced,
+	.immediate_release = release_handle_immediate,
+};
+
+static struct wl_kms_buffer_release *get_release(struct kms_test_client *c,
+						 struct wl_buffer *buffer,
+						 struct release *release)
+{
+	struct wl_kms_buffer_release *r;
+
+	release->fence = -1;
+	release->immediate = 0;
+	r = wl_kms_get_release(c->wl_kms, buffer);
+	wl_kms_buffer_release_add_listener(r, &release_listener, release);
+
+	return r;
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct kms_test_bo bo;
+	struct wl_kms_buffer_release *r;
+	struct release release;
+	struct wait w;
+	int timeline, fence;
+
+	if ((timeline = timeline_create()) < 0)
+		kms_test_skip("no sw_sync: %s", strerror(errno));
+
+	s = kms_test_server_create(NULL, 0, NULL);
+	c = kms_test_client_create(s, 9);
+	kms_test_assert(kms_test_bo_create(&bo, -1, WIDTH, HEIGHT, 32) == 0);
+
+	/* the acquire fence is waited for */
+	memset(&w, 0, sizeof w);
+	w.client = c;
+	w.buffer = wl_kms_create_buffer(c->wl_kms, bo.fd, WIDTH, HEIGHT, bo.stride,
+					WL_KMS_FORMAT_XRGB8888, 0);
+	fence = fence_create(timeline, 1);
+	wl_kms_set_acquire_fence(c->wl_kms, w.buffer, fence);
+	close(fence);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	kms_test_server_call(s, do_wait_acquire, &w);
+	kms_test_assert(wait_get_done(&w, 100) == 0);
+
+	timeline_inc(timeline);
+	kms_test_assert(wait_get_done(&w, KMS_TEST_TIMEOUT_MS) == 1);
+
+	/* with no fence, on the next idle */
+	w.done = 0;
+	kms_test_server_call(s, do_wait_acquire, &w);
+	kms_test_assert(wait_get_done(&w, KMS_TEST_TIMEOUT_MS) == 1);
+
+	/* a release fence is passed on, not consumed */
+	r = get_release(c, w.buffer, &release);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	w.fence = fence_create(timeline, 2);
+	kms_test_server_call(s, do_send_release, &w);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_assert(release.fence >= 0 && !release.immediate);
+	kms_test_assert(fcntl(w.fence, F_GETFD) >= 0);
+
+	kms_test_assert(!fence_is_signaled(release.fence));
+	timeline_inc(timeline);
+	kms_test_assert(fence_is_signaled(release.fence));
+	close(release.fence);
+	close(w.fence);
+	wl_kms_buffer_release_destroy(r);
+
+	/* and without one, the release is immediate */
+	r = get_release(c, w.buffer, &release);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	w.fence = -1;
+	kms_test_server_call(s, do_send_release, &w);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_assert(release.immediate && release.fence < 0);
+	wl_kms_buffer_release_destroy(r);
+
+	/* a wait is cancelled along with its buffer */
+	w.done = 0;
+	fence = fence_create(timeline, 3);
+	wl_kms_set_acquire_fence(c->wl_kms, w.buffer, fence);
+	close(fence);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_server_call(s, do_wait_acquire, &w);
+
+	wl_buffer_destroy(w.buffer);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	timeline_inc(timeline);
+	kms_test_assert(wait_get_done(&w, 100) == 0);
+
+	kms_test_bo_destroy(&bo);
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+	close(timeline);
+
+	return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * Buffer forwarding between two wl_kms instances: a nested server
+ * forwards a client buffer to the wl_kms of its parent, where it shows
+ * up as a buffer of its own, once however many times it is forwarded.
+ * Releases by the parent reach the client, and destroying the buffer
+ * destroys the forward.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+
+struct forward {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	uint32_t id;			/* of the wl_buffer upstream */
+};
+
+static void do_forward(void *data)
+{
+	struct forward *f = data;
+	struct wl_kms_buffer *buffer;
+	struct wl_buffer *forward;
+
+	buffer = kms_test_client_get_buffer(f->client, f->buffer);
+	kms_test_assert(buffer);
+
+	forward = wayland_kms_buffer_forward(buffer);
+	kms_test_assert(forward);
+	f->id = wl_proxy_get_id((struct wl_proxy *)forward);
+}
+
+struct release {
+	struct wl_client *client;	/* the nested server, upstream */
+	uint32_t id;
+	int buffers;
+};
+
+static void do_release(void *data)
+{
+	struct release *r = data;
+	struct wl_resource *resource;
+
+	resource = wl_client_get_object(r->client, r->id);
+	kms_test_assert(resource && wayland_kms_buffer_get(resource));
+	wl_buffer_send_release(resource);
+}
+
+static void handle_release(void *data, struct wl_buffer *buffer)
+{
+	int *released = data;
+
+	(*released)++;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = handle_release,
+};
+
+/* Waits until the parent has as many buffers, as the forwards are async */
+static void wait_buffers(struct kms_test_server *s, uint32_t buffers)
+{
+	uint64_t end = kms_test_now_ns() + KMS_TEST_TIMEOUT_MS * 1000000ull;
+	struct wl_kms_stats stats;
+
+	for (;;) {
+		kms_test_server_get_stats(s, &stats);
+		if (stats.buffers == buffers)
+			return;
+		kms_test_assert(kms_test_now_ns() < end);
+		usleep(1000);
+	}
+}
+
+int main(void)
+{
+	struct kms_test_server *parent, *s;
+	struct wl_display *upstream;
+	struct wl_client *nested;
+	struct kms_test_client *c;
+	struct kms_test_bo bo;
+	struct forward f = { 0 };
+	struct release r = { 0 };
+	struct wl_kms_stats stats;
+	uint32_t id;
+	int released = 0;
+
+	parent = kms_test_server_create(NULL, 0, NULL);
+	upstream = kms_test_server_connect(parent, &nested);
+	s = kms_test_server_create(NULL, 0, upstream);
+	c = kms_test_client_create(s, 7);
+
+	kms_test_assert(kms_test_bo_create(&bo, -1, WIDTH, HEIGHT, 32) == 0);
+	f.client = c;
+	f.buffer = wl_kms_create_buffer(c->wl_kms, bo.fd, WIDTH, HEIGHT, bo.stride,
+					WL_KMS_FORMAT_XRGB8888, 0);
+	wl_buffer_add_listener(f.buffer, &buffer_listener, &released);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	/* a single buffer upstream, however many times it is forwarded */
+	kms_test_server_call(s, do_forward, &f);
+	id = f.id;
+	kms_test_server_call(s, do_forward, &f);
+	kms_test_assert(f.id == id);
+	wait_buffers(parent, 1);
+
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.forwards == 1);
+
+	/* the parent releases it, and so the client gets it back */
+	r.client = nested;
+	r.id = id;
+	kms_test_server_call(parent, do_release, &r);
+	kms_test_assert(kms_test_client_wait(c, &released, KMS_TEST_TIMEOUT_MS) == 0);
+	kms_test_assert(released == 1);
+
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.forward_releases == 1);
+
+	/* forwarded again, with the same wl_buffer upstream */
+	released = 0;
+	kms_test_server_call(s, do_forward, &f);
+	kms_test_assert(f.id == id);
+	kms_test_server_call(parent, do_release, &r);
+	kms_test_assert(kms_test_client_wait(c, &released, KMS_TEST_TIMEOUT_MS) == 0);
+	kms_test_server_get_stats(parent, &stats);
+	kms_test_assert(stats.buffers == 1);
+
+	/* the forward goes away with the buffer */
+	wl_buffer_destroy(f.buffer);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	wait_buffers(parent, 0);
+
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+	wl_display_disconnect(upstream);
+	kms_test_assert(kms_test_server_wait_client(parent, &nested) == 0);
+	kms_test_server_destroy(parent);
+	kms_test_bo_destroy(&bo);
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * GEM handle cache: buffers sharing a dma-buf share its handle, which
+ * is closed with the last of them, and files that aren't dma-bufs are
+ * never matched with it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+
+struct get_handle {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	uint32_t handle;
+};
+
+static void do_get_handle(void *data)
+{
+	struct get_handle *gh = data;
+	struct wl_kms_buffer *buffer;
+
+	buffer = kms_test_client_get_buffer(gh->client, gh->buffer);
+	kms_test_assert(buffer);
+	gh->handle = buffer->planes[0].handle;
+}
+
+static uint32_t get_handle(struct kms_test_client *c, struct wl_buffer *buffer)
+{
+	struct get_handle gh = { .client = c, .buffer = buffer };
+
+	kms_test_server_call(c->server, do_get_handle, &gh);
+	return gh.handle;
+}
+
+static struct wl_buffer *create_buffer(struct kms_test_client *c, int fd,
+				       uint32_t stride)
+{
+	return wl_kms_create_buffer(c->wl_kms, fd, WIDTH, HEIGHT, stride,
+				    WL_KMS_FORMAT_XRGB8888, 0);
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct kms_test_bo bo, other;
+	struct wl_buffer *a, *b, *d;
+	struct wl_kms_stats stats;
+	uint32_t handle;
+	int dev, memfd;
+
+	s = kms_test_server_create("vgem", 0, NULL);
+	kms_test_assert((dev = kms_test_open_device("vgem", NULL)) >= 0);
+	kms_test_assert(kms_test_bo_create(&bo, dev, WIDTH, HEIGHT, 32) == 0);
+	kms_test_assert(kms_test_bo_create(&other, dev, WIDTH, HEIGHT, 32) == 0);
+
+	c = kms_test_client_create(s, 9);
+
+	/* two buffers on one dma-buf, imported once */
+	a = create_buffer(c, bo.fd, bo.stride);
+	b = create_buffer(c, bo.fd, bo.stride);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.import.misses == 1);
+	kms_test_assert(stats.import.hits == 1);
+	kms_test_assert(stats.import.handles == 1);
+
+	handle = get_handle(c, a);
+	kms_test_assert(handle != 0);
+	kms_test_assert(get_handle(c, b) == handle);
+
+	/* another dma-buf gets a handle of its own */
+	d = create_buffer(c, other.fd, other.stride);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_assert(get_handle(c, d) != handle);
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.import.misses == 2);
+	kms_test_assert(stats.import.handles == 2);
+	wl_buffer_destroy(d);
+
+	/* the handle lives as long as the last buffer using it */
+	wl_buffer_destroy(a);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.import.handles == 1);
+	kms_test_assert(get_handle(c, b) == handle);
+
+	wl_buffer_destroy(b);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.import.handles == 0);
+	kms_test_assert(stats.gem_closes == 2);
+	kms_test_assert(stats.gem_close_failures == 0);
+
+	kms_test_client_destroy(c);
+
+	/* a file that isn't a dma-buf is refused, whatever its inode */
+	c = kms_test_client_create(s, 9);
+	kms_test_assert((memfd = memfd_create("gem-cache-test", MFD_CLOEXEC)) >= 0);
+	kms_test_assert(ftruncate(memfd, bo.size) == 0);
+	create_buffer(c, memfd, bo.stride);
+	close(memfd);
+	kms_test_assert(kms_test_client_roundtrip(c) < 0);
+	kms_test_assert(kms_test_client_get_error(c) == WL_KMS_ERROR_INVALID_FD);
+	kms_test_client_destroy(c);
+
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.import.hits == 1);
+	kms_test_assert(stats.import.handles == 0);
+
+	kms_test_bo_destroy(&other);
+	kms_test_bo_destroy(&bo);
+	close(dev);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
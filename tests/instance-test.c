@@ -0,0 +1,166 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * wl_kms instances: wayland_kms_init() gives the one of the display,
+ * wayland_kms_init_device() one per device, each with its own global.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <wayland-client.h>
+#include "kms-test.h"
+
+static void registry_handle_global(void *data, struct wl_registry *registry,
+				   uint32_t name, const char *interface,
+				   uint32_t version)
+{
+	int *globals = data;
+
+	if (!strcmp(interface, "wl_kms"))
+		(*globals)++;
+}
+
+static void registry_handle_global_remove(void *data, struct wl_registry *registry,
+					  uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_handle_global,
+	.global_remove = registry_handle_global_remove,
+};
+
+/* The wl_kms globals a new client sees */
+static int count_globals(struct kms_test_server *s)
+{
+	struct wl_display *display;
+	struct wl_registry *registry;
+	int globals = 0;
+
+	display = kms_test_server_connect(s, NULL);
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &registry_listener, &globals);
+	kms_test_assert(wl_display_roundtrip(display) >= 0);
+	wl_registry_destroy(registry);
+	wl_display_disconnect(display);
+
+	return globals;
+}
+
+struct init {
+	struct wl_display *display;
+	int fd;
+	struct wl_kms *kms;
+};
+
+static void do_init(void *data)
+{
+	struct init *init = data;
+
+	init->kms = wayland_kms_init(init->display, NULL, "/dev/null", init->fd);
+}
+
+static void do_uninit(void *data)
+{
+	wayland_kms_uninit(data);
+}
+
+int main(void)
+{
+	struct kms_test_server *s, *other;
+	struct wl_kms *kms, *zero, *again;
+	struct init init;
+	int null_fd, zero_fd, null_fd2, pipe_fds[2];
+
+	kms_test_assert((null_fd = open("/dev/null", O_RDWR | O_CLOEXEC)) >= 0);
+	kms_test_assert((null_fd2 = open("/dev/null", O_RDWR | O_CLOEXEC)) >= 0);
+	kms_test_assert((zero_fd = open("/dev/zero", O_RDWR | O_CLOEXEC)) >= 0);
+	kms_test_assert(pipe2(pipe_fds, O_CLOEXEC) == 0);
+
+	s = kms_test_display_create();
+	other = kms_test_display_create();
+
+	/* the display has a single wl_kms, whatever the device asked for */
+	kms = wayland_kms_init(s->display, NULL, "/dev/null", null_fd);
+	kms_test_assert(kms);
+	kms_test_assert(wayland_kms_init(s->display, NULL, "/dev/zero", zero_fd) == kms);
+
+	/* unless another device is asked for explicitly */
+	zero = wayland_kms_init_device(s->display, NULL, "/dev/zero", zero_fd);
+	kms_test_assert(zero && zero != kms);
+	kms_test_assert(wayland_kms_fd_get(zero) == zero_fd);
+
+	/* the same device is found again, by its node or by its name */
+	kms_test_assert(wayland_kms_init_device(s->display, NULL, "null",
+						null_fd2) == kms);
+	kms_test_assert(wayland_kms_init_device(s->display, NULL, "/dev/zero",
+						pipe_fds[0]) == zero);
+
+	/* displays don't share them */
+	again = wayland_kms_init(other->display, NULL, "/dev/null", null_fd);
+	kms_test_assert(again && again != kms && again != zero);
+
+	kms_test_server_start(s);
+	kms_test_assert(count_globals(s) == 2);
+
+	/* kms was given out three times, and zero twice */
+	kms_test_server_call(s, do_uninit, zero);
+	kms_test_assert(count_globals(s) == 2);
+	kms_test_server_call(s, do_uninit, zero);
+	kms_test_assert(count_globals(s) == 1);
+
+	kms_test_server_call(s, do_uninit, kms);
+	kms_test_server_call(s, do_uninit, kms);
+	kms_test_assert(count_globals(s) == 1);
+	kms_test_server_call(s, do_uninit, kms);
+	kms_test_assert(count_globals(s) == 0);
+
+	/* a display without one gets a new one */
+	init.display = s->display;
+	init.fd = null_fd;
+	kms_test_server_call(s, do_init, &init);
+	kms_test_assert(init.kms);
+	kms_test_assert(count_globals(s) == 1);
+	kms_test_server_call(s, do_uninit, init.kms);
+
+	wayland_kms_uninit(again);
+	kms_test_server_destroy(other);
+	kms_test_server_destroy(s);
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	close(zero_fd);
+	close(null_fd2);
+	close(null_fd);
+
+	return 0;
+}
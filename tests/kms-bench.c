@@ -0,0 +1,362 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * The hot paths of the server, each reported as a line of JSON: binds,
+ * creates for each format, imports, destroys, buffer lookups, and the
+ * nested authentication round trips. Runs on vgem if there is one, and
+ * on no device otherwise, where nothing is imported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "wayland-kms-format.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+#define BUFFERS 32
+
+/* clients of version 5 get formats as events, so binds take no fds */
+#define BIND_VERSION 5
+
+static void fourcc(uint32_t format, char name[5])
+{
+	memcpy(name, &format, 4);
+	name[4] = '\0';
+}
+
+/*
+ * Binds
+ */
+
+static void registry_handle_global(void *data, struct wl_registry *registry,
+				   uint32_t name, const char *interface,
+				   uint32_t version)
+{
+	uint32_t *kms_name = data;
+
+	if (!strcmp(interface, "wl_kms"))
+		*kms_name = name;
+}
+
+static void registry_handle_global_remove(void *data, struct wl_registry *registry,
+					  uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_handle_global,
+	.global_remove = registry_handle_global_remove,
+};
+
+static void bench_bind(struct kms_test_client *c, int rounds)
+{
+	struct wl_kms *proxies[BUFFERS];
+	struct wl_registry *registry;
+	uint32_t name = 0;
+	uint64_t start, ns = 0;
+	int r, i;
+
+	registry = wl_display_get_registry(c->display);
+	wl_registry_add_listener(registry, &registry_listener, &name);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_assert(name != 0);
+
+	for (r = 0; r < rounds; r++) {
+		start = kms_test_now_ns();
+		for (i = 0; i < BUFFERS; i++)
+			proxies[i] = wl_registry_bind(registry, name, &wl_kms_interface,
+						      BIND_VERSION);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+		ns += kms_test_now_ns() - start;
+
+		/* wl_kms has no destructor; the resources stay with the client */
+		for (i = 0; i < BUFFERS; i++)
+			wl_kms_destroy(proxies[i]);
+	}
+
+	wl_registry_destroy(registry);
+	kms_bench_report("bind", (uint64_t)rounds * BUFFERS, ns, NULL);
+}
+
+/*
+ * Creates and destroys
+ */
+
+static void create(struct kms_test_client *c, struct kms_test_bo *bos,
+		   const struct kms_format_info *info, int mp,
+		   struct wl_buffer **buffers)
+{
+	struct kms_test_bo *bo;
+	int i;
+
+	for (i = 0; i < BUFFERS; i++) {
+		bo = &bos[i];
+		if (!mp)
+			buffers[i] = wl_kms_create_buffer(c->wl_kms, bo->fd, WIDTH,
+							  HEIGHT, bo->stride,
+							  info->format, 0);
+		else
+			buffers[i] = wl_kms_create_mp_buffer(c->wl_kms, WIDTH, HEIGHT,
+							     info->format,
+							     bo->fd, bo->stride,
+							     bo->fd, bo->stride,
+							     bo->fd, bo->stride);
+	}
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+}
+
+static void destroy(struct kms_test_client *c, struct wl_buffer **buffers)
+{
+	int i;
+
+	for (i = 0; i < BUFFERS; i++)
+		wl_buffer_destroy(buffers[i]);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+}
+
+static void bench_create(struct kms_test_client *c, struct kms_test_bo *bos,
+			 int rounds)
+{
+	const struct kms_format_info *formats, *info;
+	struct wl_buffer *buffers[BUFFERS];
+	struct wl_kms_stats before, after, start;
+	uint64_t creates = 0, create_ns = 0;
+	char name[5], label[64];
+	int count, f, mp, r;
+
+	formats = kms_format_list(&count);
+	kms_test_server_get_stats(c->server, &start);
+
+	for (f = 0; f < count; f++) {
+		info = &formats[f];
+		fourcc(info->format, name);
+
+		/* create_mp_buffer takes up to 3 planes, create_buffer one */
+		for (mp = 0; mp < 2; mp++) {
+			if ((!mp && info->num_planes > 1) || info->num_planes > 3)
+				continue;
+
+			kms_test_server_get_stats(c->server, &before);
+			for (r = 0; r < rounds; r++) {
+				create(c, bos, info, mp, buffers);
+				destroy(c, buffers);
+			}
+			kms_test_server_get_stats(c->server, &after);
+			kms_test_assert(after.creates - before.creates ==
+					(uint64_t)rounds * BUFFERS);
+
+			snprintf(label, sizeof label, "%s/%s",
+				 mp ? "create_mp_buffer" : "create_buffer", name);
+			kms_bench_report(label, after.creates - before.creates,
+					 after.create_ns - before.create_ns, NULL);
+			creates += after.creates - before.creates;
+			create_ns += after.create_ns - before.create_ns;
+		}
+	}
+
+	kms_test_server_get_stats(c->server, &after);
+	kms_bench_report("create", creates, create_ns, NULL);
+	kms_bench_report("destroy", after.destroys - start.destroys,
+			 after.destroy_ns - start.destroy_ns, &after);
+}
+
+/*
+ * Imports and lookups, timed on the server thread
+ */
+
+struct server_bench {
+	struct kms_test_client *client;
+	struct wl_buffer **buffers;
+	int rounds;
+	uint64_t ns, lookup_ns, query_ns;
+};
+
+static struct wl_resource *get_resource(struct kms_test_client *c,
+					struct wl_buffer *buffer)
+{
+	struct wl_kms_buffer *kms_buffer = kms_test_client_get_buffer(c, buffer);
+
+	kms_test_assert(kms_buffer);
+	return kms_buffer->resource;
+}
+
+static void do_import(void *data)
+{
+	struct server_bench *sb = data;
+	struct wl_resource *resources[BUFFERS];
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < BUFFERS; i++)
+		resources[i] = get_resource(sb->client, sb->buffers[i]);
+
+	start = kms_test_now_ns();
+	for (i = 0; i < BUFFERS; i++)
+		kms_test_assert(wayland_kms_buffer_get_imported(resources[i]));
+	sb->ns += kms_test_now_ns() - start;
+}
+
+static void bench_import(struct kms_test_client *c, struct kms_test_bo *bos,
+			 int rounds)
+{
+	struct wl_buffer *buffers[BUFFERS];
+	struct server_bench sb = { .client = c, .buffers = buffers };
+	struct wl_kms_stats stats;
+	int r;
+
+	/* the handles are closed with the buffers, so each import misses */
+	for (r = 0; r < rounds; r++) {
+		create(c, bos, kms_format_get_info(WL_KMS_FORMAT_XRGB8888), 0, buffers);
+		kms_test_server_call(c->server, do_import, &sb);
+		destroy(c, buffers);
+	}
+
+	kms_test_server_get_stats(c->server, &stats);
+	kms_bench_report("import", (uint64_t)rounds * BUFFERS, sb.ns, &stats);
+}
+
+static void do_lookup(void *data)
+{
+	struct server_bench *sb = data;
+	struct wl_kms *kms = sb->client->server->kms;
+	struct wl_resource *resources[BUFFERS];
+	uint64_t start;
+	int i, r, value;
+
+	for (i = 0; i < BUFFERS; i++)
+		resources[i] = get_resource(sb->client, sb->buffers[i]);
+
+	start = kms_test_now_ns();
+	for (r = 0; r < sb->rounds; r++) {
+		for (i = 0; i < BUFFERS; i++)
+			kms_test_assert(wayland_kms_buffer_get(resources[i]));
+	}
+	sb->lookup_ns = kms_test_now_ns() - start;
+
+	start = kms_test_now_ns();
+	for (r = 0; r < sb->rounds; r++) {
+		for (i = 0; i < BUFFERS; i++)
+			kms_test_assert(wayland_kms_query_buffer(kms, resources[i],
+								 WL_KMS_WIDTH,
+								 &value) == 0);
+	}
+	sb->query_ns = kms_test_now_ns() - start;
+}
+
+static void bench_lookup(struct kms_test_client *c, struct kms_test_bo *bos,
+			 int rounds)
+{
+	struct wl_buffer *buffers[BUFFERS];
+	struct server_bench sb = { .client = c, .buffers = buffers,
+				   .rounds = rounds * 100 };
+
+	create(c, bos, kms_format_get_info(WL_KMS_FORMAT_XRGB8888), 0, buffers);
+	kms_test_server_call(c->server, do_lookup, &sb);
+	destroy(c, buffers);
+
+	kms_bench_report("wayland_kms_buffer_get", (uint64_t)sb.rounds * BUFFERS,
+			 sb.lookup_ns, NULL);
+	kms_bench_report("wayland_kms_query_buffer", (uint64_t)sb.rounds * BUFFERS,
+			 sb.query_ns, NULL);
+}
+
+/*
+ * Nested authentication, against an upstream server of our own
+ */
+
+static void bench_auth(int rounds)
+{
+	struct kms_test_upstream *upstream;
+	struct wl_display *upstream_display;
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct wl_kms_stats stats;
+	uint64_t start;
+	int r;
+
+	upstream = kms_test_upstream_create();
+	upstream_display = kms_test_upstream_connect(upstream);
+	s = kms_test_server_create(NULL, 0, upstream_display);
+	c = kms_test_client_create(s, 9);
+
+	start = kms_test_now_ns();
+	for (r = 0; r < rounds; r++) {
+		wl_kms_authenticate(c->wl_kms, r);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+		kms_test_assert(kms_test_client_wait(c, &c->authenticated,
+						     KMS_TEST_TIMEOUT_MS) == 0);
+		c->authenticated = 0;
+	}
+
+	kms_test_server_get_stats(s, &stats);
+	kms_bench_report("auth", rounds, kms_test_now_ns() - start, &stats);
+
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+	wl_display_disconnect(upstream_display);
+	kms_test_upstream_destroy(upstream);
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = kms_bench_iterations(argc, argv, 100);
+	struct kms_test_bo bos[BUFFERS];
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	int dev, i;
+
+	/* imports are timed on their own */
+	dev = kms_test_open_device("vgem", NULL);
+	s = kms_test_server_create(dev >= 0 ? "vgem" : NULL,
+				   WL_KMS_FLAG_LAZY_IMPORT, NULL);
+	c = kms_test_client_create(s, 9);
+
+	for (i = 0; i < BUFFERS; i++)
+		kms_test_assert(kms_test_bo_create(&bos[i], dev, WIDTH, HEIGHT, 32) == 0);
+
+	bench_bind(c, rounds);
+	bench_create(c, bos, rounds);
+	if (dev >= 0)
+		bench_import(c, bos, rounds);
+	bench_lookup(c, bos, rounds);
+	bench_auth(rounds);
+
+	for (i = 0; i < BUFFERS; i++)
+		kms_test_bo_destroy(&bos[i]);
+	if (dev >= 0)
+		close(dev);
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
@@ -0,0 +1,462 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * wayland-kms-soak: a load generator for the server side of wl_kms.
+ *
+ * Clients, each on a thread of its own, bind wl_kms, authenticate
+ * through an upstream server, and keep replacing the buffers of a
+ * swapchain mixing single and multi-plane formats. Meanwhile, the fds
+ * of the process, the GEM handles and buffers of the wl_kms and the RSS
+ * are sampled, and the time each dispatch of the server takes is
+ * recorded. Once all the clients are gone, whatever they left behind
+ * is a leak, and makes us exit with 1.
+ *
+ * Usage: wayland-kms-soak [-c clients] [-b buffers] [-r rate] [-d seconds]
+ *                         [-i interval_ms] [-D driver|none]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 128
+#define HEIGHT 128
+#define MAX_BUFFERS 16
+
+/*
+ * Dispatch times: 16 buckets per power of 2, that is within 6%, from
+ * 1ns to the largest uint64_t
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total, max;
+};
+
+static int hist_bucket(uint64_t ns)
+{
+	int msb;
+
+	if (ns < HIST_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	       ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The lowest value of the bucket */
+static uint64_t hist_value(int bucket)
+{
+	int group = bucket >> HIST_SUB_BITS, sub = bucket & (HIST_SUB - 1);
+
+	if (group == 0)
+		return sub;
+
+	return (uint64_t)(HIST_SUB | sub) << (group - 1);
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double p)
+{
+	uint64_t rank = h->total * p, count = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		count += h->counts[i];
+		if (count > rank)
+			return hist_value(i);
+	}
+
+	return h->max;
+}
+
+static void dispatched(void *data, uint64_t ns)
+{
+	struct histogram *h = data;
+
+	h->counts[hist_bucket(ns)]++;
+	h->total++;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+static void do_set_dispatched(void *data)
+{
+	struct kms_test_server *s = data;
+
+	s->dispatched_data = calloc(1, sizeof(struct histogram));
+	kms_test_assert(s->dispatched_data);
+	s->dispatched = dispatched;
+}
+
+struct get_histogram {
+	struct kms_test_server *server;
+	struct histogram *histogram;
+};
+
+/* The thread stops recording, and we take its histogram */
+static void do_get_histogram(void *data)
+{
+	struct get_histogram *gh = data;
+
+	gh->histogram = gh->server->dispatched_data;
+	gh->server->dispatched = NULL;
+	gh->server->dispatched_data = NULL;
+}
+
+/*
+ * Clients
+ */
+
+struct options {
+	int clients;
+	int buffers;
+	int rate;			/* buffers replaced per second */
+	int seconds;
+	int interval_ms;
+	const char *driver;		/* NULL for no device */
+};
+
+struct soak {
+	struct options opts;
+	struct kms_test_server *server;
+	int dev;			/* of the driver, for the buffers */
+	uint64_t end;
+	int errors;			/* clients that failed */
+	uint64_t buffers;		/* created by all clients */
+};
+
+struct client {
+	struct soak *soak;
+	int index;
+	pthread_t thread;
+	struct kms_test_client *c;
+	struct kms_test_bo bo;
+	struct wl_buffer *buffers[MAX_BUFFERS];
+	uint64_t created;
+};
+
+/* Every other buffer is NV12, its chroma plane after the luma one */
+static struct wl_buffer *client_create_buffer(struct client *cl, uint64_t n)
+{
+	struct kms_test_bo *bo = &cl->bo;
+
+	if (n % 2 == 0)
+		return wl_kms_create_buffer(cl->c->wl_kms, bo->fd, WIDTH, HEIGHT,
+					    bo->stride, WL_KMS_FORMAT_XRGB8888, 0);
+
+	return wl_kms_create_planar_buffer(cl->c->wl_kms, WIDTH, HEIGHT,
+					   WL_KMS_FORMAT_NV12,
+					   bo->fd, 0, bo->stride,
+					   bo->fd, bo->stride * HEIGHT, bo->stride,
+					   bo->fd, 0, 0, bo->fd, 0, 0);
+}
+
+static int client_run(struct client *cl)
+{
+	struct soak *soak = cl->soak;
+	int n = soak->opts.buffers, i;
+	uint64_t period = 1000000000ull / soak->opts.rate, next;
+
+	if (kms_test_bo_create(&cl->bo, soak->dev, WIDTH, HEIGHT * 2, 32) < 0)
+		return -1;
+
+	wl_kms_authenticate(cl->c->wl_kms, cl->index);
+	if (kms_test_client_wait(cl->c, &cl->c->authenticated,
+				 KMS_TEST_TIMEOUT_MS) < 0)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		cl->buffers[i] = client_create_buffer(cl, cl->created++);
+	if (kms_test_client_roundtrip(cl->c) < 0)
+		return -1;
+
+	/* replace the oldest buffer, a frame at a time */
+	next = kms_test_now_ns();
+	while (kms_test_now_ns() < soak->end) {
+		i = cl->created % n;
+		wl_buffer_destroy(cl->buffers[i]);
+		cl->buffers[i] = client_create_buffer(cl, cl->created++);
+		if (kms_test_client_roundtrip(cl->c) < 0)
+			return -1;
+
+		next += period;
+		if (next > kms_test_now_ns())
+			usleep((next - kms_test_now_ns()) / 1000);
+	}
+
+	for (i = 0; i < n; i++)
+		wl_buffer_destroy(cl->buffers[i]);
+	return kms_test_client_roundtrip(cl->c) < 0 ? -1 : 0;
+}
+
+static void *client_thread(void *data)
+{
+	struct client *cl = data;
+	struct soak *soak = cl->soak;
+
+	if (client_run(cl) < 0) {
+		fprintf(stderr, "client %d failed, error %d\n", cl->index,
+			kms_test_client_get_error(cl->c));
+		__atomic_fetch_add(&soak->errors, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&soak->buffers, cl->created, __ATOMIC_RELAXED);
+
+	kms_test_client_destroy(cl->c);
+	kms_test_bo_destroy(&cl->bo);
+	return NULL;
+}
+
+/*
+ * Samples
+ */
+
+struct sample {
+	int fds;
+	long rss_kb;
+	struct wl_kms_stats stats;
+};
+
+static int count_fds(void)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int count = 0;
+
+	if (!(dir = opendir("/proc/self/fd")))
+		return -1;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] != '.')
+			count++;
+	}
+	closedir(dir);
+
+	/* that of the directory itself */
+	return count - 1;
+}
+
+static long rss_kb(void)
+{
+	long size, resident = 0;
+	FILE *f;
+
+	if (!(f = fopen("/proc/self/statm", "r")))
+		return -1;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose(f);
+
+	return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void take_sample(struct soak *soak, struct sample *sample)
+{
+	kms_test_server_get_stats(soak->server, &sample->stats);
+	sample->fds = count_fds();
+	sample->rss_kb = rss_kb();
+}
+
+static void print_sample(const char *name, uint64_t t_ms,
+			 const struct sample *sample)
+{
+	printf("{\"name\":\"%s\",\"t_ms\":%" PRIu64 ",\"fds\":%d,\"gem_handles\":%u,"
+	       "\"buffers\":%u,\"buffer_fds\":%u,\"rss_kb\":%ld}\n",
+	       name, t_ms, sample->fds, sample->stats.import.handles,
+	       sample->stats.buffers, sample->stats.fds, sample->rss_kb);
+	fflush(stdout);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-c clients] [-b buffers] [-r rate] [-d seconds]\n"
+		"          [-i interval_ms] [-D driver|none]\n", name);
+	exit(2);
+}
+
+static void parse_options(int argc, char **argv, struct options *opts)
+{
+	int opt;
+
+	opts->clients = 100;
+	opts->buffers = 4;
+	opts->rate = 60;
+	opts->seconds = 10;
+	opts->interval_ms = 1000;
+	opts->driver = "vgem";
+
+	while ((opt = getopt(argc, argv, "c:b:r:d:i:D:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			opts->clients = atoi(optarg);
+			break;
+		case 'b':
+			opts->buffers = atoi(optarg);
+			break;
+		case 'r':
+			opts->rate = atoi(optarg);
+			break;
+		case 'd':
+			opts->seconds = atoi(optarg);
+			break;
+		case 'i':
+			opts->interval_ms = atoi(optarg);
+			break;
+		case 'D':
+			opts->driver = strcmp(optarg, "none") ? optarg : NULL;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (opts->clients <= 0 || opts->buffers <= 0 ||
+	    opts->buffers > MAX_BUFFERS || opts->rate <= 0 ||
+	    opts->seconds <= 0 || opts->interval_ms <= 0)
+		usage(argv[0]);
+}
+
+/* Room for the fds of all the clients, on both sides */
+static void raise_fd_limit(void)
+{
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct soak soak = { 0 };
+	struct kms_test_upstream *upstream;
+	struct wl_display *upstream_display;
+	struct client *clients;
+	struct sample start, sample;
+	struct get_histogram gh;
+	struct histogram *h;
+	uint64_t t0, now, next;
+	char *json;
+	int i, leaks;
+
+	parse_options(argc, argv, &soak.opts);
+	raise_fd_limit();
+
+	/* vgem by default, or no device if there is none */
+	soak.dev = -1;
+	if (soak.opts.driver &&
+	    (soak.dev = kms_test_open_device(soak.opts.driver, NULL)) < 0) {
+		if (strcmp(soak.opts.driver, "vgem"))
+			kms_test_skip("no %s device", soak.opts.driver);
+		soak.opts.driver = NULL;
+	}
+
+	upstream = kms_test_upstream_create();
+	upstream_display = kms_test_upstream_connect(upstream);
+	soak.server = kms_test_server_create(soak.opts.driver, 0, upstream_display);
+	kms_test_server_call(soak.server, do_set_dispatched, soak.server);
+
+	kms_test_assert((clients = calloc(soak.opts.clients, sizeof *clients)));
+	take_sample(&soak, &start);
+	print_sample("start", 0, &start);
+
+	t0 = kms_test_now_ns();
+	soak.end = t0 + soak.opts.seconds * 1000000000ull;
+	for (i = 0; i < soak.opts.clients; i++) {
+		clients[i].soak = &soak;
+		clients[i].index = i;
+		clients[i].c = kms_test_client_create(soak.server, 9);
+		kms_test_assert(!pthread_create(&clients[i].thread, NULL,
+						client_thread, &clients[i]));
+	}
+
+	next = t0;
+	while ((now = kms_test_now_ns()) < soak.end) {
+		next += soak.opts.interval_ms * 1000000ull;
+		if (next > soak.end)
+			next = soak.end;
+		if (next > now)
+			usleep((next - now) / 1000);
+		take_sample(&soak, &sample);
+		print_sample("sample", (kms_test_now_ns() - t0) / 1000000, &sample);
+	}
+
+	for (i = 0; i < soak.opts.clients; i++)
+		pthread_join(clients[i].thread, NULL);
+
+	gh.server = soak.server;
+	kms_test_server_call(soak.server, do_get_histogram, &gh);
+	h = gh.histogram;
+	take_sample(&soak, &sample);
+	print_sample("end", (kms_test_now_ns() - t0) / 1000000, &sample);
+
+	json = wayland_kms_stats_to_json(&sample.stats);
+	printf("{\"name\":\"soak\",\"clients\":%d,\"seconds\":%d,"
+	       "\"buffers_created\":%" PRIu64 ",\"client_errors\":%d,"
+	       "\"dispatches\":%" PRIu64 ",\"dispatch_p50_ns\":%" PRIu64
+	       ",\"dispatch_p99_ns\":%" PRIu64 ",\"dispatch_p999_ns\":%" PRIu64
+	       ",\"dispatch_max_ns\":%" PRIu64 ",\"fd_growth\":%d,"
+	       "\"rss_growth_kb\":%ld,\"stats\":%s}\n",
+	       soak.opts.clients, soak.opts.seconds, soak.buffers, soak.errors,
+	       h->total, hist_percentile(h, 0.5), hist_percentile(h, 0.99),
+	       hist_percentile(h, 0.999), h->max, sample.fds - start.fds,
+	       sample.rss_kb - start.rss_kb, json ? json : "null");
+	free(json);
+	free(h);
+
+	/* all the clients are gone; so should be what they had */
+	leaks = sample.fds != start.fds || sample.stats.buffers ||
+		sample.stats.fds || sample.stats.import.handles;
+	if (leaks)
+		fprintf(stderr, "leaked %d fds, %u buffers, %u buffer fds, "
+			"%u GEM handles\n", sample.fds - start.fds,
+			sample.stats.buffers, sample.stats.fds,
+			sample.stats.import.handles);
+
+	free(clients);
+	kms_test_server_destroy(soak.server);
+	wl_display_disconnect(upstream_display);
+	kms_test_upstream_destroy(upstream);
+	if (soak.dev >= 0)
+		close(soak.dev);
+
+	return leaks || soak.errors ? 1 : 0;
+}
@@ -0,0 +1,859 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#if defined(HAVE_LINUX_UDMABUF_H)
+#include <linux/udmabuf.h>
+#endif
+
+#include <xf86drm.h>
+#include <wayland-server.h>
+#include <wayland-client.h>
+#include "wayland-kms-server-protocol.h"
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+void kms_test_skip(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "skipped: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+
+	exit(KMS_TEST_SKIP);
+}
+
+uint64_t kms_test_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int kms_test_open_device(const char *driver, char **path)
+{
+	drmVersionPtr version;
+	char name[64];
+	int i, fd, found;
+
+	for (i = 0; i < 16; i++) {
+		snprintf(name, sizeof name, "/dev/dri/card%d", i);
+		if ((fd = open(name, O_RDWR | O_CLOEXEC)) < 0)
+			continue;
+
+		version = drmGetVersion(fd);
+		found = version && !strcmp(version->name, driver);
+		drmFreeVersion(version);
+
+		if (found) {
+			if (path)
+				*path = strdup(name);
+			return fd;
+		}
+		close(fd);
+	}
+
+	return -1;
+}
+
+/*
+ * Server thread
+ */
+
+static void *kms_test_server_thread(void *data)
+{
+	struct kms_test_server *s = data;
+	struct pollfd pfd = { .fd = wl_event_loop_get_fd(s->loop), .events = POLLIN };
+	uint64_t start;
+
+	while (!s->quit) {
+		wl_display_flush_clients(s->display);
+		if (!s->dispatched) {
+			if (wl_event_loop_dispatch(s->loop, -1) < 0 && errno != EINTR)
+				break;
+			continue;
+		}
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		start = kms_test_now_ns();
+		if (wl_event_loop_dispatch(s->loop, 0) < 0 && errno != EINTR)
+			break;
+		wl_display_flush_clients(s->display);
+		s->dispatched(s->dispatched_data, kms_test_now_ns() - start);
+	}
+
+	return NULL;
+}
+
+static int kms_test_server_handle_call(int fd, uint32_t mask, void *data)
+{
+	struct kms_test_server *s = data;
+	void (*func)(void *data);
+	void *func_data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+	func = s->call_done ? NULL : s->call;
+	func_data = s->call_data;
+	pthread_mutex_unlock(&s->lock);
+
+	if (!func)
+		return 0;
+
+	func(func_data);
+
+	pthread_mutex_lock(&s->lock);
+	s->call_done = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+void kms_test_server_call(struct kms_test_server *s,
+			  void (*func)(void *data), void *data)
+{
+	uint64_t one = 1;
+
+	if (!s->running) {
+		func(data);
+		return;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	while (s->call)
+		pthread_cond_wait(&s->cond, &s->lock);
+
+	s->call = func;
+	s->call_data = data;
+	s->call_done = 0;
+	kms_test_assert(write(s->efd, &one, sizeof one) == sizeof one);
+
+	while (!s->call_done)
+		pthread_cond_wait(&s->cond, &s->lock);
+
+	s->call = NULL;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void kms_test_server_quit(void *data)
+{
+	struct kms_test_server *s = data;
+
+	s->quit = 1;
+}
+
+static void kms_test_nop(void *data)
+{
+}
+
+struct kms_test_server *kms_test_display_create(void)
+{
+	struct kms_test_server *s;
+
+	kms_test_assert((s = calloc(1, sizeof(struct kms_test_server))));
+	s->fd = -1;
+
+	kms_test_assert((s->display = wl_display_create()));
+	s->loop = wl_display_get_event_loop(s->display);
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	kms_test_assert((s->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0);
+	s->call_source = wl_event_loop_add_fd(s->loop, s->efd, WL_EVENT_READABLE,
+					      kms_test_server_handle_call, s);
+	kms_test_assert(s->call_source);
+
+	return s;
+}
+
+void kms_test_server_start(struct kms_test_server *s)
+{
+	kms_test_assert(!pthread_create(&s->thread, NULL, kms_test_server_thread, s));
+	s->running = 1;
+}
+
+struct kms_test_server *
+kms_test_server_create(const char *driver, uint32_t flags,
+		       struct wl_display *upstream)
+{
+	struct kms_test_server *s = kms_test_display_create();
+
+	if (driver) {
+		if ((s->fd = kms_test_open_device(driver, &s->device)) < 0)
+			kms_test_skip("no %s device", driver);
+	} else {
+		kms_test_assert((s->fd = open("/dev/null", O_RDWR | O_CLOEXEC)) >= 0);
+		s->device = strdup("/dev/null");
+		flags |= WL_KMS_FLAG_LAZY_IMPORT;
+	}
+
+	s->kms = wayland_kms_init(s->display, upstream, s->device, s->fd);
+	kms_test_assert(s->kms);
+	wayland_kms_set_flags(s->kms, flags);
+
+	kms_test_server_start(s);
+	return s;
+}
+
+void kms_test_server_destroy(struct kms_test_server *s)
+{
+	if (s->running) {
+		kms_test_server_call(s, kms_test_server_quit, s);
+		pthread_join(s->thread, NULL);
+		s->running = 0;
+	}
+
+	wl_display_destroy_clients(s->display);
+	if (s->kms)
+		wayland_kms_uninit(s->kms);
+
+	wl_event_source_remove(s->call_source);
+	wl_display_destroy(s->display);
+
+	close(s->efd);
+	if (s->fd >= 0)
+		close(s->fd);
+	free(s->device);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+struct kms_test_client_ref {
+	struct wl_listener destroy_listener;
+	struct wl_client **client;
+};
+
+static void kms_test_client_ref_destroy(struct wl_listener *listener, void *data)
+{
+	struct kms_test_client_ref *ref =
+		wl_container_of(listener, ref, destroy_listener);
+
+	*ref->client = NULL;
+	free(ref);
+}
+
+struct kms_test_connect {
+	struct kms_test_server *server;
+	int fd;
+	struct wl_client **client;
+};
+
+static void kms_test_do_connect(void *data)
+{
+	struct kms_test_connect *connect = data;
+	struct kms_test_client_ref *ref;
+	struct wl_client *client;
+
+	client = wl_client_create(connect->server->display, connect->fd);
+	kms_test_assert(client);
+
+	if (!connect->client)
+		return;
+
+	kms_test_assert((ref = calloc(1, sizeof(struct kms_test_client_ref))));
+	ref->client = connect->client;
+	ref->destroy_listener.notify = kms_test_client_ref_destroy;
+	wl_client_add_destroy_listener(client, &ref->destroy_listener);
+	*connect->client = client;
+}
+
+struct wl_display *kms_test_server_connect(struct kms_test_server *s,
+					   struct wl_client **client)
+{
+	struct kms_test_connect connect = { .server = s, .client = client };
+	struct wl_display *display;
+	int fds[2];
+
+	kms_test_assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+
+	connect.fd = fds[0];
+	kms_test_server_call(s, kms_test_do_connect, &connect);
+
+	kms_test_assert((display = wl_display_connect_to_fd(fds[1])));
+	return display;
+}
+
+int kms_test_server_wait_client(struct kms_test_server *s,
+				struct wl_client **client)
+{
+	uint64_t end = kms_test_now_ns() + KMS_TEST_TIMEOUT_MS * 1000000ull;
+
+	for (;;) {
+		/* also makes what the thread wrote visible to us */
+		kms_test_server_call(s, kms_test_nop, NULL);
+		if (!*client)
+			return 0;
+		if (!s->running || kms_test_now_ns() > end)
+			return -1;
+		usleep(1000);
+	}
+}
+
+struct kms_test_stats {
+	struct kms_test_server *server;
+	struct wl_kms_stats *stats;
+};
+
+static void kms_test_do_get_stats(void *data)
+{
+	struct kms_test_stats *ts = data;
+
+	wayland_kms_get_stats(ts->server->kms, ts->stats);
+}
+
+void kms_test_server_get_stats(struct kms_test_server *s,
+			       struct wl_kms_stats *stats)
+{
+	struct kms_test_stats ts = { .server = s, .stats = stats };
+
+	kms_test_server_call(s, kms_test_do_get_stats, &ts);
+}
+
+/*
+ * Clients
+ */
+
+static void kms_test_handle_device(void *data, struct wl_kms *wl_kms,
+				   const char *name)
+{
+	struct kms_test_client *c = data;
+
+	free(c->device);
+	c->device = strdup(name);
+}
+
+static void kms_test_handle_format(void *data, struct wl_kms *wl_kms,
+				   uint32_t format)
+{
+	struct kms_test_client *c = data;
+
+	c->formats++;
+}
+
+static void kms_test_handle_authenticated(void *data, struct wl_kms *wl_kms)
+{
+	struct kms_test_client *c = data;
+
+	c->authenticated++;
+}
+
+static void kms_test_handle_format_table(void *data, struct wl_kms *wl_kms,
+					 int32_t fd, uint32_t size)
+{
+	struct kms_test_client *c = data;
+
+	/* struct kms_format_table_entry */
+	c->formats += size / 16;
+	close(fd);
+}
+
+static void kms_test_handle_scanout_hint(void *data, struct wl_kms *wl_kms,
+					 struct wl_buffer *buffer, uint32_t format,
+					 int32_t width, int32_t height)
+{
+	struct kms_test_client *c = data;
+
+	c->hints++;
+	c->hint_format = format;
+	c->hint_width = width;
+	c->hint_height = height;
+}
+
+static void kms_test_handle_plane(void *data, struct wl_kms *wl_kms,
+				  struct wl_buffer *buffer, int32_t fd,
+				  uint32_t offset, uint32_t stride)
+{
+	struct kms_test_client *c = data;
+
+	if (c->planes == MAX_PLANES) {
+		close(fd);
+		return;
+	}
+
+	c->plane_fds[c->planes] = fd;
+	c->plane_offsets[c->planes] = offset;
+	c->plane_strides[c->planes] = stride;
+	c->planes++;
+}
+
+static void kms_test_handle_allocated(void *data, struct wl_kms *wl_kms,
+				      struct wl_buffer *buffer)
+{
+	struct kms_test_client *c = data;
+
+	c->allocated++;
+}
+
+static void kms_test_handle_allocation_failed(void *data, struct wl_kms *wl_kms,
+					      struct wl_buffer *buffer)
+{
+	struct kms_test_client *c = data;
+
+	c->allocation_failed++;
+}
+
+static const struct wl_kms_listener kms_test_kms_listener = {
+	.device = kms_test_handle_device,
+	.format = kms_test_handle_format,
+	.authenticated = kms_test_handle_authenticated,
+	.format_table = kms_test_handle_format_table,
+	.scanout_hint = kms_test_handle_scanout_hint,
+	.plane = kms_test_handle_plane,
+	.allocated = kms_test_handle_allocated,
+	.allocation_failed = kms_test_handle_allocation_failed,
+};
+
+static void kms_test_handle_global(void *data, struct wl_registry *registry,
+				   uint32_t name, const char *interface,
+				   uint32_t version)
+{
+	struct kms_test_client *c = data;
+
+	if (strcmp(interface, "wl_kms") || c->wl_kms)
+		return;
+
+	if (c->version > version)
+		c->version = version;
+	c->wl_kms = wl_registry_bind(registry, name, &wl_kms_interface, c->version);
+	wl_kms_add_listener(c->wl_kms, &kms_test_kms_listener, c);
+}
+
+static void kms_test_handle_global_remove(void *data, struct wl_registry *registry,
+					  uint32_t name)
+{
+}
+
+static const struct wl_registry_listener kms_test_registry_listener = {
+	.global = kms_test_handle_global,
+	.global_remove = kms_test_handle_global_remove,
+};
+
+struct kms_test_client *
+kms_test_client_create(struct kms_test_server *s, uint32_t version)
+{
+	struct kms_test_client *c;
+
+	kms_test_assert((c = calloc(1, sizeof(struct kms_test_client))));
+	c->server = s;
+	c->version = version;
+	c->display = kms_test_server_connect(s, &c->client);
+
+	c->registry = wl_display_get_registry(c->display);
+	wl_registry_add_listener(c->registry, &kms_test_registry_listener, c);
+	kms_test_assert(wl_display_roundtrip(c->display) >= 0);
+	kms_test_assert(c->wl_kms);
+
+	/* device and formats */
+	kms_test_assert(wl_display_roundtrip(c->display) >= 0);
+	kms_test_assert(c->device);
+
+	return c;
+}
+
+void kms_test_client_reset_planes(struct kms_test_client *c)
+{
+	int i;
+
+	for (i = 0; i < c->planes; i++)
+		close(c->plane_fds[i]);
+	c->planes = 0;
+}
+
+void kms_test_client_destroy(struct kms_test_client *c)
+{
+	kms_test_client_reset_planes(c);
+
+	wl_kms_destroy(c->wl_kms);
+	wl_registry_destroy(c->registry);
+	wl_display_disconnect(c->display);
+
+	/* c->client is written until the server notices */
+	if (c->client)
+		kms_test_server_wait_client(c->server, &c->client);
+
+	free(c->device);
+	free(c);
+}
+
+int kms_test_client_roundtrip(struct kms_test_client *c)
+{
+	return wl_display_roundtrip(c->display);
+}
+
+int kms_test_client_get_error(struct kms_test_client *c)
+{
+	if (wl_display_get_error(c->display) != EPROTO)
+		return -1;
+
+	return wl_display_get_protocol_error(c->display, NULL, NULL);
+}
+
+int kms_test_client_wait(struct kms_test_client *c, const int *flag,
+			 int timeout_ms)
+{
+	uint64_t end = kms_test_now_ns() + timeout_ms * 1000000ull;
+
+	while (!*flag) {
+		if (wl_display_roundtrip(c->display) < 0)
+			return -1;
+		if (*flag)
+			break;
+		if (kms_test_now_ns() > end)
+			return -1;
+		usleep(1000);
+	}
+
+	return 0;
+}
+
+struct wl_kms_buffer *kms_test_client_get_buffer(struct kms_test_client *c,
+						 void *proxy)
+{
+	struct wl_resource *resource;
+
+	if (!c->client)
+		return NULL;
+
+	resource = wl_client_get_object(c->client,
+					wl_proxy_get_id((struct wl_proxy *)proxy));
+	return wayland_kms_buffer_get(resource);
+}
+
+/*
+ * Buffers
+ */
+
+static int kms_test_memfd_create(struct kms_test_bo *bo)
+{
+	int memfd;
+#if defined(HAVE_LINUX_UDMABUF_H)
+	struct udmabuf_create create;
+	int dev, fd;
+#endif
+
+	memfd = memfd_create("wayland-kms-test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0)
+		return -1;
+	if (ftruncate(memfd, bo->size) < 0) {
+		close(memfd);
+		return -1;
+	}
+
+#if defined(HAVE_LINUX_UDMABUF_H)
+	/* udmabuf wants the memfd sealed against shrinking */
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) == 0 &&
+	    (dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC)) >= 0) {
+		memset(&create, 0, sizeof create);
+		create.memfd = memfd;
+		create.flags = UDMABUF_FLAGS_CLOEXEC;
+		create.offset = 0;
+		create.size = bo->size;
+		fd = ioctl(dev, UDMABUF_CREATE, &create);
+		close(dev);
+
+		if (fd >= 0) {
+			close(memfd);
+			bo->fd = fd;
+			bo->is_dmabuf = 1;
+			return 0;
+		}
+	}
+#endif
+
+	bo->fd = memfd;
+	return 0;
+}
+
+int kms_test_bo_create(struct kms_test_bo *bo, int dev, uint32_t width,
+		       uint32_t height, uint32_t bpp)
+{
+	struct drm_mode_create_dumb create;
+	long page = sysconf(_SC_PAGESIZE);
+
+	memset(bo, 0, sizeof *bo);
+	bo->fd = -1;
+	bo->dev = dev;
+
+	if (dev < 0) {
+		bo->stride = (width * bpp / 8 + 63) & ~63u;
+		bo->size = ((uint64_t)bo->stride * height + page - 1) & ~(uint64_t)(page - 1);
+		return kms_test_memfd_create(bo);
+	}
+
+	memset(&create, 0, sizeof create);
+	create.width = width;
+	create.height = height;
+	create.bpp = bpp;
+	if (drmIoctl(dev, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+		return -1;
+
+	bo->handle = create.handle;
+	bo->stride = create.pitch;
+	bo->size = create.size;
+	bo->is_dmabuf = 1;
+
+	if (drmPrimeHandleToFD(dev, bo->handle, DRM_CLOEXEC | DRM_RDWR, &bo->fd)) {
+		kms_test_bo_destroy(bo);
+		return -1;
+	}
+
+	return 0;
+}
+
+void kms_test_bo_destroy(struct kms_test_bo *bo)
+{
+	struct drm_mode_destroy_dumb destroy;
+
+	if (bo->fd >= 0)
+		close(bo->fd);
+
+	if (bo->handle) {
+		memset(&destroy, 0, sizeof destroy);
+		destroy.handle = bo->handle;
+		drmIoctl(bo->dev, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+
+	memset(bo, 0, sizeof *bo);
+	bo->fd = -1;
+}
+
+/*
+ * Benchmarks
+ */
+
+void kms_bench_report(const char *name, uint64_t iterations, uint64_t ns,
+		      const struct wl_kms_stats *stats)
+{
+	char *json = stats ? wayland_kms_stats_to_json(stats) : NULL;
+
+	printf("{\"name\":\"%s\",\"iterations\":%" PRIu64 ",\"ns\":%" PRIu64
+	       ",\"ns_per_iteration\":%" PRIu64 "%s%s}\n",
+	       name, iterations, ns, iterations ? ns / iterations : 0,
+	       json ? ",\"stats\":" : "", json ? json : "");
+	fflush(stdout);
+	free(json);
+}
+
+int kms_bench_iterations(int argc, char **argv, int iterations)
+{
+	if (argc > 1 && atoi(argv[1]) > 0)
+		return atoi(argv[1]);
+
+	return iterations;
+}
+
+/*
+ * Fake upstream server
+ */
+
+struct kms_test_upstream {
+	struct kms_test_server *server;
+	struct wl_global *global;
+	int requests;
+	int hold;
+	struct wl_array held;		/* struct wl_resource *, oldest first */
+};
+
+static void kms_test_upstream_authenticate(struct wl_client *client,
+					   struct wl_resource *resource,
+					   uint32_t magic)
+{
+	struct kms_test_upstream *u = wl_resource_get_user_data(resource);
+	struct wl_resource **r;
+
+	u->requests++;
+
+	if (!u->hold) {
+		wl_kms_send_authenticated(resource);
+		return;
+	}
+
+	kms_test_assert((r = wl_array_add(&u->held, sizeof *r)));
+	*r = resource;
+}
+
+static const struct wl_kms_interface kms_test_upstream_interface = {
+	.authenticate = kms_test_upstream_authenticate,
+};
+
+static void kms_test_upstream_unbind(struct wl_resource *resource)
+{
+	struct kms_test_upstream *u = wl_resource_get_user_data(resource);
+	struct wl_resource **r;
+
+	/* nobody to answer any more */
+	wl_array_for_each(r, &u->held) {
+		if (*r == resource)
+			*r = NULL;
+	}
+}
+
+static void kms_test_upstream_bind(struct wl_client *client, void *data,
+				   uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &wl_kms_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &kms_test_upstream_interface,
+				       data, kms_test_upstream_unbind);
+
+	wl_kms_send_device(resource, "/dev/null");
+	wl_kms_send_format(resource, WL_KMS_FORMAT_XRGB8888);
+	wl_kms_send_format(resource, WL_KMS_FORMAT_ARGB8888);
+	wl_kms_send_format(resource, WL_KMS_FORMAT_NV12);
+}
+
+struct kms_test_upstream *kms_test_upstream_create(void)
+{
+	struct kms_test_upstream *u;
+
+	kms_test_assert((u = calloc(1, sizeof(struct kms_test_upstream))));
+	wl_array_init(&u->held);
+
+	u->server = kms_test_display_create();
+	u->global = wl_global_create(u->server->display, &wl_kms_interface,
+				     wl_kms_interface.version, u,
+				     kms_test_upstream_bind);
+	kms_test_assert(u->global);
+
+	kms_test_server_start(u->server);
+	return u;
+}
+
+void kms_test_upstream_destroy(struct kms_test_upstream *u)
+{
+	kms_test_server_destroy(u->server);
+	wl_array_release(&u->held);
+	free(u);
+}
+
+struct wl_display *kms_test_upstream_connect(struct kms_test_upstream *u)
+{
+	return kms_test_server_connect(u->server, NULL);
+}
+
+struct kms_test_upstream_op {
+	struct kms_test_upstream *upstream;
+	int value;
+};
+
+static void kms_test_do_get_requests(void *data)
+{
+	struct kms_test_upstream_op *op = data;
+
+	op->value = op->upstream->requests;
+}
+
+int kms_test_upstream_get_requests(struct kms_test_upstream *u)
+{
+	struct kms_test_upstream_op op = { .upstream = u };
+
+	kms_test_server_call(u->server, kms_test_do_get_requests, &op);
+	return op.value;
+}
+
+int kms_test_upstream_wait_requests(struct kms_test_upstream *u, int requests,
+				    int timeout_ms)
+{
+	uint64_t end = kms_test_now_ns() + timeout_ms * 1000000ull;
+
+	while (kms_test_upstream_get_requests(u) < requests) {
+		if (kms_test_now_ns() > end)
+			return -1;
+		usleep(1000);
+	}
+
+	return 0;
+}
+
+static void kms_test_do_hold(void *data)
+{
+	struct kms_test_upstream_op *op = data;
+
+	op->upstream->hold = op->value;
+}
+
+void kms_test_upstream_hold(struct kms_test_upstream *u, int hold)
+{
+	struct kms_test_upstream_op op = { .upstream = u, .value = hold };
+
+	kms_test_server_call(u->server, kms_test_do_hold, &op);
+}
+
+static void kms_test_do_release(void *data)
+{
+	struct kms_test_upstream_op *op = data;
+	struct kms_test_upstream *u = op->upstream;
+	struct wl_resource **held = u->held.data;
+	size_t count = u->held.size / sizeof *held;
+	size_t i, n = op->value < (int)count ? (size_t)op->value : count;
+
+	for (i = 0; i < n; i++) {
+		if (held[i])
+			wl_kms_send_authenticated(held[i]);
+	}
+
+	memmove(held, held + n, (count - n) * sizeof *held);
+	u->held.size -= n * sizeof *held;
+}
+
+void kms_test_upstream_release(struct kms_test_upstream *u, int count)
+{
+	struct kms_test_upstream_op op = { .upstream = u, .value = count };
+
+	kms_test_server_call(u->server, kms_test_do_release, &op);
+}
@@ -0,0 +1,207 @@
+#ifndef KMS_TEST_H
+#define KMS_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <wayland-server-core.h>
+#include <wayland-client-core.h>
+#include "wayland-kms.h"
+
+/*
+ * Helpers for the tests and benchmarks
+ *
+ * A kms_test_server runs a wl_display with a wl_kms on a thread of its
+ * own, so that clients on the test thread can simply do round trips.
+ * Anything touching the server state is run on that thread with
+ * kms_test_server_call(). Clients are connected through socketpairs.
+ */
+
+/* exit status meson takes as a skipped test */
+#define KMS_TEST_SKIP 77
+
+/* how long kms_test_client_wait() waits for an event */
+#define KMS_TEST_TIMEOUT_MS 5000
+
+#define kms_test_assert(cond) do {					\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s: assertion failed: %s\n",	\
+			__FILE__, __LINE__, __func__, #cond);		\
+		abort();						\
+	}								\
+} while (0)
+
+extern void kms_test_skip(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2), noreturn));
+
+extern uint64_t kms_test_now_ns(void);
+
+/*
+ * Opens the first primary node of the given DRM driver, e.g. "vgem" or
+ * "vkms". Returns -1 if there is none; path is to be freed.
+ */
+extern int kms_test_open_device(const char *driver, char **path);
+
+struct kms_test_server {
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct wl_kms *kms;		/* NULL for a bare display */
+	int fd;				/* the device of kms, or /dev/null */
+	char *device;
+
+	pthread_t thread;
+	int running, quit;
+	int efd;			/* wakes the thread up for calls */
+	struct wl_event_source *call_source;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void (*call)(void *data);
+	void *call_data;
+	int call_done;
+
+	/*
+	 * Called on the thread with the time each dispatch of the event
+	 * loop took, waiting aside. To be set before the thread starts,
+	 * or from it with kms_test_server_call().
+	 */
+	void (*dispatched)(void *data, uint64_t ns);
+	void *dispatched_data;
+};
+
+/* A display with no wl_kms, to be started with kms_test_server_start() */
+extern struct kms_test_server *kms_test_display_create(void);
+extern void kms_test_server_start(struct kms_test_server *s);
+
+/*
+ * A wl_kms on a primary node of driver, or on /dev/null with
+ * WL_KMS_FLAG_LAZY_IMPORT added if driver is NULL; buffers are then
+ * never imported. Skips the test if there is no such device. upstream
+ * is passed to wayland_kms_init() as the server we are nested in.
+ */
+extern struct kms_test_server *
+kms_test_server_create(const char *driver, uint32_t flags,
+		       struct wl_display *upstream);
+extern void kms_test_server_destroy(struct kms_test_server *s);
+
+/* Runs func on the thread of the server, and waits for it */
+extern void kms_test_server_call(struct kms_test_server *s,
+				 void (*func)(void *data), void *data);
+
+/*
+ * Connects a client. The wl_client is stored into *client, unless it is
+ * NULL, and set to NULL once the server destroys it.
+ */
+extern struct wl_display *kms_test_server_connect(struct kms_test_server *s,
+						  struct wl_client **client);
+
+/* Snapshots of the wl_kms counters, taken on the server thread */
+extern void kms_test_server_get_stats(struct kms_test_server *s,
+				      struct wl_kms_stats *stats);
+
+/* A client bound to the wl_kms of a kms_test_server */
+struct kms_test_client {
+	struct kms_test_server *server;
+	struct wl_display *display;
+	struct wl_client *client;	/* server side, NULL once destroyed */
+	struct wl_registry *registry;
+	struct wl_kms *wl_kms;
+	uint32_t version;
+
+	/* wl_kms events */
+	char *device;
+	int formats;			/* format events, or table entries */
+	int authenticated;
+	int hints;
+	uint32_t hint_format;
+	int32_t hint_width, hint_height;
+	int allocated, allocation_failed;
+	int planes;
+	int plane_fds[MAX_PLANES];	/* of the last allocated buffer */
+	uint32_t plane_offsets[MAX_PLANES], plane_strides[MAX_PLANES];
+};
+
+extern struct kms_test_client *
+kms_test_client_create(struct kms_test_server *s, uint32_t version);
+extern void kms_test_client_destroy(struct kms_test_client *c);
+extern int kms_test_client_roundtrip(struct kms_test_client *c);
+
+/* Closes the fds of the plane events received so far */
+extern void kms_test_client_reset_planes(struct kms_test_client *c);
+
+/* Returns the protocol error the client got, or -1 */
+extern int kms_test_client_get_error(struct kms_test_client *c);
+
+/*
+ * Dispatches the client until *flag is set. Returns 0 then, or -1 on
+ * errors and once timeout_ms passed.
+ */
+extern int kms_test_client_wait(struct kms_test_client *c, const int *flag,
+				int timeout_ms);
+
+/*
+ * Returns the server side of a wl_buffer of the client; to be called on
+ * the server thread.
+ */
+extern struct wl_kms_buffer *kms_test_client_get_buffer(struct kms_test_client *c,
+							 void *proxy);
+
+/*
+ * Waits until the server destroyed the wl_client, after the client
+ * disconnected
+ */
+extern int kms_test_server_wait_client(struct kms_test_server *s,
+				       struct wl_client **client);
+
+/*
+ * A buffer to send to the server: a dumb buffer exported as a dma-buf
+ * if dev is a DRM fd, and otherwise a udmabuf, or a plain memfd if the
+ * kernel has no udmabuf.
+ */
+struct kms_test_bo {
+	int fd;
+	int dev;
+	uint32_t handle;		/* of the dumb buffer on dev */
+	uint32_t stride;
+	uint64_t size;
+	int is_dmabuf;
+};
+
+extern int kms_test_bo_create(struct kms_test_bo *bo, int dev, uint32_t width,
+			      uint32_t height, uint32_t bpp);
+extern void kms_test_bo_destroy(struct kms_test_bo *bo);
+
+/*
+ * Benchmarks print a line of JSON per measurement: its name, how many
+ * iterations were timed, the mean time of one, and the wl_kms counters
+ * at the end unless stats is NULL.
+ */
+extern void kms_bench_report(const char *name, uint64_t iterations,
+			     uint64_t ns, const struct wl_kms_stats *stats);
+
+/* Iterations to run: the first argument if given, or the default */
+extern int kms_bench_iterations(int argc, char **argv, int iterations);
+
+/*
+ * A stand-in for the server of a nested compositor: a wl_kms global
+ * that only answers authenticate requests. The answers can be held and
+ * released one by one, to see what happens while they are pending.
+ */
+struct kms_test_upstream;
+
+extern struct kms_test_upstream *kms_test_upstream_create(void);
+extern void kms_test_upstream_destroy(struct kms_test_upstream *u);
+
+/* A connection to it, to hand to wayland_kms_init() */
+extern struct wl_display *kms_test_upstream_connect(struct kms_test_upstream *u);
+
+extern int kms_test_upstream_get_requests(struct kms_test_upstream *u);
+extern int kms_test_upstream_wait_requests(struct kms_test_upstream *u,
+					   int requests, int timeout_ms);
+extern void kms_test_upstream_hold(struct kms_test_upstream *u, int hold);
+
+/* Sends the authenticated events of the count oldest held requests */
+extern void kms_test_upstream_release(struct kms_test_upstream *u, int count);
+
+#endif
@@ -0,0 +1,353 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * Planar texture formats: an NV12 udmabuf reports EGL_TEXTURE_Y_UV_WL
+ * with WL_KMS_FLAG_PLANAR_TEXTURES, and its planes, as described by
+ * wayland_kms_query_plane(), import into EGL as R8 and GR88 images
+ * sampling back what was written. Meant for Mesa's llvmpipe on the
+ * surfaceless platform; skipped without udmabuf or dma-buf import.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <drm_fourcc.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "weston-egl-ext.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 32
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+static uint8_t luma(int x, int y)
+{
+	return x * 3 + y;
+}
+
+static uint8_t chroma(int x, int y, int v)
+{
+	return v ? 0x80 + y : 0x10 + x;
+}
+
+static void fill(struct kms_test_bo *bo)
+{
+	uint8_t *map, *uv;
+	int x, y;
+
+	map = mmap(NULL, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED, bo->fd, 0);
+	kms_test_assert(map != MAP_FAILED);
+
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < WIDTH; x++)
+			map[y * bo->stride + x] = luma(x, y);
+	}
+
+	uv = map + bo->stride * HEIGHT;
+	for (y = 0; y < HEIGHT / 2; y++) {
+		for (x = 0; x < WIDTH / 2; x++) {
+			uv[y * bo->stride + x * 2] = chroma(x, y, 0);
+			uv[y * bo->stride + x * 2 + 1] = chroma(x, y, 1);
+		}
+	}
+
+	munmap(map, bo->size);
+}
+
+/* What the compositor would pass on to its renderer */
+struct plane {
+	int fd;
+	int stride, offset, width, height;
+};
+
+struct query {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	int texture_format;
+	struct plane planes[2];
+};
+
+static void do_query(void *data)
+{
+	struct query *q = data;
+	struct wl_kms *kms = q->client->server->kms;
+	struct wl_kms_buffer *buffer;
+	struct plane *p;
+	int i, value;
+
+	buffer = kms_test_client_get_buffer(q->client, q->buffer);
+	kms_test_assert(buffer);
+
+	kms_test_assert(wayland_kms_query_buffer(kms, buffer->resource,
+						 WL_KMS_TEXTURE_FORMAT,
+						 &q->texture_format) == 0);
+
+	for (i = 0; i < 2; i++) {
+		p = &q->planes[i];
+		kms_test_assert(wayland_kms_query_plane(kms, buffer->resource, i,
+							WL_KMS_PLANE_STRIDE,
+							&p->stride) == 0);
+		kms_test_assert(wayland_kms_query_plane(kms, buffer->resource, i,
+							WL_KMS_PLANE_OFFSET,
+							&p->offset) == 0);
+		kms_test_assert(wayland_kms_query_plane(kms, buffer->resource, i,
+							WL_KMS_PLANE_WIDTH,
+							&p->width) == 0);
+		kms_test_assert(wayland_kms_query_plane(kms, buffer->resource, i,
+							WL_KMS_PLANE_HEIGHT,
+							&p->height) == 0);
+		p->fd = wayland_kms_buffer_get_plane_fd(buffer, i);
+		kms_test_assert(p->fd >= 0);
+	}
+
+	kms_test_assert(wayland_kms_query_plane(kms, buffer->resource, 2,
+						WL_KMS_PLANE_STRIDE, &value) < 0);
+}
+
+/*
+ * EGL
+ */
+
+struct egl {
+	EGLDisplay display;
+	EGLContext context;
+	PFNEGLCREATEIMAGEKHRPROC create_image;
+	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture;
+};
+
+static int has_extension(const char *extensions, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p = extensions;
+
+	while (p && (p = strstr(p, name))) {
+		if ((p == extensions || p[-1] == ' ') &&
+		    (p[len] == ' ' || p[len] == '\0'))
+			return 1;
+		p += len;
+	}
+
+	return 0;
+}
+
+/* Whether the display takes dma-bufs of the format at all */
+static int has_dmabuf_format(EGLDisplay display, uint32_t format)
+{
+	PFNEGLQUERYDMABUFFORMATSEXTPROC query_formats;
+	EGLint formats[256], count, i;
+
+	query_formats = (void *)eglGetProcAddress("eglQueryDmaBufFormatsEXT");
+	if (!query_formats)
+		return 1;
+	if (!query_formats(display, 256, formats, &count))
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		if ((uint32_t)formats[i] == format)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void egl_init(struct egl *egl)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+	static const EGLint config_attribs[] = {
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_NONE
+	};
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 3,
+		EGL_NONE
+	};
+	const char *extensions;
+	EGLConfig config;
+	EGLint count;
+
+	extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (!has_extension(extensions, "EGL_MESA_platform_surfaceless"))
+		kms_test_skip("no surfaceless EGL platform");
+
+	get_platform_display = (void *)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	kms_test_assert(get_platform_display);
+	egl->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+					    EGL_DEFAULT_DISPLAY, NULL);
+	if (egl->display == EGL_NO_DISPLAY || !eglInitialize(egl->display, NULL, NULL))
+		kms_test_skip("no surfaceless EGL display");
+
+	extensions = eglQueryString(egl->display, EGL_EXTENSIONS);
+	if (!has_extension(extensions, "EGL_EXT_image_dma_buf_import") ||
+	    !has_extension(extensions, "EGL_KHR_surfaceless_context"))
+		kms_test_skip("no dma-buf import on %s",
+			      eglQueryString(egl->display, EGL_VENDOR));
+	if (!has_dmabuf_format(egl->display, DRM_FORMAT_R8) ||
+	    !has_dmabuf_format(egl->display, DRM_FORMAT_GR88))
+		kms_test_skip("no R8 or GR88 dma-buf import");
+
+	kms_test_assert(eglBindAPI(EGL_OPENGL_ES_API));
+	kms_test_assert(eglChooseConfig(egl->display, config_attribs, &config, 1,
+					&count) && count == 1);
+	egl->context = eglCreateContext(egl->display, config, EGL_NO_CONTEXT,
+					context_attribs);
+	if (egl->context == EGL_NO_CONTEXT)
+		kms_test_skip("no GLES 3 context");
+	kms_test_assert(eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+				       egl->context));
+
+	egl->create_image = (void *)eglGetProcAddress("eglCreateImageKHR");
+	egl->destroy_image = (void *)eglGetProcAddress("eglDestroyImageKHR");
+	egl->image_target_texture =
+		(void *)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+	kms_test_assert(egl->create_image && egl->destroy_image &&
+			egl->image_target_texture);
+}
+
+static void egl_fini(struct egl *egl)
+{
+	eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(egl->display, egl->context);
+	eglTerminate(egl->display);
+}
+
+/* Imports the plane, and reads it back through a framebuffer */
+static void read_plane(struct egl *egl, const struct plane *p, uint32_t format,
+		       uint8_t *pixels)
+{
+	const EGLint attribs[] = {
+		EGL_WIDTH, p->width,
+		EGL_HEIGHT, p->height,
+		EGL_LINUX_DRM_FOURCC_EXT, format,
+		EGL_DMA_BUF_PLANE0_FD_EXT, p->fd,
+		EGL_DMA_BUF_PLANE0_OFFSET_EXT, p->offset,
+		EGL_DMA_BUF_PLANE0_PITCH_EXT, p->stride,
+		EGL_NONE
+	};
+	EGLImageKHR image;
+	GLuint texture, fb;
+
+	image = egl->create_image(egl->display, EGL_NO_CONTEXT,
+				  EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	kms_test_assert(image != EGL_NO_IMAGE_KHR);
+
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	egl->image_target_texture(GL_TEXTURE_2D, image);
+	kms_test_assert(glGetError() == GL_NO_ERROR);
+
+	glGenFramebuffers(1, &fb);
+	glBindFramebuffer(GL_FRAMEBUFFER, fb);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, texture, 0);
+	kms_test_assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
+			GL_FRAMEBUFFER_COMPLETE);
+
+	glReadPixels(0, 0, p->width, p->height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	kms_test_assert(glGetError() == GL_NO_ERROR);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fb);
+	glDeleteTextures(1, &texture);
+	egl->destroy_image(egl->display, image);
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct kms_test_bo bo;
+	struct query q = { 0 };
+	struct egl egl;
+	uint8_t pixels[WIDTH * HEIGHT * 4], *px;
+	int x, y;
+
+	/* two lines of chroma for four of luma, one byte per pixel */
+	if (kms_test_bo_create(&bo, -1, WIDTH, HEIGHT * 3 / 2, 8) < 0 || !bo.is_dmabuf)
+		kms_test_skip("no udmabuf");
+	fill(&bo);
+
+	egl_init(&egl);
+
+	s = kms_test_server_create(NULL, WL_KMS_FLAG_PLANAR_TEXTURES, NULL);
+	c = kms_test_client_create(s, 9);
+
+	q.client = c;
+	q.buffer = wl_kms_create_planar_buffer(c->wl_kms, WIDTH, HEIGHT,
+					       WL_KMS_FORMAT_NV12,
+					       bo.fd, 0, bo.stride,
+					       bo.fd, bo.stride * HEIGHT, bo.stride,
+					       bo.fd, 0, 0, bo.fd, 0, 0);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_server_call(s, do_query, &q);
+
+	kms_test_assert(q.texture_format == EGL_TEXTURE_Y_UV_WL);
+	kms_test_assert(q.planes[0].width == WIDTH && q.planes[0].height == HEIGHT);
+	kms_test_assert(q.planes[1].width == WIDTH / 2 &&
+			q.planes[1].height == HEIGHT / 2);
+	kms_test_assert(q.planes[1].offset == (int)(bo.stride * HEIGHT));
+
+	read_plane(&egl, &q.planes[0], DRM_FORMAT_R8, pixels);
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < WIDTH; x++) {
+			px = &pixels[(y * WIDTH + x) * 4];
+			kms_test_assert(px[0] == luma(x, y));
+		}
+	}
+
+	/* GR88 is little endian: U, the first byte, is red */
+	read_plane(&egl, &q.planes[1], DRM_FORMAT_GR88, pixels);
+	for (y = 0; y < HEIGHT / 2; y++) {
+		for (x = 0; x < WIDTH / 2; x++) {
+			px = &pixels[(y * (WIDTH / 2) + x) * 4];
+			kms_test_assert(px[0] == chroma(x, y, 0));
+			kms_test_assert(px[1] == chroma(x, y, 1));
+		}
+	}
+
+	close(q.planes[0].fd);
+	close(q.planes[1].fd);
+	wl_buffer_destroy(q.buffer);
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+	egl_fini(&egl);
+	kms_test_bo_destroy(&bo);
+
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * wl_kms_buffer pool: creates and destroys batches of buffers with the
+ * pool off and with its defaults. The server side time is the one of
+ * the create and destroy requests; buffers are not imported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+#define BUFFERS 32
+
+struct set_pool {
+	struct kms_test_server *server;
+	int min, max;
+};
+
+static void do_set_pool(void *data)
+{
+	struct set_pool *sp = data;
+
+	wayland_kms_set_buffer_pool(sp->server->kms, sp->min, sp->max);
+}
+
+static void run(struct kms_test_client *c, struct kms_test_bo *bo,
+		const char *name, int min, int max, int rounds)
+{
+	struct set_pool sp = { .server = c->server, .min = min, .max = max };
+	struct wl_buffer *buffers[BUFFERS];
+	struct wl_kms_stats before, after;
+	uint64_t start, end, n;
+	char label[64];
+	int r, i;
+
+	kms_test_server_call(c->server, do_set_pool, &sp);
+	kms_test_server_get_stats(c->server, &before);
+
+	start = kms_test_now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < BUFFERS; i++)
+			buffers[i] = wl_kms_create_buffer(c->wl_kms, bo->fd, WIDTH,
+							  HEIGHT, bo->stride,
+							  WL_KMS_FORMAT_XRGB8888, 0);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+		for (i = 0; i < BUFFERS; i++)
+			wl_buffer_destroy(buffers[i]);
+		kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	}
+	end = kms_test_now_ns();
+
+	kms_test_server_get_stats(c->server, &after);
+	n = (uint64_t)rounds * BUFFERS;
+	kms_test_assert(after.creates - before.creates == n);
+
+	snprintf(label, sizeof label, "pool/%s/server", name);
+	kms_bench_report(label, n, after.create_ns - before.create_ns +
+			 after.destroy_ns - before.destroy_ns, &after);
+
+	snprintf(label, sizeof label, "pool/%s/client", name);
+	kms_bench_report(label, n, end - start, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = kms_bench_iterations(argc, argv, 500);
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct kms_test_bo bo;
+
+	s = kms_test_server_create(NULL, 0, NULL);
+	c = kms_test_client_create(s, 9);
+	kms_test_assert(kms_test_bo_create(&bo, -1, WIDTH, HEIGHT, 32) == 0);
+
+	/* warm up, then each setting */
+	run(c, &bo, "warmup", 0, 0, rounds / 10 + 1);
+	run(c, &bo, "off", 0, 0, rounds);
+	run(c, &bo, "default", 8, 64, rounds);
+
+	kms_test_bo_destroy(&bo);
+	kms_test_client_destroy(c);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Scanout hints, on vkms: the hint names a format a plane of the device
+ * takes, is sent to version 8 clients only, and only when it changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 128
+#define HEIGHT 128
+
+/* A format of the first plane of the device other than format, if any */
+static uint32_t plane_format(int fd, uint32_t format)
+{
+	drmModePlaneResPtr res;
+	drmModePlanePtr plane;
+	uint32_t result = 0;
+	uint32_t i;
+
+	drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	kms_test_assert((res = drmModeGetPlaneResources(fd)));
+	kms_test_assert(res->count_planes > 0);
+	kms_test_assert((plane = drmModeGetPlane(fd, res->planes[0])));
+
+	for (i = 0; i < plane->count_formats; i++) {
+		result = plane->formats[i];
+		if (result != format)
+			break;
+	}
+
+	drmModeFreePlane(plane);
+	drmModeFreePlaneResources(res);
+	return result;
+}
+
+struct hint {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	uint32_t format;
+	int32_t width, height;
+};
+
+static void do_send_hint(void *data)
+{
+	struct hint *h = data;
+	struct wl_kms_buffer *buffer;
+
+	buffer = kms_test_client_get_buffer(h->client, h->buffer);
+	kms_test_assert(buffer);
+	wayland_kms_buffer_send_scanout_hint(buffer, h->format, h->width, h->height);
+}
+
+static void send_hint(struct hint *h, int32_t width, int32_t height)
+{
+	h->width = width;
+	h->height = height;
+	kms_test_server_call(h->client->server, do_send_hint, h);
+	kms_test_assert(kms_test_client_roundtrip(h->client) >= 0);
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *c, *old;
+	struct kms_test_bo bo;
+	struct hint h, h_old;
+	int dev;
+
+	s = kms_test_server_create("vkms", 0, NULL);
+	kms_test_assert((dev = kms_test_open_device("vkms", NULL)) >= 0);
+	kms_test_assert(kms_test_bo_create(&bo, dev, WIDTH, HEIGHT, 32) == 0);
+
+	c = kms_test_client_create(s, 9);
+	h.client = c;
+	h.buffer = wl_kms_create_buffer(c->wl_kms, bo.fd, WIDTH, HEIGHT, bo.stride,
+					WL_KMS_FORMAT_XRGB8888, 0);
+	h.format = plane_format(s->fd, WL_KMS_FORMAT_XRGB8888);
+	kms_test_assert(h.format != 0);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	send_hint(&h, 1024, 768);
+	kms_test_assert(c->hints == 1);
+	kms_test_assert(c->hint_format == h.format);
+	kms_test_assert(c->hint_width == 1024 && c->hint_height == 768);
+
+	/* nothing new, nothing sent */
+	send_hint(&h, 1024, 768);
+	kms_test_assert(c->hints == 1);
+
+	send_hint(&h, 1920, 1080);
+	kms_test_assert(c->hints == 2);
+	kms_test_assert(c->hint_width == 1920 && c->hint_height == 1080);
+
+	/* clients before version 8 don't know the event */
+	old = kms_test_client_create(s, 7);
+	h_old = h;
+	h_old.client = old;
+	h_old.buffer = wl_kms_create_buffer(old->wl_kms, bo.fd, WIDTH, HEIGHT,
+					    bo.stride, WL_KMS_FORMAT_XRGB8888, 0);
+	kms_test_assert(kms_test_client_roundtrip(old) >= 0);
+	send_hint(&h_old, 1024, 768);
+	kms_test_assert(old->hints == 0);
+	kms_test_assert(kms_test_client_get_error(old) < 0);
+
+	kms_test_client_destroy(old);
+	kms_test_client_destroy(c);
+	kms_test_bo_destroy(&bo);
+	close(dev);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
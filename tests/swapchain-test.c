@@ -0,0 +1,183 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * The client side swapchain against the threaded server, on vgem: the
+ * wl_buffers of images are created once and reused as the compositor
+ * releases them, the ring grows when the client is starved and shrinks
+ * back once images stay spare, and a resize replaces the images.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "wayland-kms-client.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+
+/* acquires over which the swapchain drops a spare image */
+#define WINDOW 120
+
+struct release {
+	struct wl_client *client;
+	struct wl_buffer *buffer;
+	uint32_t handle;		/* of the import, as a check */
+};
+
+/* What the compositor does once it is done with a buffer */
+static void do_release(void *data)
+{
+	struct release *r = data;
+	struct wl_resource *resource;
+	struct wl_kms_buffer *buffer;
+
+	resource = wl_client_get_object(r->client,
+					wl_proxy_get_id((struct wl_proxy *)r->buffer));
+	kms_test_assert(resource);
+	buffer = wayland_kms_buffer_get(resource);
+	kms_test_assert(buffer);
+
+	r->handle = buffer->planes[0].handle;
+	wl_buffer_send_release(resource);
+}
+
+static void release(struct kms_test_server *s, struct wl_client *client,
+		    struct wl_display *display, struct wl_kms_image *image)
+{
+	struct release r = { .client = client, .buffer = image->buffer };
+
+	kms_test_server_call(s, do_release, &r);
+	kms_test_assert(r.handle);
+	kms_test_assert(wl_display_roundtrip(display) >= 0);
+}
+
+static uint64_t get_imports(struct kms_test_server *s)
+{
+	struct wl_kms_stats stats;
+
+	kms_test_server_get_stats(s, &stats);
+	return stats.import.misses + stats.import.hits;
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct wl_display *display;
+	struct wl_client *client;
+	struct wl_kms_connection *conn;
+	struct wl_kms_swapchain *swapchain;
+	struct wl_kms_image *images[5], *image;
+	struct wl_buffer *first;
+	struct wl_kms_stats stats;
+	uint64_t imports;
+	int i;
+
+	s = kms_test_server_create("vgem", 0, NULL);
+	display = kms_test_server_connect(s, &client);
+
+	conn = wayland_kms_connect(display);
+	kms_test_assert(conn);
+	kms_test_assert(wayland_kms_connection_get_fd(conn) >= 0);
+	kms_test_assert(wayland_kms_connection_get_device(conn));
+	kms_test_assert(wayland_kms_connection_has_format(conn, WL_KMS_FORMAT_XRGB8888));
+
+	swapchain = wayland_kms_swapchain_create(conn, WIDTH, HEIGHT,
+						 WL_KMS_FORMAT_XRGB8888, NULL);
+	kms_test_assert(swapchain);
+	kms_test_assert(wayland_kms_swapchain_set_depth(swapchain, 2, 4) == 0);
+
+	/* one image goes round and round */
+	image = wayland_kms_swapchain_acquire(swapchain);
+	kms_test_assert(image && image->buffer && image->data[0]);
+	first = image->buffer;
+	release(s, client, display, image);
+	imports = get_imports(s);
+
+	for (i = 0; i < 100; i++) {
+		image = wayland_kms_swapchain_acquire(swapchain);
+		kms_test_assert(image && image->buffer == first);
+		release(s, client, display, image);
+	}
+	kms_test_assert(wayland_kms_swapchain_get_depth(swapchain) == 1);
+	kms_test_assert(get_imports(s) == imports);
+
+	/* starved: up to max_images, then nothing until a release */
+	for (i = 0; i < 4; i++) {
+		images[i] = wayland_kms_swapchain_acquire(swapchain);
+		kms_test_assert(images[i]);
+	}
+	kms_test_assert(wayland_kms_swapchain_get_depth(swapchain) == 4);
+	kms_test_assert(!wayland_kms_swapchain_acquire(swapchain));
+
+	release(s, client, display, images[2]);
+	images[4] = wayland_kms_swapchain_acquire(swapchain);
+	kms_test_assert(images[4] == images[2]);
+	kms_test_assert(wayland_kms_swapchain_get_depth(swapchain) == 4);
+
+	for (i = 0; i < 4; i++)
+		release(s, client, display, images[i]);
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.buffers == 4);
+
+	/* spare images are dropped a window at a time, down to min_images */
+	for (i = 0; i < WINDOW * 4; i++) {
+		image = wayland_kms_swapchain_acquire(swapchain);
+		kms_test_assert(image);
+		wayland_kms_swapchain_cancel(swapchain, image);
+	}
+	kms_test_assert(wayland_kms_swapchain_get_depth(swapchain) == 2);
+	kms_test_assert(wl_display_roundtrip(display) >= 0);
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.buffers == 2);
+
+	/* a resize drops the free images now, and the busy ones on release */
+	image = wayland_kms_swapchain_acquire(swapchain);
+	kms_test_assert(wayland_kms_swapchain_resize(swapchain, WIDTH * 2, HEIGHT) == 0);
+	kms_test_assert(wayland_kms_swapchain_get_depth(swapchain) == 1);
+	release(s, client, display, image);
+	kms_test_assert(wayland_kms_swapchain_get_depth(swapchain) == 0);
+
+	image = wayland_kms_swapchain_acquire(swapchain);
+	kms_test_assert(image && image->width == WIDTH * 2);
+	release(s, client, display, image);
+
+	wayland_kms_swapchain_destroy(swapchain);
+	wayland_kms_disconnect(conn);
+	kms_test_assert(wl_display_roundtrip(display) >= 0);
+	kms_test_server_get_stats(s, &stats);
+	kms_test_assert(stats.buffers == 0);
+
+	wl_display_disconnect(display);
+	kms_test_assert(kms_test_server_wait_client(s, &client) == 0);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ * Clients outliving the wl_kms: once wayland_kms_uninit() ran, their
+ * requests must neither crash the server nor get them disconnected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "wayland-kms-client-protocol.h"
+#include "kms-test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+
+struct batch_result {
+	int created, failed;
+};
+
+static void batch_handle_created(void *data, struct wl_kms_buffer_batch *batch)
+{
+	struct batch_result *result = data;
+
+	result->created = 1;
+}
+
+static void batch_handle_failed(void *data, struct wl_kms_buffer_batch *batch)
+{
+	struct batch_result *result = data;
+
+	result->failed = 1;
+}
+
+static const struct wl_kms_buffer_batch_listener batch_listener = {
+	.created = batch_handle_created,
+	.failed = batch_handle_failed,
+};
+
+static void release_handle_fenced(void *data, struct wl_kms_buffer_release *r,
+				  int32_t fence)
+{
+	close(fence);
+}
+
+static void release_handle_immediate(void *data, struct wl_kms_buffer_release *r)
+{
+	int *immediate = data;
+
+	*immediate = 1;
+}
+
+static const struct wl_kms_buffer_release_listener release_listener = {
+	.fenced_release = release_handle_fenced,
+	.immediate_release = release_handle_immediate,
+};
+
+static void do_uninit(void *data)
+{
+	struct kms_test_server *s = data;
+
+	wayland_kms_uninit(s->kms);
+	s->kms = NULL;
+}
+
+struct get_buffer {
+	struct kms_test_client *client;
+	struct wl_buffer *buffer;
+	struct wl_kms_buffer *result;
+};
+
+static void do_get_buffer(void *data)
+{
+	struct get_buffer *gb = data;
+
+	gb->result = kms_test_client_get_buffer(gb->client, gb->buffer);
+}
+
+static struct wl_kms_buffer *get_buffer(struct kms_test_client *c,
+					struct wl_buffer *buffer)
+{
+	struct get_buffer gb = { .client = c, .buffer = buffer };
+
+	kms_test_server_call(c->server, do_get_buffer, &gb);
+	return gb.result;
+}
+
+static struct wl_kms_buffer_batch *
+create_batch(struct kms_test_client *c, struct batch_result *result)
+{
+	struct wl_kms_buffer_batch *batch;
+
+	batch = wl_kms_create_buffer_batch(c->wl_kms, WIDTH, HEIGHT,
+					   WL_KMS_FORMAT_XRGB8888);
+	wl_kms_buffer_batch_add_listener(batch, &batch_listener, result);
+	return batch;
+}
+
+static struct wl_buffer *batch_add(struct wl_kms_buffer_batch *batch,
+				   struct kms_test_bo *bo)
+{
+	return wl_kms_buffer_batch_add(batch, bo->fd, bo->stride,
+				       bo->fd, 0, bo->fd, 0);
+}
+
+static struct wl_buffer *create_buffer(struct kms_test_client *c,
+				       struct kms_test_bo *bo)
+{
+	return wl_kms_create_buffer(c->wl_kms, bo->fd, WIDTH, HEIGHT, bo->stride,
+				    WL_KMS_FORMAT_XRGB8888, 0);
+}
+
+int main(void)
+{
+	struct kms_test_server *s;
+	struct kms_test_client *c;
+	struct kms_test_bo bo;
+	struct wl_kms_buffer_batch *pending, *batch;
+	struct wl_kms_buffer_release *r;
+	struct wl_buffer *a, *b, *queued, *added, *allocated;
+	struct batch_result pending_result = { 0 }, batch_result = { 0 };
+	int immediate = 0;
+
+	s = kms_test_server_create(NULL, 0, NULL);
+	kms_test_assert(kms_test_bo_create(&bo, -1, WIDTH, HEIGHT, 32) == 0);
+	c = kms_test_client_create(s, 9);
+
+	/* a buffer, and another waiting in a batch, when the wl_kms goes */
+	a = create_buffer(c, &bo);
+	pending = create_batch(c, &pending_result);
+	queued = batch_add(pending, &bo);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_assert(get_buffer(c, a));
+
+	kms_test_server_call(s, do_uninit, s);
+	kms_test_assert(!get_buffer(c, a));
+
+	/* everything still goes through, with nothing behind it */
+	b = create_buffer(c, &bo);
+	wl_kms_set_acquire_fence(c->wl_kms, a, bo.fd);
+	r = wl_kms_get_release(c->wl_kms, a);
+	wl_kms_buffer_release_add_listener(r, &release_listener, &immediate);
+	allocated = wl_kms_allocate_buffer(c->wl_kms, WIDTH, HEIGHT,
+					   WL_KMS_FORMAT_XRGB8888, 0);
+	wl_kms_authenticate(c->wl_kms, 1);
+	wl_kms_buffer_batch_commit(pending);
+	batch = create_batch(c, &batch_result);
+	added = batch_add(batch, &bo);
+	wl_kms_buffer_batch_commit(batch);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+
+	kms_test_assert(kms_test_client_get_error(c) == -1);
+	kms_test_assert(!get_buffer(c, b));
+	kms_test_assert(!get_buffer(c, queued));
+	kms_test_assert(!get_buffer(c, added));
+	kms_test_assert(immediate);
+	kms_test_assert(c->allocation_failed == 1 && c->allocated == 0);
+	kms_test_assert(pending_result.failed && !pending_result.created);
+	kms_test_assert(batch_result.failed && !batch_result.created);
+	kms_test_assert(c->authenticated == 0);
+
+	/* and the client can clean up */
+	wl_kms_buffer_release_destroy(r);
+	wl_buffer_destroy(a);
+	wl_buffer_destroy(b);
+	wl_buffer_destroy(queued);
+	wl_buffer_destroy(added);
+	wl_buffer_destroy(allocated);
+	wl_kms_buffer_batch_destroy(pending);
+	wl_kms_buffer_batch_destroy(batch);
+	kms_test_assert(kms_test_client_roundtrip(c) >= 0);
+	kms_test_assert(kms_test_client_get_error(c) == -1);
+
+	kms_test_client_destroy(c);
+	kms_test_bo_destroy(&bo);
+	kms_test_server_destroy(s);
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+#
+# Converts a wayland-kms trace dump into Chrome trace event JSON, which
+# chrome://tracing and https://ui.perfetto.dev can open.
+#
+# Dumps come from wayland_kms_dump_trace(), or from SIGUSR2 with
+# WAYLAND_KMS_TRACE set. See src/wayland-kms-trace.c for the format.
+#
+# usage: wayland-kms-trace.py dump [output.json]
+
+import json
+import struct
+import sys
+
+HEADER = struct.Struct('=4sIII')
+ENTRY = struct.Struct('=QIiQQ')
+
+BIND, AUTH_START, AUTH_END, IMPORT, CREATE, DESTROY, ERROR, ALLOCATE = range(1, 9)
+
+ERRORS = {
+    0: 'invalid_format',
+    1: 'invalid_fd',
+    2: 'invalid_handle',
+    3: 'authentication_failed',
+    4: 'invalid_buffer',
+    5: 'invalid_size',
+}
+
+
+def fourcc(code):
+    return bytes((code >> s) & 0xff for s in (0, 8, 16, 24)).decode('ascii', 'replace')
+
+
+def convert(data):
+    magic, version, record_size, count = HEADER.unpack_from(data)
+    if magic != b'WKMT' or version != 1 or record_size != ENTRY.size:
+        raise ValueError('not a wayland-kms trace (version 1)')
+
+    events = []
+    for i in range(count):
+        time, event, error, arg0, arg1 = ENTRY.unpack_from(data, HEADER.size + i * ENTRY.size)
+        ev = {'pid': 0, 'tid': 0, 'ts': time / 1000.0}
+
+        if event in (CREATE, DESTROY):
+            ev.update(ph='X', name='create_buffer' if event == CREATE else 'destroy_buffer',
+                      ts=(time - arg1) / 1000.0, dur=arg1 / 1000.0,
+                      args={'format': fourcc(arg0)})
+        elif event == ALLOCATE:
+            ev.update(ph='X', name='allocate_buffer',
+                      ts=(time - arg1) / 1000.0, dur=arg1 / 1000.0,
+                      args={'format': fourcc(arg0), 'errno': error})
+        elif event == AUTH_START:
+            ev.update(ph='b', cat='auth', name='authenticate', id=arg0,
+                      args={'magic': arg0})
+        elif event == AUTH_END:
+            ev.update(ph='e', cat='auth', name='authenticate', id=arg0,
+                      args={'result': error})
+        elif event == IMPORT:
+            ev.update(ph='i', s='t', name='import',
+                      args={'fd': arg0, 'handle': arg1, 'errno': error})
+        elif event == BIND:
+            ev.update(ph='i', s='p', name='bind',
+                      args={'version': arg0, 'client_pid': arg1})
+        elif event == ERROR:
+            ev.update(ph='i', s='p', name='error',
+                      args={'error': ERRORS.get(arg0, arg0), 'errno': error})
+        else:
+            ev.update(ph='i', s='t', name='event %d' % event,
+                      args={'arg0': arg0, 'arg1': arg1, 'error': error})
+
+        events.append(ev)
+
+    return {'traceEvents': events, 'displayTimeUnit': 'ns'}
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit('usage: %s dump [output.json]' % sys.argv[0])
+
+    with open(sys.argv[1], 'rb') as f:
+        trace = convert(f.read())
+
+    if len(sys.argv) == 3:
+        with open(sys.argv[2], 'w') as f:
+            json.dump(trace, f)
+    else:
+        json.dump(trace, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()